@@ -0,0 +1,183 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Arenas.  Everything that a CIP_FILE_ARENA parse allocates is carved out of a
+ * chain of blocks that double in size, and is only freed when the whole chain
+ * is.  The arena's own header lives in its first block.  Allocation goes to
+ * the thread's current arena, which the parser sets while it works on a file.
+ */
+
+#define CIP_ARENA_ALIGN		__BIGGEST_ALIGNMENT__
+#define CIP_ARENA_MIN_BLOCK	((size_t)64 * 1024)
+#define CIP_ARENA_MAX_BLOCK	((size_t)64 * 1024 * 1024)
+
+struct cip_arena_block {
+	struct cip_arena_block *next;
+	unsigned char data[] __attribute__((aligned));
+};
+
+struct cip_arena {
+	struct cip_arena_block *blocks;	/* the first is being carved up */
+	unsigned char *next;
+	unsigned char *end;
+	size_t block_size;		/* of the next block */
+};
+
+__thread struct cip_arena *cip_arena_cur;
+
+static struct cip_arena_block *cip_arena_block_new(size_t size)
+{
+	struct cip_arena_block *block;
+
+	if (size > SIZE_MAX - sizeof *block)
+		return NULL;
+
+	block = malloc(sizeof *block + size);
+	if (block == NULL)
+		return NULL;
+
+	block->next = NULL;
+	return block;
+}
+
+/* Large allocations get a block of their own, behind the current one */
+static void *cip_arena_alloc_large(struct cip_arena *arena, size_t size)
+{
+	struct cip_arena_block *block;
+
+	block = cip_arena_block_new(size);
+	if (block == NULL)
+		return NULL;
+
+	block->next = arena->blocks->next;
+	arena->blocks->next = block;
+
+	return block->data;
+}
+
+static int cip_arena_grow(struct cip_arena *arena)
+{
+	struct cip_arena_block *block;
+
+	block = cip_arena_block_new(arena->block_size);
+	if (block == NULL)
+		return -1;
+
+	block->next = arena->blocks;
+	arena->blocks = block;
+	arena->next = block->data;
+	arena->end = block->data + arena->block_size;
+
+	if (arena->block_size < CIP_ARENA_MAX_BLOCK)
+		arena->block_size *= 2;
+
+	return 0;
+}
+
+void *cip_arena_alloc(struct cip_arena *arena, size_t size)
+{
+	void *p;
+
+	if (size > SIZE_MAX - CIP_ARENA_ALIGN)
+		return NULL;
+
+	size = (size + CIP_ARENA_ALIGN - 1) & ~(size_t)(CIP_ARENA_ALIGN - 1);
+
+	if (size > (size_t)(arena->end - arena->next)) {
+
+		if (arena->blocks != NULL && size > arena->block_size / 4)
+			return cip_arena_alloc_large(arena, size);
+
+		if (cip_arena_grow(arena) == -1)
+			return NULL;
+	}
+
+	p = arena->next;
+	arena->next += size;
+
+	return p;
+}
+
+struct cip_arena *cip_arena_new(cip_err_ctx *ctx)
+{
+	struct cip_arena tmp, *arena;
+
+	tmp.blocks = NULL;
+	tmp.next = NULL;
+	tmp.end = NULL;
+	tmp.block_size = CIP_ARENA_MIN_BLOCK;
+
+	arena = cip_arena_alloc(&tmp, sizeof *arena);
+	if (arena == NULL)
+		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+
+	*arena = tmp;
+	return arena;
+}
+
+void cip_arena_free(struct cip_arena *arena)
+{
+	struct cip_arena_block *block, *next;
+
+	/* The header is in one of the blocks */
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+}
+
+void cip_arena_adopt(struct cip_arena *arena, struct cip_arena *other)
+{
+	struct cip_arena_block *tail;
+
+	tail = other->blocks;
+	while (tail->next != NULL)
+		tail = tail->next;
+
+	tail->next = arena->blocks->next;
+	arena->blocks->next = other->blocks;
+}
+
+/*
+ * Public API
+ */
+
+void *cip_malloc(size_t size)
+{
+	void *p;
+
+	if (cip_arena_cur != NULL) {
+		p = cip_arena_alloc(cip_arena_cur, size);
+		if (p == NULL)
+			errno = ENOMEM;
+		return p;
+	}
+
+	return malloc(size);
+}
+
+void cip_free(void *ptr)
+{
+	if (cip_arena_cur == NULL)
+		free(ptr);
+}
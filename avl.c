@@ -18,19 +18,35 @@
 #include "libcip_p.h"
 
 #include <string.h>
+#include <limits.h>
 
+/*
+ * The recursion is replaced by rotating each left child up, which turns the
+ * tree into a list linked through the right pointers as it is freed.
+ */
 void cip_avl_free(struct cip_avl_node *tree,
 		  void (*free_fn)(struct cip_avl_node *node))
 {
-	if (tree->left)
-		cip_avl_free(tree->left, free_fn);
-	if (tree->right)
-		cip_avl_free(tree->right, free_fn);
+	struct cip_avl_node *node;
+
+	while (tree != NULL) {
+
+		if (tree->left != NULL) {
+			node = tree->left;
+			tree->left = node->right;
+			node->right = tree;
+			tree = node;
+			continue;
+		}
+
+		node = tree;
+		tree = tree->right;
 
-	if (free_fn != 0)
-		free_fn(tree);
+		if (free_fn != 0)
+			free_fn(node);
 
-	free(tree);
+		free(node);
+	}
 }
 
 static struct cip_avl_node *cip_avl_promote_right(struct cip_avl_node *left)
@@ -79,53 +95,66 @@ static struct cip_avl_node *cip_avl_promote_left(struct cip_avl_node *right)
 
 int cip_avl_add(struct cip_avl_node **tree_ptr, struct cip_avl_node *new)
 {
-	struct cip_avl_node *tree;
-	int ret;
+	struct cip_avl_node **path[CIP_AVL_MAX_HEIGHT];
+	struct cip_avl_node **link, *tree;
+	signed char dirs[CIP_AVL_MAX_HEIGHT];
+	int depth, ret;
 
 	new->left = NULL;
 	new->right = NULL;
 	new->skew = 0;
 
-	tree = *tree_ptr;
+	/* Find the insertion point, remembering the way down */
+	for (link = tree_ptr, depth = 0; *link != NULL; ++depth) {
 
-	if (tree == NULL) {
-		*tree_ptr = new;
-		return 1;
-	}
+		tree = *link;
+		ret = strcmp(new->name, tree->name);
+		if (ret == 0)
+			return -1;
 
-	ret = strcmp(new->name, tree->name);
-	if (ret < 0) {
+		path[depth] = link;
+		dirs[depth] = (ret < 0) ? -1 : 1;
+		link = (ret < 0) ? &tree->left : &tree->right;
+	}
 
-		ret = cip_avl_add(&tree->left, new);
-		if (ret < 1)
-			return ret;
+	*link = new;
 
-		if (--tree->skew > -2)
-			return -tree->skew;
+	/* Go back up while the subtree just below has grown taller */
+	while (depth-- > 0) {
 
-		if (tree->left->skew == 1)
-			tree->left = cip_avl_promote_right(tree->left);
+		link = path[depth];
+		tree = *link;
 
-		*tree_ptr = cip_avl_promote_left(tree);
-		return 0;
-	}
-	else if (ret > 0) {
-		ret = cip_avl_add(&tree->right, new);
-		if (ret < 1)
-			return ret;
+		if (dirs[depth] < 0) {
 
-		if (++tree->skew < 2)
-			return tree->skew;
+			if (--tree->skew > -2) {
+				if (tree->skew == 0)
+					return 0;
+				continue;
+			}
 
-		if (tree->right->skew == -1)
-			tree->right = cip_avl_promote_left(tree->right);
+			if (tree->left->skew == 1)
+				tree->left = cip_avl_promote_right(tree->left);
 
-		*tree_ptr = cip_avl_promote_right(tree);
-		return 0;
-	}
-	else {
-		return -1;
+			*link = cip_avl_promote_left(tree);
+			return 0;
+		}
+		else {
+			if (++tree->skew < 2) {
+				if (tree->skew == 0)
+					return 0;
+				continue;
+			}
+
+			if (tree->right->skew == -1)
+				tree->right = cip_avl_promote_left(tree->right);
+
+			*link = cip_avl_promote_right(tree);
+			return 0;
+		}
 	}
+
+	return 1;
 }
 
 struct cip_avl_node *cip_avl_get(struct cip_avl_node *tree, const char *name)
@@ -145,25 +174,53 @@ struct cip_avl_node *cip_avl_get(struct cip_avl_node *tree, const char *name)
 	return NULL;
 }
 
-static int cip_avl_foreach_int(struct cip_avl_node *tree,
-			       int (*callback_fn)(struct cip_avl_node *node,
-						  void *context),
-			       void *context)
+struct cip_avl_node *cip_avl_get_n(struct cip_avl_node *tree, const char *name,
+				   size_t len)
 {
-	if (tree->left) {
-		if (!cip_avl_foreach(tree->left, callback_fn, context))
-			return 0;
+	int ret;
+
+	/* name must not contain any NULs within len */
+
+	while (tree != NULL) {
+		ret = strncmp(name, tree->name, len);
+		if (ret == 0 && tree->name[len] != 0)
+			ret = -1;
+		if (ret < 0)
+			tree = tree->left;
+		else if (ret > 0)
+			tree = tree->right;
+		else
+			return tree;
 	}
 
-	if (!callback_fn(tree, context))
+	return NULL;
+}
+
+static int cip_avl_height(size_t count)
+{
+	if (count == 0)
 		return 0;
 
-	if (tree->right) {
-		if (!cip_avl_foreach(tree->right, callback_fn, context))
-			return 0;
-	}
+	return CHAR_BIT * sizeof(unsigned long) - __builtin_clzl(count);
+}
 
-	return 1;
+/* O(n); the recursion is only as deep as the tree it builds */
+struct cip_avl_node *cip_avl_build(struct cip_avl_node **nodes, size_t count)
+{
+	struct cip_avl_node *root;
+	size_t mid;
+
+	if (count == 0)
+		return NULL;
+
+	mid = count / 2;
+	root = nodes[mid];
+
+	root->left = cip_avl_build(nodes, mid);
+	root->right = cip_avl_build(nodes + mid + 1, count - mid - 1);
+	root->skew = cip_avl_height(count - mid - 1) - cip_avl_height(mid);
+
+	return root;
 }
 
 int cip_avl_foreach(struct cip_avl_node *tree,
@@ -171,8 +228,15 @@ int cip_avl_foreach(struct cip_avl_node *tree,
 				       void *context),
 		    void *context)
 {
-	if (tree == NULL)
-		return 1;
+	struct cip_avl_iter iter;
+	struct cip_avl_node *node;
+
+	cip_avl_iter_init(&iter, tree);
+
+	while ((node = cip_avl_iter_next(&iter)) != NULL) {
+		if (!callback_fn(node, context))
+			return 0;
+	}
 
-	return cip_avl_foreach_int(tree, callback_fn, context);
+	return 1;
 }
@@ -0,0 +1,880 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE	/* for asprintf and mkostemp */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Binary cache.  An image is a header followed by the nodes of a parsed file,
+ * laid out just as they are in memory, except that pointers are stored as
+ * offsets from the start of the image, and schema pointers as indexes into the
+ * schema's sections and options (in name order).  Loading maps the image
+ * privately and turns the offsets back into pointers.  Types that own memory
+ * copy it into the image with save_fn and fix up their pointers with load_fn.
+ *
+ * An image is only meaningful to the same version of libcip on the same
+ * platform.  Every offset is checked before it is followed, so a damaged image
+ * is rejected rather than read out of bounds.  Children are always written
+ * before their parents, so a loader that only follows offsets downwards can't
+ * be sent around in circles.
+ */
+
+#define CIP_CACHE_VERSION	3
+#define CIP_CACHE_BYTE_ORDER	0x01020304
+#define CIP_CACHE_TOP		((size_t)-1)	/* not in an instance */
+
+static const char cip_cache_magic[4] = { 'C', 'I', 'P', 'c' };
+
+struct cip_cache_hdr {
+	char magic[4];
+	uint16_t version;
+	uint16_t ptr_size;
+	uint32_t byte_order;
+	uint32_t reserved;
+	uint64_t source_hash;
+	uint64_t schema_hash;
+	uint64_t size;		/* of the whole image */
+	uint64_t sections;	/* offset of the section tree */
+};
+
+struct cip_cache_schema {
+	struct cip_schema_order order;
+	uint64_t hash;
+	int cacheable;		/* every type that owns memory can save it */
+};
+
+struct cip_cache_writer {
+	const struct cip_schema_order *order;
+	unsigned char *buf;
+	size_t len;
+	size_t size;
+};
+
+struct cip_cache_loader {
+	const struct cip_schema_order *order;
+	char *base;
+	size_t size;
+};
+
+/*
+ * Schema hashing
+ */
+
+static uint64_t cip_cache_hash_str(const char *s, uint64_t hash)
+{
+	return cip_hash(s, strlen(s) + 1, hash);
+}
+
+/* Defaults are hashed as text, since they may point elsewhere */
+static int cip_cache_hash_default(const cip_opt_schema *opt, uint64_t *hash)
+{
+	cip_err_ctx err_ctx;
+	char buf[256], *text;
+	int len;
+
+	cip_err_ctx_init(&err_ctx);
+
+	len = opt->type->format_fn(&err_ctx, buf, sizeof buf,
+				   opt->default_value);
+	if (len < 0) {
+		cip_err_ctx_fini(&err_ctx);
+		return -1;
+	}
+
+	if ((size_t)len < sizeof buf) {
+		*hash = cip_hash(buf, len, *hash);
+		cip_err_ctx_fini(&err_ctx);
+		return 0;
+	}
+
+	text = malloc(len + 1);
+	if (text == NULL ||
+		opt->type->format_fn(&err_ctx, text, len + 1,
+				     opt->default_value) != len) {
+		free(text);
+		cip_err_ctx_fini(&err_ctx);
+		return -1;
+	}
+
+	*hash = cip_hash(text, len, *hash);
+	free(text);
+	cip_err_ctx_fini(&err_ctx);
+	return 0;
+}
+
+static void cip_cache_schema_hash(struct cip_cache_schema *cs)
+{
+	const struct cip_schema_order *order;
+	const cip_opt_schema *opt;
+	const cip_opt_type *type;
+	uint64_t hash, n;
+	size_t s, o, end;
+
+	order = &cs->order;
+	hash = 0;
+	cs->cacheable = 1;
+
+	for (s = 0; s < order->num_sects; ++s) {
+
+		hash = cip_cache_hash_str(order->sects[s]->node.name, hash);
+		hash = cip_hash(&order->sects[s]->flags, 1, hash);
+		end = order->first_opt[s + 1];
+		n = end - order->first_opt[s];
+		hash = cip_hash(&n, sizeof n, hash);
+
+		for (o = order->first_opt[s]; o < end; ++o) {
+
+			opt = order->opts[o];
+			type = opt->type;
+
+			hash = cip_cache_hash_str(opt->node.name, hash);
+			hash = cip_cache_hash_str(type->name, hash);
+			n = type->size;
+			hash = cip_hash(&n, sizeof n, hash);
+			hash = cip_hash(&opt->flags, 1, hash);
+
+			if ((opt->flags & CIP_OPT_DEFAULT) &&
+				cip_cache_hash_default(opt, &hash) == -1) {
+				cs->cacheable = 0;
+			}
+
+			if (type->free_fn != 0 &&
+				(type->save_fn == 0 || type->load_fn == 0)) {
+				cs->cacheable = 0;
+			}
+		}
+	}
+
+	cs->hash = hash;
+}
+
+static int cip_cache_schema_init(cip_err_ctx *ctx, struct cip_cache_schema *cs,
+				 const cip_file_schema *schema)
+{
+	if (cip_schema_order_init(ctx, &cs->order, schema) == -1)
+		return -1;
+
+	cip_cache_schema_hash(cs);
+
+	return 0;
+}
+
+/* nodes must be in name order, and name must be one of them */
+static size_t cip_cache_find(const void *const *nodes, size_t count,
+			     const char *name)
+{
+	const struct cip_avl_node *node;
+	size_t low, mid;
+	int cmp;
+
+	low = 0;
+
+	while (1) {
+
+		mid = low + count / 2;
+		node = nodes[mid];
+
+		cmp = strcmp(name, node->name);
+		if (cmp == 0)
+			return mid;
+
+		if (cmp < 0) {
+			count /= 2;
+		}
+		else {
+			low = mid + 1;
+			count -= count / 2 + 1;
+		}
+	}
+}
+
+/*
+ * Writing an image
+ */
+
+static size_t cip_cache_alloc(cip_err_ctx *ctx, cip_cache_writer *writer,
+			      size_t size, size_t align)
+{
+	unsigned char *new_buf;
+	size_t offset, new_size;
+
+	offset = (writer->len + align - 1) & ~(align - 1);
+
+	if (offset + size > writer->size) {
+
+		new_size = (writer->size != 0) ? writer->size * 2 : 4096;
+		while (new_size < offset + size)
+			new_size *= 2;
+
+		new_buf = realloc(writer->buf, new_size);
+		if (new_buf == NULL) {
+			cip_err(ctx, "%s", strerror(ENOMEM));
+			return 0;
+		}
+
+		writer->buf = new_buf;
+		writer->size = new_size;
+	}
+
+	memset(writer->buf + writer->len, 0, offset + size - writer->len);
+	writer->len = offset + size;
+
+	return offset;
+}
+
+/* Any array's size is a multiple of its elements' alignment */
+static size_t cip_cache_align(size_t size)
+{
+	size_t align;
+
+	align = size & -size;
+	if (align == 0 || align > __BIGGEST_ALIGNMENT__)
+		align = __BIGGEST_ALIGNMENT__;
+
+	return align;
+}
+
+size_t cip_cache_put(cip_err_ctx *ctx, cip_cache_writer *writer,
+		     const void *data, size_t size)
+{
+	size_t offset;
+
+	offset = cip_cache_alloc(ctx, writer, size, cip_cache_align(size));
+	if (offset != 0)
+		memcpy(writer->buf + offset, data, size);
+
+	return offset;
+}
+
+static int cip_cache_save_values(cip_err_ctx *ctx, cip_cache_writer *writer,
+				 const cip_ini_value *value, size_t s,
+				 size_t *offset)
+{
+	const struct cip_schema_order *order;
+	size_t left, right, index;
+	const cip_opt_type *type;
+	cip_ini_value *image;
+	void *copy;
+
+	if (value == NULL) {
+		*offset = 0;
+		return 0;
+	}
+
+	if (cip_cache_save_values(ctx, writer,
+				  (cip_ini_value *)value->node.left, s,
+				  &left) == -1 ||
+		cip_cache_save_values(ctx, writer,
+				      (cip_ini_value *)value->node.right, s,
+				      &right) == -1) {
+		return -1;
+	}
+
+	order = writer->order;
+	index = order->first_opt[s] +
+		cip_cache_find((const void **)order->opts + order->first_opt[s],
+			       order->first_opt[s + 1] - order->first_opt[s],
+			       value->node.name);
+
+	type = value->schema->type;
+	copy = NULL;
+
+	if (type->save_fn != 0) {
+
+		copy = malloc(type->size);
+		if (copy == NULL)
+			return cip_err_int(ctx, "%s", strerror(ENOMEM));
+
+		memcpy(copy, value->value, type->size);
+
+		if (type->save_fn(ctx, writer, copy, value->value) == -1) {
+			free(copy);
+			return -1;
+		}
+	}
+
+	*offset = cip_cache_alloc(ctx, writer, sizeof *value + type->size,
+				  __alignof__(*value));
+	if (*offset == 0) {
+		free(copy);
+		return -1;
+	}
+
+	image = (cip_ini_value *)(writer->buf + *offset);
+
+	cip_cache_ref(&image->node.left, left);
+	cip_cache_ref(&image->node.right, right);
+	image->node.skew = value->node.skew;
+	cip_cache_ref(&image->schema, index);
+	memcpy(image->value, (copy != NULL) ? copy : value->value, type->size);
+
+	free(copy);
+	return 0;
+}
+
+/* s is the section schema index of an instance tree, or CIP_CACHE_TOP */
+static int cip_cache_save_sects(cip_err_ctx *ctx, cip_cache_writer *writer,
+				const cip_ini_sect *sect, size_t s,
+				size_t *offset)
+{
+	size_t left, right, name, index, children;
+	const struct cip_schema_order *order;
+	cip_ini_sect *image;
+	unsigned num_slots;
+	int ret;
+
+	if (sect == NULL) {
+		*offset = 0;
+		return 0;
+	}
+
+	if (cip_cache_save_sects(ctx, writer, (cip_ini_sect *)sect->node.left,
+				 s, &left) == -1 ||
+		cip_cache_save_sects(ctx, writer,
+				     (cip_ini_sect *)sect->node.right, s,
+				     &right) == -1) {
+		return -1;
+	}
+
+	order = writer->order;
+
+	if (s == CIP_CACHE_TOP) {
+
+		name = 0;
+		index = cip_cache_find((const void **)order->sects,
+				       order->num_sects, sect->node.name);
+
+		if (sect->schema->flags & CIP_SECT_MULTIPLE) {
+			ret = cip_cache_save_sects(ctx, writer, sect->instances,
+						   index, &children);
+		}
+		else {
+			ret = cip_cache_save_values(ctx, writer, sect->values,
+						    index, &children);
+		}
+	}
+	else {
+		index = s;
+		name = cip_cache_put(ctx, writer, sect->node.name,
+				     strlen(sect->node.name) + 1);
+		if (name == 0)
+			return -1;
+
+		ret = cip_cache_save_values(ctx, writer, sect->values, index,
+					    &children);
+	}
+
+	if (ret == -1)
+		return -1;
+
+	/* The loader fills in the slots */
+	if (s == CIP_CACHE_TOP && (sect->schema->flags & CIP_SECT_MULTIPLE))
+		num_slots = 0;
+	else
+		num_slots = sect->schema->num_opts;
+
+	*offset = cip_cache_alloc(ctx, writer, sizeof *sect +
+					num_slots * sizeof *sect->slots,
+				  __alignof__(*sect));
+	if (*offset == 0)
+		return -1;
+
+	image = (cip_ini_sect *)(writer->buf + *offset);
+
+	cip_cache_ref(&image->node.name, name);
+	cip_cache_ref(&image->node.left, left);
+	cip_cache_ref(&image->node.right, right);
+	image->node.skew = sect->node.skew;
+	cip_cache_ref(&image->schema, index);
+	cip_cache_ref(&image->values, children);
+	image->line = sect->line;
+	image->hash = sect->hash;
+	image->num_slots = num_slots;
+
+	return 0;
+}
+
+static int cip_cache_write(cip_err_ctx *ctx, const char *cache_name,
+			   const void *buf, size_t len)
+{
+	const char *p;
+	char *tmp_name;
+	ssize_t ret;
+	int fd;
+
+	if (asprintf(&tmp_name, "%s.XXXXXX", cache_name) == -1)
+		return cip_err_int(ctx, "%s", strerror(ENOMEM));
+
+	fd = mkostemp(tmp_name, O_CLOEXEC);
+	if (fd == -1) {
+		cip_err(ctx, "%s: %m", tmp_name);
+		free(tmp_name);
+		return -1;
+	}
+
+	for (p = buf; len != 0; p += ret, len -= ret) {
+
+		ret = write(fd, p, len);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			cip_err(ctx, "%s: %m", tmp_name);
+			break;
+		}
+	}
+
+	if (close(fd) == -1 && len == 0) {
+		cip_err(ctx, "%s: %m", tmp_name);
+		len = 1;
+	}
+
+	/* Replace the old image atomically; anyone using it keeps its inode */
+	if (len != 0 || rename(tmp_name, cache_name) == -1) {
+		if (len == 0)
+			cip_err(ctx, "%s: %m", cache_name);
+		unlink(tmp_name);
+		free(tmp_name);
+		return -1;
+	}
+
+	free(tmp_name);
+	return 0;
+}
+
+static int cip_cache_save(cip_err_ctx *ctx, const cip_ini_file *file,
+			  const struct cip_cache_schema *cs,
+			  uint64_t source_hash, const char *cache_name)
+{
+	struct cip_cache_writer writer;
+	struct cip_cache_hdr *hdr;
+	size_t sections;
+	int ret;
+
+	writer.order = &cs->order;
+	writer.buf = NULL;
+	writer.len = 0;
+	writer.size = 0;
+
+	/* The header is at offset 0, so no real offset is ever 0 */
+	if (cip_cache_alloc(ctx, &writer, sizeof *hdr,
+			    __alignof__(*hdr)) != 0 || writer.buf == NULL) {
+		return -1;
+	}
+
+	if (cip_cache_save_sects(ctx, &writer, file->sections, CIP_CACHE_TOP,
+				 &sections) == -1) {
+		free(writer.buf);
+		return -1;
+	}
+
+	hdr = (struct cip_cache_hdr *)writer.buf;
+	memcpy(hdr->magic, cip_cache_magic, sizeof hdr->magic);
+	hdr->version = CIP_CACHE_VERSION;
+	hdr->ptr_size = sizeof(void *);
+	hdr->byte_order = CIP_CACHE_BYTE_ORDER;
+	hdr->source_hash = source_hash;
+	hdr->schema_hash = cs->hash;
+	hdr->size = writer.len;
+	hdr->sections = sections;
+
+	ret = cip_cache_write(ctx, cache_name, writer.buf, writer.len);
+	free(writer.buf);
+	return ret;
+}
+
+/*
+ * Loading an image
+ */
+
+__attribute__((always_inline))
+static inline void cip_cache_reloc(void *ptr, char *base)
+{
+	*(char **)ptr = base + *(uintptr_t *)ptr;
+}
+
+/* Children are below parents in the image, so limit stops any cycles */
+static void *cip_cache_node(const struct cip_cache_loader *loader,
+			    size_t offset, size_t size, size_t align,
+			    size_t limit)
+{
+	if (offset >= limit || offset % align != 0 ||
+		size > loader->size - offset) {
+		return NULL;
+	}
+
+	return loader->base + offset;
+}
+
+static int cip_cache_load_values(const struct cip_cache_loader *loader,
+				 cip_ini_sect *sect, void *ptr, size_t s,
+				 size_t limit)
+{
+	const struct cip_schema_order *order;
+	const cip_opt_schema *opt;
+	cip_ini_value *value;
+	size_t offset, index;
+
+	offset = *(uintptr_t *)ptr;
+	if (offset == 0)
+		return 0;
+
+	value = cip_cache_node(loader, offset, sizeof *value,
+			       __alignof__(*value), limit);
+	if (value == NULL)
+		return -1;
+
+	order = loader->order;
+	index = (uintptr_t)value->schema;
+	if (index < order->first_opt[s] || index >= order->first_opt[s + 1])
+		return -1;
+
+	opt = order->opts[index];
+	if (opt->type->size > loader->size - offset - sizeof *value ||
+		opt->slot >= sect->num_slots ||
+		sect->slots[opt->slot] != NULL) {
+		return -1;
+	}
+
+	sect->slots[opt->slot] = value;
+
+	value->node.name = opt->node.name;
+	value->schema = opt;
+	value->post_parse_done = 0;
+
+	if (opt->type->load_fn != 0 &&
+		opt->type->load_fn(loader, value->value) == -1) {
+		return -1;
+	}
+
+	if (cip_cache_load_values(loader, sect, &value->node.left, s,
+				  offset) == -1 ||
+		cip_cache_load_values(loader, sect, &value->node.right, s,
+				      offset) == -1) {
+		return -1;
+	}
+
+	cip_cache_reloc(ptr, loader->base);
+	return 0;
+}
+
+/* Checks that the section at offset has room for num_slots and clears them */
+static int cip_cache_slots(const struct cip_cache_loader *loader,
+			   cip_ini_sect *sect, size_t offset,
+			   unsigned num_slots)
+{
+	size_t size;
+
+	size = num_slots * sizeof *sect->slots;
+	if (sect->num_slots != num_slots ||
+		size > loader->size - offset - sizeof *sect) {
+		return -1;
+	}
+
+	memset(sect->slots, 0, size);
+	return 0;
+}
+
+static int cip_cache_load_sects(const struct cip_cache_loader *loader,
+				void *ptr, size_t s, size_t limit)
+{
+	const struct cip_schema_order *order;
+	const cip_sect_schema *schema;
+	size_t offset, index, name;
+	cip_ini_sect *sect;
+	int ret;
+
+	offset = *(uintptr_t *)ptr;
+	if (offset == 0)
+		return 0;
+
+	sect = cip_cache_node(loader, offset, sizeof *sect, __alignof__(*sect),
+			      limit);
+	if (sect == NULL)
+		return -1;
+
+	order = loader->order;
+	index = (uintptr_t)sect->schema;
+	name = (uintptr_t)sect->node.name;
+
+	if (s == CIP_CACHE_TOP) {
+
+		if (index >= order->num_sects || name != 0)
+			return -1;
+
+		schema = order->sects[index];
+		sect->node.name = schema->node.name;
+
+		if (schema->flags & CIP_SECT_MULTIPLE) {
+			/* Can't have been created without an instance */
+			if (sect->instances == NULL || sect->num_slots != 0)
+				return -1;
+			ret = cip_cache_load_sects(loader, &sect->instances,
+						   index, offset);
+		}
+		else if (cip_cache_slots(loader, sect, offset,
+					 schema->num_opts) == -1) {
+			return -1;
+		}
+		else {
+			ret = cip_cache_load_values(loader, sect,
+						    &sect->values, index,
+						    offset);
+		}
+	}
+	else {
+		if (index != s || name == 0 || name >= offset ||
+			memchr(loader->base + name, 0, offset - name) == NULL) {
+			return -1;
+		}
+
+		schema = order->sects[index];
+		if (cip_cache_slots(loader, sect, offset,
+				    schema->num_opts) == -1) {
+			return -1;
+		}
+
+		cip_cache_reloc(&sect->node.name, loader->base);
+		ret = cip_cache_load_values(loader, sect, &sect->values, index,
+					    offset);
+	}
+
+	if (ret == -1)
+		return -1;
+
+	sect->schema = schema;
+	sect->flags = 0;
+	sect->index = NULL;
+
+	if (cip_cache_load_sects(loader, &sect->node.left, s, offset) == -1 ||
+		cip_cache_load_sects(loader, &sect->node.right, s,
+				     offset) == -1) {
+		return -1;
+	}
+
+	cip_cache_reloc(ptr, loader->base);
+	return 0;
+}
+
+int cip_cache_load_data(const cip_cache_loader *loader, void *ptr,
+			size_t size)
+{
+	size_t offset;
+
+	offset = *(uintptr_t *)ptr;
+	if (offset == 0 || offset > loader->size ||
+		size > loader->size - offset ||
+		offset % cip_cache_align(size) != 0) {
+		return -1;
+	}
+
+	cip_cache_reloc(ptr, loader->base);
+	return 0;
+}
+
+int cip_cache_load_str(const cip_cache_loader *loader, void *ptr)
+{
+	size_t offset;
+
+	offset = *(uintptr_t *)ptr;
+	if (offset == 0 || offset >= loader->size ||
+		memchr(loader->base + offset, 0,
+		       loader->size - offset) == NULL) {
+		return -1;
+	}
+
+	cip_cache_reloc(ptr, loader->base);
+	return 0;
+}
+
+static int cip_cache_hdr_ok(const struct cip_cache_hdr *hdr, size_t size,
+			    const struct cip_cache_schema *cs,
+			    uint64_t source_hash)
+{
+	return memcmp(hdr->magic, cip_cache_magic, sizeof hdr->magic) == 0 &&
+		hdr->version == CIP_CACHE_VERSION &&
+		hdr->ptr_size == sizeof(void *) &&
+		hdr->byte_order == CIP_CACHE_BYTE_ORDER &&
+		hdr->source_hash == source_hash &&
+		hdr->schema_hash == cs->hash &&
+		hdr->size == size;
+}
+
+/* Any failure just means the text must be parsed */
+static cip_ini_file *cip_cache_load(const char *cache_name,
+				    const cip_file_schema *schema,
+				    const struct cip_cache_schema *cs,
+				    uint64_t source_hash)
+{
+	struct cip_cache_loader loader;
+	struct cip_cache_hdr *hdr;
+	cip_ini_sect *sections;
+	cip_ini_file *file;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(cache_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		(size_t)st.st_size < sizeof *hdr) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+		   0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	hdr = map;
+	loader.order = &cs->order;
+	loader.base = map;
+	loader.size = st.st_size;
+
+	if (!cip_cache_hdr_ok(hdr, st.st_size, cs, source_hash)) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	sections = (cip_ini_sect *)(uintptr_t)hdr->sections;
+	if (cip_cache_load_sects(&loader, &sections, CIP_CACHE_TOP,
+				 st.st_size) == -1) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	file = malloc(sizeof *file);
+	if (file == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	file->schema = schema;
+	file->sections = sections;
+	file->image = map;
+	file->image_size = st.st_size;
+	file->arena = NULL;
+	file->flags = 0;
+	file->source = NULL;
+	file->source_size = 0;
+	file->text = NULL;
+	file->index = NULL;
+
+	return file;
+}
+
+/*
+ * Public API
+ */
+
+cip_ini_file *cip_parse_cached(cip_err_ctx *err_ctx, const char *file_name,
+			       const char *cache_name,
+			       const cip_file_schema *schema,
+			       int (*warning_fn)(const char *warn_msg))
+{
+	struct cip_cache_schema cs;
+	cip_err_ctx save_err;
+	uint64_t source_hash;
+	cip_ini_file *file;
+	struct stat st;
+	size_t len;
+	void *map;
+	int fd;
+
+	fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return cip_err_ptr(err_ctx, "%s: %m", file_name);
+
+	if (fstat(fd, &st) == -1) {
+		cip_err(err_ctx, "%s: %m", file_name);
+		close(fd);
+		return NULL;
+	}
+
+	/* Can't hash a pipe without reading it */
+	if (!S_ISREG(st.st_mode)) {
+		close(fd);
+		return cip_parse_mmap(err_ctx, file_name, schema, warning_fn);
+	}
+
+	len = st.st_size;
+
+	if (len == 0) {
+		map = NULL;
+	}
+	else {
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			cip_err(err_ctx, "%s: %m", file_name);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	close(fd);
+
+	if (cip_cache_schema_init(err_ctx, &cs, schema) == -1) {
+		if (map != NULL)
+			munmap(map, len);
+		return NULL;
+	}
+
+	source_hash = cip_hash((map != NULL) ? map : "", len, 0);
+
+	if (cs.cacheable) {
+
+		file = cip_cache_load(cache_name, schema, &cs, source_hash);
+		if (file != NULL) {
+			if (map != NULL)
+				munmap(map, len);
+			cip_schema_order_fini(&cs.order);
+			return cip_parse_loaded(err_ctx, file, file_name,
+						warning_fn);
+		}
+	}
+
+	file = cip_parse_buffer(err_ctx, map, len, file_name, schema,
+				warning_fn);
+
+	if (file != NULL && cs.cacheable) {
+		cip_err_ctx_init(&save_err);
+		cip_cache_save(&save_err, file, &cs, source_hash, cache_name);
+		cip_err_ctx_fini(&save_err);
+	}
+
+	if (map != NULL)
+		cip_parse_unmap(file, map, len);
+
+	cip_schema_order_fini(&cs.order);
+
+	return file;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Compact lookup.  Each tree of a parsed file is copied into an array in
+ * Eytzinger (breadth-first) order, so the children of entry i are entries 2i
+ * and 2i + 1.  Every index in a file lives in one cache-line aligned block, and
+ * each index starts on a cache line, so entries 4i to 4i + 3 (two levels down)
+ * share a line that can be prefetched.  Entries hold the 8 bytes of the name
+ * that follow the prefix common to the whole index (e.g. "backend-server-") as
+ * a big-endian integer, which compares just like strcmp(), so nodes are only
+ * touched to check longer names.  The trees themselves are left alone for
+ * iteration.
+ */
+
+#define CIP_INDEX_ALIGN		64
+
+static uint64_t cip_index_key(const char *name)
+{
+	uint64_t key;
+	int i;
+
+	key = 0;
+
+	for (i = 0; i < 8 && name[i] != 0; ++i)
+		key |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+
+	return key;
+}
+
+static size_t cip_index_count(struct cip_avl_node *tree)
+{
+	struct cip_avl_iter iter;
+	size_t count;
+
+	cip_avl_iter_init(&iter, tree);
+
+	for (count = 0; cip_avl_iter_next(&iter) != NULL; ++count);
+
+	return count;
+}
+
+/* Bytes needed by an index of count entries (plus the header) */
+static size_t cip_index_size(size_t count)
+{
+	size_t size;
+
+	size = (count + 1) * sizeof(struct cip_ini_index);
+
+	return (size + CIP_INDEX_ALIGN - 1) & ~(size_t)(CIP_INDEX_ALIGN - 1);
+}
+
+/* Fills the index at *next with tree's nodes, and moves *next past it */
+static struct cip_ini_index *cip_index_fill(char **next,
+					    struct cip_avl_node *tree)
+{
+	struct cip_avl_node *node, *first, *last;
+	struct cip_ini_index *index;
+	struct cip_avl_iter iter;
+	size_t count, prefix_len, i;
+
+	if (tree == NULL)
+		return NULL;
+
+	count = cip_index_count(tree);
+	index = (struct cip_ini_index *)*next;
+	*next += cip_index_size(count);
+
+	/* What the first and last names share, all of them do */
+	for (first = tree; first->left != NULL; first = first->left);
+	for (last = tree; last->right != NULL; last = last->right);
+
+	for (prefix_len = 0; first->name[prefix_len] != 0; ++prefix_len) {
+		if (first->name[prefix_len] != last->name[prefix_len])
+			break;
+	}
+
+	index[0].count = count;
+	index[0].prefix_len = prefix_len;
+	index[0].node = first;
+
+	/* The tree's in-order walk, matched with the array's */
+	for (i = 1; 2 * i <= count; i *= 2);
+
+	cip_avl_iter_init(&iter, tree);
+
+	while ((node = cip_avl_iter_next(&iter)) != NULL) {
+
+		index[i].key = cip_index_key(node->name + prefix_len);
+		index[i].node = node;
+
+		if (2 * i + 1 <= count) {
+			for (i = 2 * i + 1; 2 * i <= count; i *= 2);
+		}
+		else {
+			while (i & 1)
+				i >>= 1;
+			i >>= 1;
+		}
+	}
+
+	return index;
+}
+
+/*
+ * Fills (or if next is NULL, just sizes) the indexes of a section and, if it
+ * has any, its instances.
+ */
+static size_t cip_compact_sect(char **next, cip_ini_sect *sect, int is_inst)
+{
+	struct cip_avl_node *tree, *node;
+	struct cip_avl_iter iter;
+	size_t size;
+
+	/* Values or instances */
+	tree = (struct cip_avl_node *)sect->values;
+	if (tree == NULL)
+		return 0;
+
+	size = cip_index_size(cip_index_count(tree));
+	if (next != NULL)
+		sect->index = cip_index_fill(next, tree);
+
+	if (is_inst || !(sect->schema->flags & CIP_SECT_MULTIPLE))
+		return size;
+
+	cip_avl_iter_init(&iter, tree);
+
+	while ((node = cip_avl_iter_next(&iter)) != NULL)
+		size += cip_compact_sect(next, (cip_ini_sect *)node, 1);
+
+	return size;
+}
+
+static size_t cip_compact_file(char **next, cip_ini_file *file)
+{
+	struct cip_avl_node *tree, *node;
+	struct cip_avl_iter iter;
+	size_t size;
+
+	tree = (struct cip_avl_node *)file->sections;
+
+	size = cip_index_size(cip_index_count(tree));
+	if (next != NULL)
+		file->index = cip_index_fill(next, tree);
+
+	cip_avl_iter_init(&iter, tree);
+
+	while ((node = cip_avl_iter_next(&iter)) != NULL)
+		size += cip_compact_sect(next, (cip_ini_sect *)node, 0);
+
+	return size;
+}
+
+/*
+ * Internal API
+ */
+
+struct cip_avl_node *cip_index_get(const struct cip_ini_index *index,
+				   const char *name)
+{
+	const struct cip_ini_index *ent;
+	size_t count, prefix_len, i;
+	uint64_t key;
+	int ret;
+
+	count = index[0].count;
+	prefix_len = index[0].prefix_len;
+
+	if (strncmp(name, index[0].node->name, prefix_len) != 0)
+		return NULL;
+
+	name += prefix_len;
+	key = cip_index_key(name);
+
+	for (i = 1; i <= count; i = 2 * i + (ret < 0)) {
+
+		__builtin_prefetch(index + 4 * i);
+
+		ent = index + i;
+
+		if (ent->key == key) {
+
+			/* Names that match so far are either done or go on */
+			if ((key & 0xff) == 0)
+				return ent->node;
+
+			ret = strcmp(ent->node->name + prefix_len + 8,
+				     name + 8);
+			if (ret == 0)
+				return ent->node;
+		}
+		else {
+			ret = (ent->key < key) ? -1 : 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Public API
+ */
+
+int cip_ini_file_compact(cip_err_ctx *ctx, cip_ini_file *file)
+{
+	char *block, *next;
+
+	if (file->index != NULL || file->sections == NULL)
+		return 0;
+
+	block = aligned_alloc(CIP_INDEX_ALIGN, cip_compact_file(NULL, file));
+	if (block == NULL)
+		return cip_err_int(ctx, "%s", strerror(ENOMEM));
+
+	/* The file's index comes first, so freeing it frees the block */
+	next = block;
+	cip_compact_file(&next, file);
+
+	return 0;
+}
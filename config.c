@@ -0,0 +1,235 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE	/* for syscall() */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+/*
+ * Hot-swappable configuration.  The current file is published through an
+ * atomic pointer, and each reader announces the file it is using in a hazard
+ * slot of its own (on its own cache line), then checks that the file is still
+ * current.  After swapping in a new file, the publisher waits until no slot
+ * holds the old one, and frees it.
+ *
+ * A reader's announcement must be visible before it checks the pointer again,
+ * which normally takes a sequentially consistent store (in effect, a full
+ * fence) on every read; the publisher's exchange of the pointer and its loads
+ * of the slots are sequentially consistent too.  Where the kernel supports
+ * it, the publisher issues the fence on the readers' behalf with membarrier(),
+ * so readers only need a compiler barrier.  (Neither path uses a thread fence,
+ * which ThreadSanitizer can't model.)
+ */
+
+#define CIP_CONFIG_ALIGN	64
+
+struct cip_config_reader {
+	const cip_ini_file *hazard;
+	struct cip_config_reader *next;
+	cip_config *config;
+	int in_use;
+} __attribute__((aligned(CIP_CONFIG_ALIGN)));
+
+struct cip_config {
+	/* All that readers touch */
+	cip_ini_file *file;
+	int fence;			/* no membarrier() */
+
+	/* Publisher's */
+	pthread_mutex_t lock __attribute__((aligned(CIP_CONFIG_ALIGN)));
+	struct cip_config_reader *readers;
+};
+
+static pthread_once_t cip_membarrier_once = PTHREAD_ONCE_INIT;
+static int cip_membarrier_ok;
+
+static void cip_membarrier_init(void)
+{
+	cip_membarrier_ok = syscall(SYS_membarrier,
+				    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED,
+				    0, 0) == 0;
+}
+
+/*
+ * Makes every reader's announcement visible to the publisher.  Without
+ * membarrier(), the readers' own stores already have.
+ */
+static void cip_config_barrier(const cip_config *config)
+{
+	if (!config->fence)
+		syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+}
+
+static int cip_config_in_use(const cip_config *config,
+			     const cip_ini_file *file)
+{
+	const struct cip_config_reader *reader;
+
+	for (reader = config->readers; reader != NULL; reader = reader->next) {
+		if (__atomic_load_n(&reader->hazard, __ATOMIC_SEQ_CST) == file)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Public API
+ */
+
+cip_config *cip_config_new(cip_err_ctx *ctx, cip_ini_file *file)
+{
+	cip_config *config;
+
+	config = aligned_alloc(CIP_CONFIG_ALIGN, sizeof *config);
+	if (config == NULL)
+		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+
+	pthread_once(&cip_membarrier_once, cip_membarrier_init);
+
+	config->file = file;
+	config->fence = !cip_membarrier_ok;
+	pthread_mutex_init(&config->lock, NULL);
+	config->readers = NULL;
+
+	return config;
+}
+
+void cip_config_free(cip_config *config)
+{
+	struct cip_config_reader *reader, *next;
+
+	for (reader = config->readers; reader != NULL; reader = next) {
+		next = reader->next;
+		free(reader);
+	}
+
+	if (config->file != NULL)
+		cip_ini_file_free(config->file);
+
+	pthread_mutex_destroy(&config->lock);
+	free(config);
+}
+
+void cip_config_publish(cip_config *config, cip_ini_file *file)
+{
+	static const struct timespec pause = { 0, 100000 };
+	cip_ini_file *old;
+
+	pthread_mutex_lock(&config->lock);
+
+	old = __atomic_exchange_n(&config->file, file, __ATOMIC_SEQ_CST);
+	if (old == file)
+		old = NULL;
+
+	if (old != NULL) {
+		cip_config_barrier(config);
+		while (cip_config_in_use(config, old))
+			nanosleep(&pause, NULL);
+	}
+
+	pthread_mutex_unlock(&config->lock);
+
+	if (old != NULL)
+		cip_ini_file_free(old);
+}
+
+cip_config_reader *cip_config_reader_new(cip_err_ctx *ctx, cip_config *config)
+{
+	struct cip_config_reader *reader;
+
+	pthread_mutex_lock(&config->lock);
+
+	for (reader = config->readers; reader != NULL; reader = reader->next) {
+		if (!reader->in_use)
+			break;
+	}
+
+	if (reader == NULL) {
+
+		reader = aligned_alloc(CIP_CONFIG_ALIGN, sizeof *reader);
+		if (reader == NULL) {
+			pthread_mutex_unlock(&config->lock);
+			return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+		}
+
+		reader->hazard = NULL;
+		reader->config = config;
+		reader->next = config->readers;
+		config->readers = reader;
+	}
+
+	reader->in_use = 1;
+
+	pthread_mutex_unlock(&config->lock);
+
+	return reader;
+}
+
+void cip_config_reader_free(cip_config_reader *reader)
+{
+	cip_config *config;
+
+	config = reader->config;
+
+	__atomic_store_n(&reader->hazard, NULL, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&config->lock);
+	reader->in_use = 0;
+	pthread_mutex_unlock(&config->lock);
+}
+
+const cip_ini_file *cip_config_read(cip_config_reader *reader)
+{
+	const cip_config *config;
+	const cip_ini_file *file, *current;
+
+	config = reader->config;
+	file = __atomic_load_n(&config->file, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+
+		if (config->fence) {
+			__atomic_store_n(&reader->hazard, file,
+					 __ATOMIC_SEQ_CST);
+		}
+		else {
+			__atomic_store_n(&reader->hazard, file,
+					 __ATOMIC_RELAXED);
+			__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		}
+
+		current = __atomic_load_n(&config->file, __ATOMIC_SEQ_CST);
+		if (current == file)
+			return file;
+
+		file = current;
+	}
+}
+
+void cip_config_done(cip_config_reader *reader)
+{
+	__atomic_store_n(&reader->hazard, NULL, __ATOMIC_RELEASE);
+}
@@ -19,6 +19,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 static const char *const cip_static_errors[] = {
 	[0] = "Failed to allocate memory for error message",
@@ -53,36 +54,62 @@ const char *cip_last_err(const cip_err_ctx *ctx)
 		return ctx->err_buf;
 }
 
+/* Grows ctx's buffer to len + 1 bytes; returns 0 or sets a static error */
+static int cip_err_grow(cip_err_ctx *ctx, int len)
+{
+	char *new_buf;
+
+	if (len < 0) {
+		ctx->static_err = 1;
+		return -1;
+	}
+
+	new_buf = realloc(ctx->err_buf, len + 1);
+	if (new_buf == NULL) {
+		ctx->static_err = 0;
+		return -1;
+	}
+
+	ctx->err_buf = new_buf;
+	ctx->buf_size = len + 1;
+	return 0;
+}
+
 static void cip_err_fmt(cip_err_ctx *ctx, const char *format, va_list ap)
 {
+	char stack_buf[256];
 	va_list ap_copy;
-	char *new_buf;
 	int len;
 
-	while (1) {
+	/* A fresh context has no buffer; format short messages only once */
+	if (ctx->buf_size == 0) {
 
 		va_copy(ap_copy, ap);
-		len = vsnprintf(ctx->err_buf, ctx->buf_size, format, ap_copy);
+		len = vsnprintf(stack_buf, sizeof stack_buf, format, ap_copy);
 		va_end(ap_copy);
 
-		if (len < 0) {
-			ctx->static_err = 1;
+		if ((unsigned)len < sizeof stack_buf) {
+			if (cip_err_grow(ctx, len) == 0) {
+				memcpy(ctx->err_buf, stack_buf, len + 1);
+				ctx->static_err = -1;
+			}
 			return;
 		}
+	}
+
+	while (1) {
 
-		if ((unsigned)len < ctx->buf_size) {
+		va_copy(ap_copy, ap);
+		len = vsnprintf(ctx->err_buf, ctx->buf_size, format, ap_copy);
+		va_end(ap_copy);
+
+		if (len >= 0 && (unsigned)len < ctx->buf_size) {
 			ctx->static_err = -1;
 			return;
 		}
 
-		new_buf = realloc(ctx->err_buf, len + 1);
-		if (new_buf == NULL) {
-			ctx->static_err = 0;
+		if (cip_err_grow(ctx, len) == -1)
 			return;
-		}
-
-		ctx->err_buf = new_buf;
-		ctx->buf_size = len + 1;
 	}
 }
 
@@ -132,3 +159,46 @@ void cip_err_use(cip_err_ctx *ctx, const char *format, ...)
 
 	free(old_buf);
 }
+
+void cip_err_diag(cip_err_ctx *ctx, const cip_diag *diag)
+{
+	int len;
+
+	while (1) {
+
+		len = cip_diag_format(diag, ctx->err_buf, ctx->buf_size);
+
+		if (len >= 0 && (unsigned)len < ctx->buf_size) {
+			ctx->static_err = -1;
+			return;
+		}
+
+		if (cip_err_grow(ctx, len) == -1)
+			return;
+	}
+}
+
+int cip_diag_format(const cip_diag *diag, char *buf, size_t size)
+{
+	switch (diag->code) {
+
+	case CIP_DIAG_EXTRA_CHARS:
+		return snprintf(buf, size, "%s:%d: Unexpected extra characters",
+				diag->file_name, diag->line);
+
+	case CIP_DIAG_VALUE:
+		return snprintf(buf, size, "%s:%d: %s", diag->file_name,
+				diag->line, diag->detail);
+
+	case CIP_DIAG_POST_PARSE:
+		if (diag->id != NULL) {
+			return snprintf(buf, size, "%s: [%s:%s]:%s: %s",
+					diag->file_name, diag->sect, diag->id,
+					diag->opt, diag->detail);
+		}
+		return snprintf(buf, size, "%s: [%s]:%s: %s", diag->file_name,
+				diag->sect, diag->opt, diag->detail);
+	}
+
+	return -1;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE	/* for qsort_r */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+/*
+ * Lookup code generator.  A name is dispatched on its length, then on the
+ * character positions that best split the names of that length, and finally
+ * confirmed with a single memcmp().
+ */
+
+struct cip_gen_ctx {
+	cip_err_ctx *err;
+	FILE *out;
+	struct cip_avl_node **nodes;	/* the names being dispatched */
+	size_t *lens;
+	size_t pos;			/* used by cip_gen_cmp() */
+};
+
+static void cip_gen_indent(FILE *out, int depth)
+{
+	while (depth-- > 0)
+		fputc('\t', out);
+}
+
+static void cip_gen_char(FILE *out, unsigned char c)
+{
+	if (c == '\'' || c == '\\')
+		fprintf(out, "'\\%c'", c);
+	else if (c >= ' ' && c <= '~')
+		fprintf(out, "'%c'", c);
+	else
+		fprintf(out, "'\\%03o'", c);
+}
+
+static void cip_gen_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+
+	for (; *s != 0; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if (*s >= ' ' && *s <= '~')
+			fputc(*s, out);
+		else
+			fprintf(out, "\\%03o", (unsigned char)*s);
+	}
+
+	fputc('"', out);
+}
+
+/* Writes s inside a comment, keeping '*' and '/' apart so it can't end it */
+static void cip_gen_comment(FILE *out, const char *s)
+{
+	for (; *s != 0; ++s) {
+		if (*s >= ' ' && *s <= '~')
+			fputc(*s, out);
+		else
+			fputc('?', out);
+		if ((s[0] == '*' && s[1] == '/') ||
+				(s[0] == '/' && s[1] == '*')) {
+			fputc(' ', out);
+		}
+	}
+}
+
+/* Sorts candidates by length, then by the character at gen->pos */
+static int cip_gen_cmp(const void *p1, const void *p2, void *context)
+{
+	const struct cip_gen_ctx *gen;
+	size_t i1, i2;
+	int c1, c2;
+
+	gen = context;
+	i1 = *(const size_t *)p1;
+	i2 = *(const size_t *)p2;
+
+	if (gen->lens[i1] != gen->lens[i2])
+		return (gen->lens[i1] < gen->lens[i2]) ? -1 : 1;
+
+	c1 = (unsigned char)gen->nodes[i1]->name[gen->pos];
+	c2 = (unsigned char)gen->nodes[i2]->name[gen->pos];
+	if (c1 != c2)
+		return c1 - c2;
+
+	return (i1 < i2) ? -1 : (i1 > i2);
+}
+
+static void cip_gen_sort(struct cip_gen_ctx *gen, size_t *cands, size_t count,
+			 size_t pos)
+{
+	gen->pos = pos;
+	qsort_r(cands, count, sizeof *cands, cip_gen_cmp, gen);
+}
+
+/* The position with the most distinct characters among the candidates */
+static size_t cip_gen_best_pos(const struct cip_gen_ctx *gen,
+			       const size_t *cands, size_t count, size_t len)
+{
+	unsigned char seen[256], c;
+	size_t pos, best, i;
+	unsigned n, best_n;
+
+	best = 0;
+	best_n = 0;
+
+	for (pos = 0; pos < len; ++pos) {
+
+		memset(seen, 0, sizeof seen);
+		n = 0;
+
+		for (i = 0; i < count; ++i) {
+			c = gen->nodes[cands[i]]->name[pos];
+			if (!seen[c]) {
+				seen[c] = 1;
+				++n;
+			}
+		}
+
+		if (n > best_n) {
+			best = pos;
+			best_n = n;
+		}
+	}
+
+	return best;
+}
+
+/* cands all have length len; the caller provides the enclosing case */
+static void cip_gen_split(struct cip_gen_ctx *gen, size_t *cands, size_t count,
+			  size_t len, int depth)
+{
+	size_t pos, i, j;
+	unsigned char c;
+
+	if (count == 1) {
+		cip_gen_indent(gen->out, depth);
+		fprintf(gen->out, "if (memcmp(name, ");
+		cip_gen_string(gen->out, gen->nodes[cands[0]]->name);
+		fprintf(gen->out, ", %zu) == 0)\n", len);
+		cip_gen_indent(gen->out, depth + 1);
+		fprintf(gen->out, "return %zu;\n", cands[0]);
+		return;
+	}
+
+	pos = cip_gen_best_pos(gen, cands, count, len);
+	cip_gen_sort(gen, cands, count, pos);
+
+	cip_gen_indent(gen->out, depth);
+	fprintf(gen->out, "switch (name[%zu]) {\n", pos);
+
+	for (i = 0; i < count; i = j) {
+
+		c = gen->nodes[cands[i]]->name[pos];
+		for (j = i + 1; j < count; ++j) {
+			if ((unsigned char)gen->nodes[cands[j]]->name[pos] != c)
+				break;
+		}
+
+		cip_gen_indent(gen->out, depth);
+		fprintf(gen->out, "case ");
+		cip_gen_char(gen->out, c);
+		fprintf(gen->out, ":\n");
+
+		cip_gen_split(gen, cands + i, j - i, len, depth + 1);
+
+		cip_gen_indent(gen->out, depth + 1);
+		fprintf(gen->out, "break;\n");
+	}
+
+	cip_gen_indent(gen->out, depth);
+	fprintf(gen->out, "}\n");
+}
+
+/* Emits the body of a function of name and len that returns an index */
+static int cip_gen_body(struct cip_gen_ctx *gen, struct cip_avl_node **nodes,
+			size_t count)
+{
+	size_t *cands, i, j;
+
+	fprintf(gen->out, "{\n");
+
+	if (count == 0) {
+		fprintf(gen->out, "\t(void)name;\n\t(void)len;\n"
+			"\treturn -1;\n}\n");
+		return 0;
+	}
+
+	cands = malloc(count * (sizeof *cands + sizeof *gen->lens));
+	if (cands == NULL)
+		return cip_err_int(gen->err, "%s", strerror(ENOMEM));
+
+	gen->nodes = nodes;
+	gen->lens = cands + count;
+
+	for (i = 0; i < count; ++i) {
+		cands[i] = i;
+		gen->lens[i] = strlen(nodes[i]->name);
+	}
+
+	cip_gen_sort(gen, cands, count, 0);
+
+	fprintf(gen->out, "\tswitch (len) {\n");
+
+	for (i = 0; i < count; i = j) {
+
+		for (j = i + 1; j < count; ++j) {
+			if (gen->lens[cands[j]] != gen->lens[cands[i]])
+				break;
+		}
+
+		fprintf(gen->out, "\tcase %zu:\n", gen->lens[cands[i]]);
+		cip_gen_split(gen, cands + i, j - i, gen->lens[cands[i]], 2);
+		fprintf(gen->out, "\t\tbreak;\n");
+	}
+
+	fprintf(gen->out, "\t}\n\n\treturn -1;\n}\n");
+
+	free(cands);
+	return 0;
+}
+
+/*
+ * Public API
+ */
+
+int cip_file_schema_gen(cip_err_ctx *ctx, const cip_file_schema *file_schema,
+			FILE *out, const char *prefix)
+{
+	struct cip_schema_order order;
+	struct cip_gen_ctx gen;
+	size_t s, first, count;
+	int ret;
+
+	if (cip_schema_order_init(ctx, &order, file_schema) == -1)
+		return -1;
+
+	gen.err = ctx;
+	gen.out = out;
+	ret = 0;
+
+	fprintf(out, "/* Generated by cip_file_schema_gen(); do not edit */\n\n"
+		"#include <libcip.h>\n#include <string.h>\n\n");
+
+	for (s = 0; s < order.num_sects && ret == 0; ++s) {
+
+		first = order.first_opt[s];
+		count = order.first_opt[s + 1] - first;
+
+		fprintf(out, "/* [");
+		cip_gen_comment(out, order.sects[s]->node.name);
+		fprintf(out, "] */\n");
+		fprintf(out, "static int %s_opt_%zu(const char *name, "
+			"size_t len)\n", prefix, s);
+		ret = cip_gen_body(&gen, (struct cip_avl_node **)order.opts +
+					first, count);
+		fputc('\n', out);
+	}
+
+	if (ret == 0) {
+		fprintf(out, "static int %s_opt(int sect, const char *name, "
+			"size_t len)\n{\n\tswitch (sect) {\n", prefix);
+
+		for (s = 0; s < order.num_sects; ++s) {
+			fprintf(out, "\tcase %zu:\n\t\treturn %s_opt_%zu(name, "
+				"len);\n", s, prefix, s);
+		}
+
+		fprintf(out, "\t}\n\n\treturn -1;\n}\n\n");
+
+		fprintf(out, "static int %s_sect(const char *name, "
+			"size_t len)\n", prefix);
+		ret = cip_gen_body(&gen, (struct cip_avl_node **)order.sects,
+				   order.num_sects);
+	}
+
+	if (ret == 0) {
+		fprintf(out, "\nconst cip_schema_lookup %s_lookup = {\n"
+			"\t.sect_fn\t= %s_sect,\n"
+			"\t.opt_fn\t\t= %s_opt,\n"
+			"\t.names_hash\t= 0x%016" PRIx64 "ULL,\n};\n",
+			prefix, prefix, prefix, cip_schema_names_hash(&order));
+
+		if (ferror(out))
+			ret = cip_err_int(ctx, "Error writing generated code");
+	}
+
+	cip_schema_order_fini(&order);
+	return ret;
+}
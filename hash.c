@@ -0,0 +1,79 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+
+/*
+ * Fast, non-cryptographic 64-bit hash (multiply-fold, 16 bytes per step).
+ * Used to detect changed input, not to resist deliberate collisions.
+ */
+
+#define CIP_HASH_P0	0xa0761d6478bd642fULL
+#define CIP_HASH_P1	0xe7037ed1a0b428dbULL
+#define CIP_HASH_P2	0x8ebc6af09c88c6e3ULL
+
+__attribute__((always_inline))
+static inline uint64_t cip_hash_mix(uint64_t a, uint64_t b)
+{
+	__uint128_t r;
+
+	r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+uint64_t cip_hash(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p;
+	uint64_t a, b;
+	uint32_t x, y;
+
+	p = data;
+	seed = cip_hash_mix(seed ^ CIP_HASH_P0, len ^ CIP_HASH_P1);
+
+	while (len > 16) {
+		memcpy(&a, p, 8);
+		memcpy(&b, p + 8, 8);
+		seed = cip_hash_mix(a ^ CIP_HASH_P1, b ^ seed);
+		p += 16;
+		len -= 16;
+	}
+
+	/* Overlapping fixed-size reads; stay inside the original buffer */
+	if (len > 8) {
+		memcpy(&a, p, 8);
+		memcpy(&b, p + len - 8, 8);
+	}
+	else if (len >= 4) {
+		memcpy(&x, p, 4);
+		memcpy(&y, p + len - 4, 4);
+		a = x;
+		b = y;
+	}
+	else if (len > 0) {
+		a = (uint64_t)p[0] << 16 | (uint64_t)p[len / 2] << 8 |
+			p[len - 1];
+		b = 0;
+	}
+	else {
+		a = 0;
+		b = 0;
+	}
+
+	return cip_hash_mix(a ^ CIP_HASH_P2, b ^ seed);
+}
@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #pragma GCC visibility push(default)
 
@@ -36,6 +37,16 @@ typedef struct cip_file_schema cip_file_schema;
 typedef struct cip_ini_value cip_ini_value;
 typedef struct cip_ini_sect cip_ini_sect;
 typedef struct cip_ini_file cip_ini_file;
+typedef struct cip_parser cip_parser;
+typedef struct cip_parse_result cip_parse_result;
+typedef struct cip_cache_writer cip_cache_writer;
+typedef struct cip_cache_loader cip_cache_loader;
+typedef struct cip_schema_lookup cip_schema_lookup;
+typedef struct cip_inst_array cip_inst_array;
+typedef struct cip_config cip_config;
+typedef struct cip_config_reader cip_config_reader;
+typedef struct cip_watcher cip_watcher;
+typedef struct cip_diag cip_diag;
 
 /*
  * Error reporting
@@ -54,18 +65,50 @@ cip_err_ctx *cip_err_ctx_init(cip_err_ctx *ctx);
 void cip_err_ctx_fini(cip_err_ctx *ctx);
 const char *cip_last_err(const cip_err_ctx *ctx);
 
+/*
+ * Structured warnings, for a schema's diag_fn.  The strings are only valid
+ * during the call; nothing is formatted unless cip_diag_format() is called.
+ */
+
+enum cip_diag_code {
+	CIP_DIAG_EXTRA_CHARS,	/* after a value or section header */
+	CIP_DIAG_VALUE,		/* from the option type's parse_fn */
+	CIP_DIAG_POST_PARSE,	/* from a post_parse_fn */
+};
+
+struct cip_diag {
+	enum cip_diag_code code;
+	const char *file_name;
+	int line;		/* 0 for post-parse warnings */
+	const char *sect;
+	const char *id;		/* instance ID, or NULL */
+	const char *opt;	/* NULL after a section header */
+	const char *detail;	/* parse_fn's or post_parse_fn's message */
+};
+
+/* The message warning_fn would get; returns what snprintf() would */
+int cip_diag_format(const cip_diag *diag, char *buf, size_t size);
+
 /*
  * Schema stuff
  */
 
 #define CIP_OPT_REQUIRED	0x01
 #define CIP_OPT_DEFAULT		0x02
+#define CIP_OPT_POST_GLOBAL	0x04	/* post_parse_fn reads other sections */
+#define CIP_OPT_BIND		0x08	/* copied by cip_ini_file_bind() */
+
+#define CIP_FILE_ARENA		0x01	/* see cip_malloc() */
 
 #define CIP_SECT_REQUIRED	0x01
 #define CIP_SECT_MULTIPLE	0x02
 #define CIP_SECT_NOT_EMPTY	0x04
 #define CIP_SECT_CREATE		0X08
 
+/*
+ * Types written for libcip.so.0.1 lack save_fn and load_fn, so they must be
+ * rebuilt (with those set, or zeroed) against this header
+ */
 struct cip_opt_type {
 	const char *name;
 	char *(*parse_fn)(cip_err_ctx *ctx, void *value, char *s);
@@ -73,6 +116,10 @@ struct cip_opt_type {
 			 const void *value);
 	void (*free_fn)(void *value);
 	size_t size;
+	/* Binary cache support; required only if free_fn is set */
+	int (*save_fn)(cip_err_ctx *ctx, cip_cache_writer *writer,
+		       void *image, const void *value);
+	int (*load_fn)(const cip_cache_loader *loader, void *value);
 };
 
 struct cip_opt_info {
@@ -84,12 +131,15 @@ struct cip_opt_info {
 	void *post_parse_data;
 	const void *default_value;
 	unsigned char flags;
+	size_t offset;		/* in the section's struct, if CIP_OPT_BIND */
 };
 
 struct cip_sect_info {
 	char *name;
 	const cip_opt_info *options;
 	unsigned char flags;
+	size_t offset;		/* of its struct (or its cip_inst_array) */
+	size_t struct_size;	/* 0 if the section isn't bound */
 };
 
 void cip_file_schema_free(cip_file_schema *file_schema);
@@ -99,6 +149,19 @@ cip_file_schema *cip_file_schema_new1(cip_err_ctx *ctx);
 cip_file_schema *cip_file_schema_new2(cip_err_ctx *ctx,
 				      const cip_sect_info *sections);
 
+void cip_file_schema_set_flags(cip_file_schema *file_schema,
+			       unsigned char flags);
+
+/*
+ * Warnings go to diag_fn, unformatted, instead of to warning_fn (which then
+ * needn't be set); returning -1 makes one an error.  Like warning_fn, it is
+ * called in order, on the calling thread, by the multi-threaded parsers too.
+ */
+void cip_file_schema_set_diag_fn(cip_file_schema *file_schema,
+				 int (*diag_fn)(const cip_diag *diag,
+						void *data),
+				 void *data);
+
 cip_sect_schema *cip_sect_schema_new1(cip_err_ctx *ctx,
 				      cip_file_schema *file_schema, char *name,
 				      unsigned char flags);
@@ -126,6 +189,39 @@ int cip_opt_schema_new2(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
 int cip_opt_schema_new3(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
 			const cip_opt_info *options);
 
+/* Section and option indexes are in name (strcmp) order */
+struct cip_schema_lookup {
+	int (*sect_fn)(const char *name, size_t len);
+	int (*opt_fn)(int sect, const char *name, size_t len);
+	uint64_t names_hash;
+};
+
+/* Writes C source that defines a cip_schema_lookup named <prefix>_lookup */
+int cip_file_schema_gen(cip_err_ctx *ctx, const cip_file_schema *file_schema,
+			FILE *out, const char *prefix);
+
+/* Sections and options can't be added once a lookup is set */
+int cip_file_schema_set_lookup(cip_err_ctx *ctx, cip_file_schema *file_schema,
+			       const cip_schema_lookup *lookup);
+
+/* Replaces name lookups with perfect hash tables; also final */
+int cip_file_schema_freeze(cip_err_ctx *ctx, cip_file_schema *file_schema);
+
+/* For cip_ini_value_get_by_handle(); stays valid until the schema is freed */
+int cip_opt_handle(cip_err_ctx *ctx, const cip_file_schema *file_schema,
+		   const char *sect_name, const char *opt_name);
+
+/*
+ * Makes the post_parse_fn of [sect_name]:opt_name run after that of
+ * [dep_sect]:dep_opt, or if dep_opt is NULL, after those of all of dep_sect's
+ * (other) options, as they are when this is called.  Fails, naming the cycle,
+ * if it would make one.  A callback that defers (returns > 0) is retried once
+ * all the others have run.
+ */
+int cip_opt_schema_depend(cip_err_ctx *ctx, cip_file_schema *file_schema,
+			  const char *sect_name, const char *opt_name,
+			  const char *dep_sect, const char *dep_opt);
+
 /*
  * Built-in option types
  */
@@ -135,6 +231,19 @@ typedef struct cip_short_list cip_short_list;
 typedef struct cip_float_list cip_float_list;
 typedef struct cip_str_list cip_str_list;
 typedef struct cip_bool_list cip_bool_list;
+typedef struct cip_int64_list cip_int64_list;
+typedef struct cip_uint64_list cip_uint64_list;
+typedef struct cip_size_list cip_size_list;
+typedef struct cip_double_list cip_double_list;
+typedef struct cip_str_slice cip_str_slice;
+typedef struct cip_slice_list cip_slice_list;
+
+/*
+ * A list's values are one array from cip_malloc(), of exactly count elements.
+ * Even short lists aren't stored inside the option value, which is copied
+ * (and cached) by value, so each non-empty list is one allocation -- carved
+ * out of the file's arena with CIP_FILE_ARENA.
+ */
 
 struct cip_int_list {
 	int *values;
@@ -161,6 +270,37 @@ struct cip_bool_list {
 	unsigned count;
 };
 
+struct cip_int64_list {
+	int64_t *values;
+	unsigned count;
+};
+
+struct cip_uint64_list {
+	uint64_t *values;
+	unsigned count;
+};
+
+struct cip_size_list {
+	size_t *values;
+	unsigned count;
+};
+
+struct cip_double_list {
+	double *values;
+	unsigned count;
+};
+
+/* Not NUL-terminated; points into the parsed text (see cip_value_source()) */
+struct cip_str_slice {
+	const char *start;
+	size_t len;
+};
+
+struct cip_slice_list {
+	cip_str_slice *values;
+	unsigned count;
+};
+
 extern const cip_opt_type cip_opt_type_int;
 extern const cip_opt_type cip_opt_type_int_list;
 extern const cip_opt_type cip_opt_type_float;
@@ -171,6 +311,16 @@ extern const cip_opt_type cip_opt_type_short;
 extern const cip_opt_type cip_opt_type_short_list;
 extern const cip_opt_type cip_opt_type_bool;
 extern const cip_opt_type cip_opt_type_bool_list;
+extern const cip_opt_type cip_opt_type_str_slice;
+extern const cip_opt_type cip_opt_type_slice_list;
+extern const cip_opt_type cip_opt_type_int64;
+extern const cip_opt_type cip_opt_type_int64_list;
+extern const cip_opt_type cip_opt_type_uint64;
+extern const cip_opt_type cip_opt_type_uint64_list;
+extern const cip_opt_type cip_opt_type_size;
+extern const cip_opt_type cip_opt_type_size_list;
+extern const cip_opt_type cip_opt_type_double;
+extern const cip_opt_type cip_opt_type_double_list;
 
 #define CIP_OPT_TYPE_INT	(&cip_opt_type_int)
 #define CIP_OPT_TYPE_INT_LIST	(&cip_opt_type_int_list)
@@ -182,6 +332,16 @@ extern const cip_opt_type cip_opt_type_bool_list;
 #define CIP_OPT_TYPE_SHORT_LIST	(&cip_opt_type_short_list)
 #define CIP_OPT_TYPE_BOOL	(&cip_opt_type_bool)
 #define CIP_OPT_TYPE_BOOL_LIST	(&cip_opt_type_bool_list)
+#define CIP_OPT_TYPE_STR_SLICE	(&cip_opt_type_str_slice)
+#define CIP_OPT_TYPE_SLICE_LIST	(&cip_opt_type_slice_list)
+#define CIP_OPT_TYPE_INT64	(&cip_opt_type_int64)
+#define CIP_OPT_TYPE_INT64_LIST	(&cip_opt_type_int64_list)
+#define CIP_OPT_TYPE_UINT64	(&cip_opt_type_uint64)
+#define CIP_OPT_TYPE_UINT64_LIST (&cip_opt_type_uint64_list)
+#define CIP_OPT_TYPE_SIZE	(&cip_opt_type_size)
+#define CIP_OPT_TYPE_SIZE_LIST	(&cip_opt_type_size_list)
+#define CIP_OPT_TYPE_DOUBLE	(&cip_opt_type_double)
+#define CIP_OPT_TYPE_DOUBLE_LIST (&cip_opt_type_double_list)
 
 /*
  * AVL tree
@@ -196,6 +356,46 @@ struct cip_avl_node {
 
 struct cip_avl_node *cip_avl_get(struct cip_avl_node *tree, const char *name);
 
+/* AVL trees are no taller than 1.44 * log2(n); enough for any n in memory */
+#define CIP_AVL_MAX_HEIGHT	96
+
+/* In-order iteration, e.g. over the values of a section */
+struct cip_avl_iter {
+	struct cip_avl_node *stack[CIP_AVL_MAX_HEIGHT];
+	int depth;
+};
+
+__attribute__((always_inline))
+static inline void cip_avl_iter_push(struct cip_avl_iter *iter,
+				     struct cip_avl_node *node)
+{
+	for (; node != NULL; node = node->left)
+		iter->stack[iter->depth++] = node;
+}
+
+__attribute__((always_inline))
+static inline void cip_avl_iter_init(struct cip_avl_iter *iter,
+				     struct cip_avl_node *tree)
+{
+	iter->depth = 0;
+	cip_avl_iter_push(iter, tree);
+}
+
+/* Returns NULL at the end; the tree must not change while iterating */
+__attribute__((always_inline))
+static inline struct cip_avl_node *cip_avl_iter_next(struct cip_avl_iter *iter)
+{
+	struct cip_avl_node *node;
+
+	if (iter->depth == 0)
+		return NULL;
+
+	node = iter->stack[--iter->depth];
+	cip_avl_iter_push(iter, node->right);
+
+	return node;
+}
+
 /*
  * Parsed values
  */
@@ -214,61 +414,314 @@ struct cip_ini_sect {
 		cip_ini_value *values;
 		cip_ini_sect *instances;
 	};
+	int line;		/* header line number; 0 if created */
+	uint64_t hash;		/* of source lines */
+	unsigned char flags;	/* private */
+	unsigned num_slots;	/* private */
+	const struct cip_ini_index *index;	/* private */
+	cip_ini_value *slots[];	/* private; by slot; none if MULTIPLE */
 };
 
 struct cip_ini_file {
 	const cip_file_schema *schema;
 	cip_ini_sect *sections;
+	void *image;		/* private */
+	size_t image_size;	/* private */
+	struct cip_arena *arena;	/* private */
+	unsigned char flags;	/* private */
+	void *source;		/* private; mapping that values point into */
+	size_t source_size;	/* private */
+	struct cip_arena *text;	/* private; value text copied for slices */
+	struct cip_ini_index *index;	/* private; compact lookups */
 };
 
-__attribute__((always_inline))
-static inline const cip_ini_value *cip_ini_value_get(const cip_ini_sect *sect,
-						     const char *name)
-{
-	return (cip_ini_value *)
-		cip_avl_get((struct cip_avl_node *)sect->values, name);
-}
+const cip_ini_value *cip_ini_value_get(const cip_ini_sect *sect,
+				      const char *name);
 
-__attribute__((always_inline))
-static inline const cip_ini_sect *cip_ini_inst_get(const cip_ini_sect *sect,
-						   const char *name)
-{
-	return (cip_ini_sect *)
-		cip_avl_get((struct cip_avl_node *)sect->instances, name);
-}
+/*
+ * NULL if the option isn't set.  Also NULL, with errno set to EINVAL, if sect
+ * isn't (an instance of) the section that handle was made for, was parsed
+ * before the option was added, or is a MULTIPLE section itself (which holds
+ * instances rather than options).
+ */
+const cip_ini_value *cip_ini_value_get_by_handle(const cip_ini_sect *sect,
+						int handle);
 
-__attribute__((always_inline))
-static inline const cip_ini_sect *cip_ini_sect_get(const cip_ini_file *file,
-						   const char *name)
-{
-	return (cip_ini_sect *)
-		cip_avl_get((struct cip_avl_node *)file->sections, name);
-}
+const cip_ini_sect *cip_ini_inst_get(const cip_ini_sect *sect,
+				     const char *name);
+
+const cip_ini_sect *cip_ini_sect_get(const cip_ini_file *file,
+				     const char *name);
 
 void cip_ini_file_free(cip_ini_file *file);
 
+/* Copies file's names into cache-friendly arrays that the getters then use */
+int cip_ini_file_compact(cip_err_ctx *ctx, cip_ini_file *file);
+
+/* Bound instance structs start with a const char * that points to the ID */
+struct cip_inst_array {
+	void *structs;		/* in ID order; free with free() */
+	unsigned count;
+};
+
+/* Bound strings and lists point into file, so they only live as long as it */
+int cip_ini_file_bind(cip_err_ctx *ctx, const cip_ini_file *file,
+		      void *config);
+
+/*
+ * Writes file as INI text that parses back to the same values (in name
+ * order, with defaults written out)
+ */
+int cip_ini_file_write(cip_err_ctx *ctx, const cip_ini_file *file,
+		       FILE *out);
+
+/* Likewise, into a NUL-terminated buffer; free it with free() */
+char *cip_ini_file_format(cip_err_ctx *ctx, const cip_ini_file *file,
+			  size_t *len);
+
 /*
  * Parsing
+ *
+ * Parsing never modifies a schema, so any number of threads may parse with the
+ * same schema at once, as long as it isn't changed or freed meanwhile.
+ * (Post-parse callbacks and their data are also shared.)
  */
 
+cip_ini_file *cip_parse_buffer(cip_err_ctx *err_ctx, const char *buf,
+			       size_t len, const char *name,
+			       const cip_file_schema *schema,
+			       int (*warning_fn)(const char *warn_msg));
+
 cip_ini_file *cip_parse_stream(cip_err_ctx *err_ctx, FILE *stream,
-			       const char *name, cip_file_schema *schema,
+			       const char *name, const cip_file_schema *schema,
 			       int (*warning_fn)(const char *warn_msg));
 
 cip_ini_file *cip_parse_file(cip_err_ctx *err_ctx, const char *file_name,
-			     cip_file_schema *schema,
+			     const cip_file_schema *schema,
+			     int (*warning_fn)(const char *warn_msg));
+
+cip_ini_file *cip_parse_mmap(cip_err_ctx *err_ctx, const char *file_name,
+			     const cip_file_schema *schema,
 			     int (*warning_fn)(const char *warn_msg));
 
+/* threads == 0 means one per online CPU */
+cip_ini_file *cip_parse_buffer_mt(cip_err_ctx *err_ctx, const char *buf,
+				  size_t len, const char *name,
+				  const cip_file_schema *schema,
+				  int (*warning_fn)(const char *warn_msg),
+				  unsigned threads);
+
+cip_ini_file *cip_parse_mmap_mt(cip_err_ctx *err_ctx, const char *file_name,
+				const cip_file_schema *schema,
+				int (*warning_fn)(const char *warn_msg),
+				unsigned threads);
+
+struct cip_parse_result {
+	char *file_name;
+	cip_ini_file *file;		/* NULL if parsing failed */
+	cip_err_ctx err;
+};
+
+/* Results are in file_names order */
+cip_parse_result *cip_parse_files(cip_err_ctx *err_ctx,
+				  const char *const *file_names,
+				  unsigned count,
+				  const cip_file_schema *schema,
+				  int (*warning_fn)(const char *warn_msg),
+				  unsigned threads);
+
+/*
+ * Parses regular files (and symlinks to them), except dot files; results are
+ * sorted by name (strcmp).  If no files match, *count is 0 and the (empty)
+ * results must still be freed; NULL always means an error.
+ */
+cip_parse_result *cip_parse_dir(cip_err_ctx *err_ctx, const char *dir_name,
+				const char *suffix, unsigned *count,
+				const cip_file_schema *schema,
+				int (*warning_fn)(const char *warn_msg),
+				unsigned threads);
+
+void cip_parse_results_free(cip_parse_result *results, unsigned count);
+
+/*
+ * Sections whose text hasn't changed since old was parsed share its values;
+ * old must still be freed, and must not be used once the new file is freed.
+ * Nothing in old is modified.  Files with values in an arena, or that point
+ * into their text (slices), and sections with CIP_OPT_POST_GLOBAL options are
+ * always parsed in full.  A section counts as unchanged when its text has the
+ * same 64-bit hash as before (old's text isn't kept), so in the unlikely event
+ * of a collision, the section keeps its old values.
+ */
+cip_ini_file *cip_reparse_buffer(cip_err_ctx *err_ctx, cip_ini_file *old,
+				 const char *buf, size_t len, const char *name,
+				 int (*warning_fn)(const char *warn_msg));
+
+cip_ini_file *cip_reparse_mmap(cip_err_ctx *err_ctx, cip_ini_file *old,
+			       const char *file_name,
+			       int (*warning_fn)(const char *warn_msg));
+
+/*
+ * Loads cache_name if it was written from the current contents of file_name
+ * with an identical schema; otherwise parses file_name and rewrites
+ * cache_name (failing to write it isn't an error).  Warnings from parse_fn
+ * are only reported when the text is parsed.
+ */
+cip_ini_file *cip_parse_cached(cip_err_ctx *err_ctx, const char *file_name,
+			       const char *cache_name,
+			       const cip_file_schema *schema,
+			       int (*warning_fn)(const char *warn_msg));
+
+cip_parser *cip_parser_new(cip_err_ctx *err_ctx, const char *name,
+			   const cip_file_schema *schema,
+			   int (*warning_fn)(const char *warn_msg));
+
+int cip_parser_feed(cip_parser *parser, const char *chunk, size_t len);
+
+/* Frees the parser, whether or not it succeeds */
+cip_ini_file *cip_parser_finish(cip_parser *parser);
+
+void cip_parser_free(cip_parser *parser);
+
+/*
+ * Hot-swappable configuration, for files that are read by many threads while
+ * another one reloads them
+ */
+
+/* Takes ownership of file, which may be NULL */
+cip_config *cip_config_new(cip_err_ctx *ctx, cip_ini_file *file);
+
+/* Frees the current file too; readers must be done with it */
+void cip_config_free(cip_config *config);
+
+/*
+ * Makes file the current one, then waits for readers to be done with the old
+ * one and frees it.  Readers are never blocked.  Publishers are serialized.
+ */
+void cip_config_publish(cip_config *config, cip_ini_file *file);
+
+/* A reader belongs to one thread at a time */
+cip_config_reader *cip_config_reader_new(cip_err_ctx *ctx,
+					 cip_config *config);
+void cip_config_reader_free(cip_config_reader *reader);
+
+/*
+ * Returns the current file, which stays valid until cip_config_done() or the
+ * next cip_config_read() with the same reader.  Lock-free; writes nothing
+ * shared.
+ */
+const cip_ini_file *cip_config_read(cip_config_reader *reader);
+void cip_config_done(cip_config_reader *reader);
+
+/*
+ * Automatic reloading.  A background thread watches a file (or the files in a
+ * directory, as cip_parse_dir() would pick them) with inotify, and reparses it
+ * once changes have stopped for delay_ms.  reload_fn then gets the new file
+ * (or results), which it owns, e.g. to pass to cip_config_publish().  If
+ * parsing fails, file (or results) is NULL and err says why.  reload_fn is
+ * called on the watcher's thread.  If the directory is removed or renamed,
+ * that reload fails, and the watcher checks every second for it to return.
+ */
+cip_watcher *cip_watch_file(cip_err_ctx *ctx, const char *file_name,
+			    const cip_file_schema *schema,
+			    int (*warning_fn)(const char *warn_msg),
+			    void (*reload_fn)(cip_ini_file *file,
+					      cip_err_ctx *err, void *data),
+			    void *data, unsigned delay_ms);
+
+cip_watcher *cip_watch_dir(cip_err_ctx *ctx, const char *dir_name,
+			   const char *suffix, const cip_file_schema *schema,
+			   int (*warning_fn)(const char *warn_msg),
+			   unsigned threads,
+			   void (*reload_fn)(cip_parse_result *results,
+					     unsigned count, cip_err_ctx *err,
+					     void *data),
+			   void *data, unsigned delay_ms);
+
+/*
+ * Waits for a reload in progress to finish.  Called from reload_fn, it
+ * returns at once, and the watcher is freed when reload_fn returns.
+ */
+void cip_watcher_free(cip_watcher *watcher);
+
 /*
  * Type helpers
  */
 
+/*
+ * Memory that parse_fn stores in a value must come from cip_malloc() (and
+ * be released with cip_free()).  With CIP_FILE_ARENA, it is carved out of
+ * the file's arena and freed all at once with the file.  Either way, failure
+ * sets errno to ENOMEM.
+ */
+void *cip_malloc(size_t size);
+void cip_free(void *ptr);
+
+/*
+ * Maps s, which points into the text passed to parse_fn, to the same place in
+ * the source, which lives as long as the file.  Buffers passed to
+ * cip_parse_buffer() (or its relatives) must outlive the file; mapped files
+ * stay mapped, and text that only passed through a stream or push parser is
+ * copied into the file.  NULL if that copy fails.
+ */
+const char *cip_value_source(const char *s);
+
+/*
+ * Integers with the syntax of strtoll() with base 0 (in the C locale).  Return
+ * the end of the number, or NULL with errno set to EINVAL (no number) or
+ * ERANGE.  cip_parse_u64() rejects a minus sign (EINVAL).
+ */
+char *cip_parse_i64(const char *s, int64_t *value);
+char *cip_parse_u64(const char *s, uint64_t *value);
+
+/* strtod() and strtof(), but always in the C locale */
+double cip_strtod(const char *s, char **endptr);
+float cip_strtof(const char *s, char **endptr);
+
+/*
+ * Formatting for format_fn; these return what snprintf() would.  Floating-
+ * point numbers get the shortest string that reads back as the same value.
+ */
+int cip_format_str(char *buf, size_t size, const char *s, size_t len);
+int cip_format_i64(char *buf, size_t size, int64_t value);
+int cip_format_u64(char *buf, size_t size, uint64_t value);
+int cip_format_double(char *buf, size_t size, double value);
+int cip_format_float(char *buf, size_t size, float value);
+
 void *cip_list_parse(char **remainder, unsigned *count, cip_err_ctx *ctx,
 		     char *s, const cip_opt_type *type);
 
 int cip_list_format(cip_err_ctx *ctx, char *buf, size_t size, void *values,
 		    size_t count, const cip_opt_type *type);
 
+/* image_values and values point to the list's values pointer */
+int cip_list_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+		  void *image_values, const void *values, size_t count,
+		  const cip_opt_type *type);
+
+int cip_list_load(const cip_cache_loader *loader, void *values, size_t count,
+		  const cip_opt_type *type);
+
+/* Copies data into the image; returns its offset, or 0 on error */
+size_t cip_cache_put(cip_err_ctx *ctx, cip_cache_writer *writer,
+		     const void *data, size_t size);
+
+/* Stores an image offset in a pointer that is saved in the image */
+__attribute__((always_inline))
+static inline void cip_cache_ref(void *ptr, size_t offset)
+{
+	*(uintptr_t *)ptr = offset;
+}
+
+/*
+ * Turns an offset stored by cip_cache_ref() back into a pointer to size bytes;
+ * -1 if they aren't all in the image
+ */
+int cip_cache_load_data(const cip_cache_loader *loader, void *ptr,
+			size_t size);
+
+/* Likewise, for a NUL-terminated string */
+int cip_cache_load_str(const cip_cache_loader *loader, void *ptr);
+
 #pragma GCC visibility pop
 
 #endif		/* CIP_LIBCIP_H */
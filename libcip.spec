@@ -1,6 +1,6 @@
-%define	api_ver		0.1
-%define so_ver		%{api_ver}.1
-%define lib_ver		%{so_ver}.6
+%define	api_ver		0.2
+%define so_ver		%{api_ver}.0
+%define lib_ver		%{so_ver}.0
 
 Name:		libcip
 Summary:	C INI Parser
@@ -23,7 +23,7 @@ libcip INI parsing library.
 %setup0
 
 %build
-gcc -g -Os -Wall -Wextra -shared -fPIC -fvisibility=hidden \
+gcc -g -Os -Wall -Wextra -shared -fPIC -fvisibility=hidden -pthread \
 	-Wl,-soname,%{name}.so.%{so_ver} -o %{name}.so.%{version} *.c types/*.c
 
 %install
@@ -47,6 +47,15 @@ ln -s %{name}.so.%{version} %{buildroot}%{_libdir}/%{name}.so
 %{_libdir}/%{name}.so
 
 %changelog
+* Sat Oct 17 2026 Ian Pilcher <arequipeno@gmail.com> - 0.2.0.0-1
+- Bump soname; the following layouts changed, so callers must be rebuilt
+- cip_opt_info and cip_sect_info gained binding offsets (and sizes), which
+  changes the stride of the arrays passed to the schema constructors
+- cip_ini_sect and cip_ini_file gained fields (a reparse hash, and private
+  option slots, compact indexes, arenas and mappings)
+- cip_opt_type gained save_fn and load_fn, which caching reads for every
+  type, so custom types must be rebuilt too
+
 * Wed Aug  5 2020 Ian Pilcher <arequipeno@gmail.com> - 0.1.1.6-1
 - Fix RPM build on EL 8
 
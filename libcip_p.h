@@ -27,6 +27,14 @@ int cip_err_int(cip_err_ctx *ctx, const char *format, ...);
 __attribute__((format(printf, 2, 3)))
 void cip_err_use(cip_err_ctx *ctx, const char *format, ...);
 
+void cip_err_diag(cip_err_ctx *ctx, const cip_diag *diag);
+
+/*
+ * Hashing - hash.c
+ */
+
+uint64_t cip_hash(const void *data, size_t len, uint64_t seed);
+
 /*
  * AVL tree stuff - avl.c
  */
@@ -36,11 +44,172 @@ void cip_avl_free(struct cip_avl_node *tree,
 
 int cip_avl_add(struct cip_avl_node **tree, struct cip_avl_node *new);
 
+struct cip_avl_node *cip_avl_get_n(struct cip_avl_node *tree, const char *name,
+				   size_t len);
+
+/* nodes must be sorted by name */
+struct cip_avl_node *cip_avl_build(struct cip_avl_node **nodes, size_t count);
+
 int cip_avl_foreach(struct cip_avl_node *tree,
 			   int (*callback_fn)(struct cip_avl_node *node,
 					      void *context),
 			   void *context);
 
+/*
+ * Arena allocation - arena.c
+ */
+
+struct cip_arena;
+
+extern __thread struct cip_arena *cip_arena_cur;
+
+struct cip_arena *cip_arena_new(cip_err_ctx *ctx);
+
+void *cip_arena_alloc(struct cip_arena *arena, size_t size);
+
+void cip_arena_free(struct cip_arena *arena);
+
+/* Moves other's blocks (and header) into arena */
+void cip_arena_adopt(struct cip_arena *arena, struct cip_arena *other);
+
+/* Makes arena (which may be NULL) current; returns the previous one */
+__attribute__((always_inline))
+static inline struct cip_arena *cip_arena_enter(struct cip_arena *arena)
+{
+	struct cip_arena *prev;
+
+	prev = cip_arena_cur;
+	cip_arena_cur = arena;
+	return prev;
+}
+
+__attribute__((always_inline))
+static inline void cip_arena_leave(struct cip_arena *prev)
+{
+	cip_arena_cur = prev;
+}
+
+/*
+ * Minimal perfect hashing - mph.c
+ */
+
+struct cip_mph_slot {
+	struct cip_avl_node *node;
+	size_t len;			/* of node->name */
+};
+
+struct cip_mph {
+	struct cip_mph_slot *slots;
+	uint64_t seed;
+	uint32_t num_buckets;
+	uint32_t size;			/* number of slots */
+	uint32_t disp[];		/* displacement of each bucket */
+};
+
+/* Maps x to [0, n) without dividing */
+__attribute__((always_inline))
+static inline uint32_t cip_mph_range(uint32_t x, uint32_t n)
+{
+	return ((uint64_t)x * n) >> 32;
+}
+
+__attribute__((always_inline))
+static inline uint32_t cip_mph_bucket(const struct cip_mph *mph, uint64_t hash)
+{
+	return cip_mph_range(hash >> 32, mph->num_buckets);
+}
+
+__attribute__((always_inline))
+static inline uint32_t cip_mph_slot(const struct cip_mph *mph, uint64_t hash)
+{
+	uint32_t d;
+
+	d = mph->disp[cip_mph_bucket(mph, hash)];
+	return cip_mph_range((uint32_t)hash + d * ((uint32_t)(hash >> 32) | 1),
+			     mph->size);
+}
+
+size_t cip_mph_size(size_t count);
+
+/* mph points to cip_mph_size(count) bytes */
+int cip_mph_init(cip_err_ctx *ctx, struct cip_mph *mph,
+		 struct cip_avl_node **nodes, size_t count);
+
+struct cip_avl_node *cip_mph_get(const struct cip_mph *mph, const char *name,
+				 size_t len);
+
+/*
+ * Line scanning and lexing - scan.c
+ */
+
+enum cip_char_class {
+	CIP_CC_OTHER = 0,
+	CIP_CC_SPACE,		/* C locale isspace(), except newline */
+	CIP_CC_EOL,		/* newline or NUL */
+	CIP_CC_EQUALS,
+	CIP_CC_LBRACKET,
+	CIP_CC_RBRACKET,
+	CIP_CC_COLON,
+	CIP_CC_COMMENT,		/* ';' or '#' */
+};
+
+extern const unsigned char cip_char_classes[256];
+
+__attribute__((always_inline))
+static inline int cip_cclass(char c)
+{
+	return cip_char_classes[(unsigned char)c];
+}
+
+__attribute__((always_inline))
+static inline int cip_isspace(char c)
+{
+	return cip_cclass(c) == CIP_CC_SPACE;
+}
+
+struct cip_slice {
+	const char *start;
+	size_t len;
+};
+
+__attribute__((always_inline))
+static inline void cip_slice_trim(struct cip_slice *slice, const char *s,
+				  size_t len)
+{
+	while (len != 0 && cip_isspace(*s)) {
+		++s;
+		--len;
+	}
+
+	while (len != 0 && cip_isspace(s[len - 1]))
+		--len;
+
+	slice->start = s;
+	slice->len = len;
+}
+
+enum cip_line_type {
+	CIP_LINE_BLANK,		/* empty or comment */
+	CIP_LINE_SECT,
+	CIP_LINE_OPT,
+	CIP_LINE_UNCLOSED,	/* section header without ']' */
+	CIP_LINE_NO_EQUALS,	/* option without '=' */
+};
+
+struct cip_line_tokens {
+	enum cip_line_type type;
+	struct cip_slice title;	/* section title or option name */
+	struct cip_slice id;	/* section ID (start is NULL if none) */
+	struct cip_slice value;	/* option value */
+	struct cip_slice comment;	/* after ';' or '#' (start NULL if none) */
+	int extra;		/* non-comment characters after ']' */
+};
+
+size_t cip_lex_line(struct cip_line_tokens *tok, const char *s, size_t size);
+
+/* Start of the first section header line after pos, or len */
+size_t cip_next_header(const char *buf, size_t len, size_t pos);
+
 /*
  * Schema stuff - schema.c
  */
@@ -53,19 +222,73 @@ struct cip_opt_schema {
 			     void *post_parse_data);
 	void *post_parse_data;
 	unsigned char flags;
+	unsigned slot;			/* index in cip_ini_sect slots */
+	size_t offset;			/* if CIP_OPT_BIND */
+	struct cip_post_dep *deps;	/* post-parse dependencies */
+	unsigned post_rank;		/* 0 if none, else 1 + deps' highest */
+	unsigned mark;			/* for searches of the dependencies */
 	unsigned char default_value[] __attribute__((aligned));
 };
 
+/* [sect]:opt's post_parse_fn runs first */
+struct cip_post_dep {
+	struct cip_post_dep *next;
+	const cip_sect_schema *sect;
+	cip_opt_schema *opt;
+};
+
+/* Private section schema flag */
+#define CIP_SECT_POST_GLOBAL	0x80	/* has a CIP_OPT_POST_GLOBAL option */
+
 struct cip_sect_schema {
 	struct cip_avl_node node;
 	struct cip_opt_schema *options;
 	unsigned char flags;
+	const cip_schema_lookup *lookup;
+	struct cip_opt_schema **opt_order;	/* lookup's option indexes */
+	int index;				/* lookup's section index */
+	const struct cip_mph *mph;		/* if frozen */
+	unsigned num_opts;
+	size_t offset;				/* see cip_sect_info */
+	size_t struct_size;
+	unsigned id;				/* for option handles */
+};
+
+/* Option handles hold the section's ID above the option's slot */
+#define CIP_HANDLE_SLOT_BITS	16
+#define CIP_HANDLE_SLOT_MASK	((1u << CIP_HANDLE_SLOT_BITS) - 1)
+#define CIP_HANDLE_MAX_ID	((unsigned)INT_MAX >> CIP_HANDLE_SLOT_BITS)
+
+/* Sections and options in name order; options grouped by section */
+struct cip_schema_order {
+	struct cip_sect_schema **sects;
+	struct cip_opt_schema **opts;
+	size_t *first_opt;	/* num_sects + 1 entries */
+	size_t num_sects;
+	size_t num_opts;
 };
 
 struct cip_file_schema {
 	struct cip_sect_schema *sections;
+	unsigned char flags;
+	const cip_schema_lookup *lookup;
+	struct cip_schema_order order;	/* if lookup is set */
+	struct cip_mph *mph;		/* if frozen; also holds sections' */
+	int (*diag_fn)(const cip_diag *diag, void *data);
+	void *diag_data;
+	unsigned num_deps;
+	unsigned max_post_rank;
+	unsigned mark;			/* last cip_opt_schema mark used */
+	unsigned num_sects;		/* section IDs given out */
 };
 
+int cip_schema_order_init(cip_err_ctx *ctx, struct cip_schema_order *order,
+			  const cip_file_schema *schema);
+
+void cip_schema_order_fini(struct cip_schema_order *order);
+
+uint64_t cip_schema_names_hash(const struct cip_schema_order *order);
+
 __attribute__((always_inline))
 static inline cip_opt_schema *cip_opt_schema_get(const cip_sect_schema *sect,
 						 const char *name)
@@ -82,6 +305,60 @@ static inline cip_sect_schema *cip_sect_schema_get(const cip_file_schema *file,
 		cip_avl_get((struct cip_avl_node *)file->sections, name);
 }
 
+__attribute__((always_inline))
+static inline cip_opt_schema *cip_opt_schema_get_n(const cip_sect_schema *sect,
+						   const char *name, size_t len)
+{
+	int i;
+
+	if (sect->mph != NULL)
+		return (cip_opt_schema *)cip_mph_get(sect->mph, name, len);
+
+	if (sect->lookup != NULL) {
+		i = sect->lookup->opt_fn(sect->index, name, len);
+		return (i >= 0) ? sect->opt_order[i] : NULL;
+	}
+
+	return (cip_opt_schema *)
+		cip_avl_get_n((struct cip_avl_node *)sect->options, name, len);
+}
+
+__attribute__((always_inline))
+static inline cip_sect_schema *cip_sect_schema_get_n(
+		const cip_file_schema *file, const char *name, size_t len)
+{
+	int i;
+
+	if (file->mph != NULL)
+		return (cip_sect_schema *)cip_mph_get(file->mph, name, len);
+
+	if (file->lookup != NULL) {
+		i = file->lookup->sect_fn(name, len);
+		return (i >= 0) ? file->order.sects[i] : NULL;
+	}
+
+	return (cip_sect_schema *)
+		cip_avl_get_n((struct cip_avl_node *)file->sections, name, len);
+}
+
+/*
+ * Compact lookup - compact.c
+ */
+
+struct cip_ini_index {
+	union {
+		uint64_t key;
+		struct {		/* [0] only */
+			uint32_t count;
+			uint32_t prefix_len;
+		};
+	};
+	struct cip_avl_node *node;	/* [0] has the first name */
+};
+
+struct cip_avl_node *cip_index_get(const struct cip_ini_index *index,
+				   const char *name);
+
 /*
  * Parsed stuff - values.c
  */
@@ -90,6 +367,9 @@ __attribute__((always_inline))
 static inline cip_ini_value *cip_ini_value_get_p(const cip_ini_sect *sect,
 						 const char *name)
 {
+	if (sect->index != NULL)
+		return (cip_ini_value *)cip_index_get(sect->index, name);
+
 	return (cip_ini_value *)
 		cip_avl_get((struct cip_avl_node *)sect->values, name);
 }
@@ -98,6 +378,9 @@ __attribute__((always_inline))
 static inline cip_ini_sect *cip_ini_inst_get_p(const cip_ini_sect *sect,
 					       const char *name)
 {
+	if (sect->index != NULL)
+		return (cip_ini_sect *)cip_index_get(sect->index, name);
+
 	return (cip_ini_sect *)
 		cip_avl_get((struct cip_avl_node *)sect->instances, name);
 }
@@ -106,10 +389,27 @@ __attribute__((always_inline))
 static inline cip_ini_sect *cip_ini_sect_get_p(const cip_ini_file *file,
 					       const char *name)
 {
+	if (file->index != NULL)
+		return (cip_ini_sect *)cip_index_get(file->index, name);
+
 	return (cip_ini_sect *)
 		cip_avl_get((struct cip_avl_node *)file->sections, name);
 }
 
+__attribute__((always_inline))
+static inline cip_ini_sect *cip_ini_sect_get_pn(const cip_ini_file *file,
+						const char *name, size_t len)
+{
+	return (cip_ini_sect *)
+		cip_avl_get_n((struct cip_avl_node *)file->sections, name, len);
+}
+
+/* cip_ini_sect flags */
+#define CIP_INI_BORROWED	0x01	/* values (and ID) owned by another file */
+
+/* cip_ini_file flags */
+#define CIP_INI_SOURCE		0x01	/* values point into the parsed text */
+
 cip_ini_file *cip_ini_file_new(cip_err_ctx *ctx, const cip_file_schema *schema);
 
 cip_ini_sect *cip_ini_sect_new(cip_err_ctx *ctx, cip_ini_file *file,
@@ -121,9 +421,72 @@ cip_ini_sect *cip_ini_inst_new(cip_err_ctx *ctx, cip_ini_sect *sect,
 int cip_ini_value_new(cip_err_ctx *ctx, cip_ini_sect *sect,
 		      const cip_opt_schema *schema, const void *value);
 
+/* A value to be parsed in place, then added (or freed with cip_free()) */
+cip_ini_value *cip_ini_value_alloc(cip_err_ctx *ctx,
+				   const cip_opt_schema *schema);
+
+int cip_ini_value_add(cip_err_ctx *ctx, cip_ini_sect *sect,
+		      cip_ini_value *value);
+
+cip_ini_sect *cip_ini_sect_borrow(cip_err_ctx *ctx, cip_ini_file *file,
+				  const cip_ini_sect *old);
+
+cip_ini_sect *cip_ini_inst_borrow(cip_err_ctx *ctx, cip_ini_sect *sect,
+				  const cip_ini_sect *old);
+
 __attribute__((always_inline))
 static inline int cip_ini_value_def(cip_err_ctx *ctx, cip_ini_sect *sect,
 				    const cip_opt_schema *schema)
 {
 	return cip_ini_value_new(ctx, sect, schema, schema->default_value);
 }
+
+/*
+ * Parsing - parse.c
+ */
+
+struct cip_parse_ctx {
+	cip_err_ctx *err;
+	const cip_file_schema *file_schema;
+	cip_ini_file *file;
+	cip_ini_sect *sect;
+	const char *file_name;
+	int (*warning_fn)(const char *warn_msg);
+	char *scratch;
+	size_t scratch_size;
+	cip_ini_file *old;		/* when reloading */
+	cip_ini_sect **borrowed;	/* pairs of new and old sections */
+	size_t num_borrowed;
+	size_t borrowed_size;
+	struct cip_slice value;		/* source of the text in scratch */
+	char *value_copy;		/* of value, if the source isn't kept */
+	char keep_source;		/* the text outlives the file */
+	int line_num;
+};
+
+int cip_parse_ctx_init(struct cip_parse_ctx *ctx, cip_err_ctx *err_ctx,
+		       const char *name, const cip_file_schema *schema,
+		       int (*warning_fn)(const char *warn_msg));
+
+void cip_parse_ctx_abort(struct cip_parse_ctx *ctx);
+
+int cip_parse_mem(struct cip_parse_ctx *ctx, const char *buf, size_t len);
+
+int cip_check_prev_sect(struct cip_parse_ctx *ctx);
+
+/* Frees the file on failure */
+cip_ini_file *cip_parse_finish(struct cip_parse_ctx *ctx);
+
+/* Frees the file on failure */
+cip_ini_file *cip_parse_loaded(cip_err_ctx *err_ctx, cip_ini_file *file,
+			       const char *name,
+			       int (*warning_fn)(const char *warn_msg));
+
+/*
+ * Set on the multi-threaded parsers' workers, which record what would go to the
+ * schema's diag_fn and replay it in order on the calling thread
+ */
+extern __thread int (*cip_diag_record)(const cip_diag *diag);
+
+/* Unmaps the text that file was parsed from, unless its values point into it */
+void cip_parse_unmap(cip_ini_file *file, void *map, size_t len);
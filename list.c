@@ -15,68 +15,137 @@
  */
 
 #include "libcip.h"
+#include "libcip_p.h"
 
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 
-struct cip_vlist_node {
-	struct cip_vlist_node *next;
-	unsigned char value[] __attribute__((aligned));
-};
+/*
+ * Lists are parsed into a buffer that starts out on the stack and doubles as
+ * needed, so most lists cost a single allocation (for the final array).  Only
+ * that working buffer is inline; the final array can't live in the value,
+ * whose pointer would then go stale whenever the value is copied.
+ */
+
+#define CIP_LIST_INLINE		256	/* bytes */
 
-static void cip_vlist_free(struct cip_vlist_node *list,
-			   void (*free_fn)(void *value))
+static void cip_list_free_values(unsigned char *values, unsigned count,
+				 const cip_opt_type *type)
 {
-	struct cip_vlist_node *next;
+	unsigned i;
 
-	while (list != NULL) {
+	if (type->free_fn == 0)
+		return;
 
-		if (free_fn != 0)
-			free_fn(list->value);
+	for (i = 0; i < count; ++i)
+		type->free_fn(values + (size_t)i * type->size);
+}
+
+static int cip_list_grow(unsigned char **values, size_t *size,
+			 const unsigned char *inline_buf, size_t used,
+			 size_t needed)
+{
+	unsigned char *new_values;
+	size_t new_size;
+
+	new_size = *size;
+	while (new_size < needed) {
+		if (new_size > SIZE_MAX / 2)
+			return -1;
+		new_size *= 2;
+	}
 
-		next = list->next;
-		free(list);
-		list = next;
+	if (*values == inline_buf) {
+		new_values = malloc(new_size);
+		if (new_values != NULL)
+			memcpy(new_values, inline_buf, used);
+	}
+	else {
+		new_values = realloc(*values, new_size);
 	}
+
+	if (new_values == NULL)
+		return -1;
+
+	*values = new_values;
+	*size = new_size;
+	return 0;
+}
+
+/* Returns an array from cip_malloc() that holds exactly the used bytes */
+static void *cip_list_finish(unsigned char *values,
+			     const unsigned char *inline_buf, size_t used)
+{
+	unsigned char *result;
+
+	/* Outside an arena, cip_malloc() is malloc(), so just shrink */
+	if (values != inline_buf && cip_arena_cur == NULL) {
+		result = realloc(values, used);
+		if (result != NULL)
+			return result;
+	}
+
+	result = cip_malloc(used);
+	if (result == NULL)
+		return NULL;
+
+	memcpy(result, values, used);
+
+	if (values != inline_buf)
+		free(values);
+
+	return result;
 }
 
 void *cip_list_parse(char **remainder, unsigned *count, cip_err_ctx *ctx,
 		     char *s, const cip_opt_type *type)
 {
-	struct cip_vlist_node *n, *list, **list_end;
-	unsigned char *values;
+	unsigned char inline_buf[CIP_LIST_INLINE] __attribute__((aligned));
+	unsigned char *values, *result;
+	size_t size, used;
 	unsigned i;
 
-	list = NULL;
-	list_end = &list;
+	values = inline_buf;
+	size = sizeof inline_buf;
+	used = 0;
 	i = 0;
 
 	while (1) {
 
-		*list_end = malloc(sizeof **list_end + type->size);
-		if (*list_end == NULL) {
-			cip_err(ctx, "%m");
-			cip_vlist_free(list, type->free_fn);
-			return NULL;
+		if (size - used < type->size &&
+			(i == UINT_MAX ||
+			 cip_list_grow(&values, &size, inline_buf, used,
+				       used + type->size) == -1)) {
+			cip_err(ctx, "%s", strerror(ENOMEM));
+			break;
 		}
 
-		(*list_end)->next = NULL;
-
-		s = type->parse_fn(ctx, (*list_end)->value, s);
-		if (s == NULL) {
-			cip_vlist_free(list, type->free_fn);
-			return NULL;
-		}
+		s = type->parse_fn(ctx, values + used, s);
+		if (s == NULL)
+			break;
 
-		list_end = &(*list_end)->next;
+		used += type->size;
 		++i;
 
 		while (*s != 0 && isspace(*s))
 			++s;
 
-		if (*s != ',')
-			break;
+		if (*s != ',') {
+
+			/* i > 0 (type->parse_fn will error on empty list) */
+
+			result = cip_list_finish(values, inline_buf, used);
+			if (result == NULL) {
+				cip_err(ctx, "%s", strerror(ENOMEM));
+				break;
+			}
+
+			*count = i;
+			*remainder = s;
+			return result;
+		}
 
 		++s;
 
@@ -84,24 +153,13 @@ void *cip_list_parse(char **remainder, unsigned *count, cip_err_ctx *ctx,
 			++s;
 	}
 
-	/* i > 0 (type->parse_fn will error on empty list) */
-
-	values = malloc(i * type->size);
-	if (values == NULL) {
-		cip_err(ctx, "%m");
-		cip_vlist_free(list, type->free_fn);
-		return NULL;
-	}
-
-	*count = i;
-	*remainder = s;
-
-	for (n = list, i = 0; n != NULL; n = n->next, i += type->size)
-		memcpy(values + i, n->value, type->size);
+	/* Only the values that were successfully parsed */
+	cip_list_free_values(values, i, type);
 
-	cip_vlist_free(list, 0);
+	if (values != inline_buf)
+		free(values);
 
-	return values;
+	return NULL;
 }
 
 int cip_list_format(cip_err_ctx *ctx, char *buf, size_t size, void *values,
@@ -134,12 +192,7 @@ int cip_list_format(cip_err_ctx *ctx, char *buf, size_t size, void *values,
 		if (i == count)
 			break;
 
-		ret = snprintf(buf, size, ", ");
-		if (ret < 0) {
-			cip_err(ctx, "%m");
-			return -1;
-		}
-
+		ret = cip_format_str(buf, size, ", ", 2);
 		total += ret;
 
 		if ((unsigned)ret >= size)
@@ -151,3 +204,72 @@ int cip_list_format(cip_err_ctx *ctx, char *buf, size_t size, void *values,
 
 	return total;
 }
+
+int cip_list_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+		  void *image_values, const void *values, size_t count,
+		  const cip_opt_type *type)
+{
+	const unsigned char *v;
+	unsigned char *copy;
+	size_t i, size, offset;
+
+	v = *(void *const *)values;
+	size = count * type->size;
+
+	if (type->save_fn == 0) {
+		offset = cip_cache_put(ctx, writer, v, size);
+		if (offset == 0)
+			return -1;
+		cip_cache_ref(image_values, offset);
+		return 0;
+	}
+
+	copy = malloc(size);
+	if (copy == NULL)
+		return cip_err_int(ctx, "%s", strerror(ENOMEM));
+
+	memcpy(copy, v, size);
+
+	for (i = 0; i < size; i += type->size) {
+		if (type->save_fn(ctx, writer, copy + i, v + i) == -1) {
+			free(copy);
+			return -1;
+		}
+	}
+
+	offset = cip_cache_put(ctx, writer, copy, size);
+	free(copy);
+	if (offset == 0)
+		return -1;
+
+	cip_cache_ref(image_values, offset);
+	return 0;
+}
+
+int cip_list_load(const cip_cache_loader *loader, void *values, size_t count,
+		  const cip_opt_type *type)
+{
+	unsigned char *v;
+	size_t i;
+
+	/* Parsed lists are never empty */
+	if (count == 0)
+		return -1;
+
+	count *= type->size;
+
+	if (cip_cache_load_data(loader, values, count) == -1)
+		return -1;
+
+	if (type->load_fn == 0)
+		return 0;
+
+	v = *(void **)values;
+
+	for (i = 0; i < count; i += type->size) {
+		if (type->load_fn(loader, v + i) == -1)
+			return -1;
+	}
+
+	return 0;
+}
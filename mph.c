@@ -0,0 +1,237 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE	/* for qsort_r */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Minimal perfect hashing ("hash and displace").  Keys are hashed into
+ * buckets of about CIP_MPH_LOAD keys each; the largest buckets are placed
+ * first, each by finding a displacement that sends all of its keys to free
+ * slots.  If a bucket can't be placed, the whole table is retried with a new
+ * seed.
+ */
+
+#define CIP_MPH_LOAD		4
+#define CIP_MPH_MAX_DISP	65536
+#define CIP_MPH_MAX_SEEDS	64
+
+struct cip_mph_build {
+	uint64_t *hashes;
+	uint32_t *keys;		/* grouped by bucket */
+	uint32_t *starts;	/* of each bucket's keys, plus one */
+	uint32_t *order;	/* buckets, largest first */
+	uint32_t *sizes;	/* of each bucket */
+	uint32_t *slots;	/* candidate slots of the bucket being placed */
+	unsigned char *taken;
+};
+
+static uint32_t cip_mph_buckets(size_t count)
+{
+	return (count + CIP_MPH_LOAD - 1) / CIP_MPH_LOAD + 1;
+}
+
+/* Bytes needed by a table of count keys, including the header */
+size_t cip_mph_size(size_t count)
+{
+	size_t size;
+
+	size = sizeof(struct cip_mph) +
+		cip_mph_buckets(count) * sizeof(uint32_t);
+	size = (size + __alignof__(struct cip_mph) - 1) &
+		~(__alignof__(struct cip_mph) - 1);
+
+	return size + ((count != 0) ? count : 1) * sizeof(struct cip_mph_slot);
+}
+
+static int cip_mph_cmp(const void *p1, const void *p2, void *context)
+{
+	const uint32_t *sizes;
+	uint32_t b1, b2;
+
+	sizes = context;
+	b1 = *(const uint32_t *)p1;
+	b2 = *(const uint32_t *)p2;
+
+	if (sizes[b1] != sizes[b2])
+		return (sizes[b1] > sizes[b2]) ? -1 : 1;
+
+	return (b1 < b2) ? -1 : (b1 > b2);
+}
+
+/* Tries to place every bucket with mph->seed */
+static int cip_mph_place(struct cip_mph *mph, struct cip_mph_build *build,
+			 struct cip_avl_node **nodes, size_t count)
+{
+	uint32_t b, d, i, j, k, n, key, *keys;
+
+	memset(build->sizes, 0, mph->num_buckets * sizeof *build->sizes);
+
+	for (key = 0; key < count; ++key) {
+		build->hashes[key] = cip_hash(nodes[key]->name,
+					      strlen(nodes[key]->name),
+					      mph->seed);
+		++build->sizes[cip_mph_bucket(mph, build->hashes[key])];
+	}
+
+	build->starts[0] = 0;
+	for (b = 0; b < mph->num_buckets; ++b) {
+		build->starts[b + 1] = build->starts[b] + build->sizes[b];
+		build->order[b] = b;
+	}
+
+	/* Fill each bucket's keys from its end, leaving starts[b] in place */
+	for (key = 0; key < count; ++key) {
+		b = cip_mph_bucket(mph, build->hashes[key]);
+		build->keys[--build->starts[b + 1]] = key;
+	}
+
+	for (b = 0; b < mph->num_buckets; ++b)
+		build->starts[b + 1] = build->starts[b] + build->sizes[b];
+
+	qsort_r(build->order, mph->num_buckets, sizeof *build->order,
+		cip_mph_cmp, build->sizes);
+
+	memset(build->taken, 0, count);
+
+	for (i = 0; i < mph->num_buckets; ++i) {
+
+		b = build->order[i];
+		if (build->sizes[b] == 0)
+			break;
+
+		keys = build->keys + build->starts[b];
+
+		for (d = 0; d < CIP_MPH_MAX_DISP; ++d) {
+
+			mph->disp[b] = d;
+
+			for (n = 0; n < build->sizes[b]; ++n) {
+
+				k = cip_mph_slot(mph, build->hashes[keys[n]]);
+				if (build->taken[k])
+					break;
+
+				for (j = 0; j < n; ++j) {
+					if (build->slots[j] == k)
+						break;
+				}
+
+				if (j < n)
+					break;
+
+				build->slots[n] = k;
+			}
+
+			if (n == build->sizes[b])
+				break;
+		}
+
+		if (d == CIP_MPH_MAX_DISP)
+			return -1;
+
+		for (j = 0; j < n; ++j)
+			build->taken[build->slots[j]] = 1;
+	}
+
+	for (key = 0; key < count; ++key) {
+		k = cip_mph_slot(mph, build->hashes[key]);
+		mph->slots[k].node = nodes[key];
+		mph->slots[k].len = strlen(nodes[key]->name);
+	}
+
+	return 0;
+}
+
+/* mph points to cip_mph_size(count) bytes */
+int cip_mph_init(cip_err_ctx *ctx, struct cip_mph *mph,
+		 struct cip_avl_node **nodes, size_t count)
+{
+	struct cip_mph_build build;
+	unsigned seed;
+	size_t offset;
+	int ret;
+
+	mph->num_buckets = cip_mph_buckets(count);
+	mph->size = count;
+
+	offset = cip_mph_size(count) -
+			((count != 0) ? count : 1) * sizeof *mph->slots;
+	mph->slots = (struct cip_mph_slot *)((char *)mph + offset);
+
+	if (count == 0) {
+		memset(mph->disp, 0, mph->num_buckets * sizeof *mph->disp);
+		mph->seed = 0;
+		mph->size = 1;
+		mph->slots[0].node = NULL;
+		mph->slots[0].len = SIZE_MAX;	/* never matches */
+		return 0;
+	}
+
+	build.hashes = malloc(count * sizeof *build.hashes);
+	build.keys = malloc(count * sizeof *build.keys);
+	build.starts = malloc((mph->num_buckets + 1) * sizeof *build.starts);
+	build.order = malloc(mph->num_buckets * sizeof *build.order);
+	build.sizes = malloc(mph->num_buckets * sizeof *build.sizes);
+	build.slots = malloc(count * sizeof *build.slots);
+	build.taken = malloc(count);
+
+	if (build.hashes == NULL || build.keys == NULL ||
+		build.starts == NULL || build.order == NULL ||
+		build.sizes == NULL || build.slots == NULL ||
+		build.taken == NULL) {
+		ret = cip_err_int(ctx, "%s", strerror(ENOMEM));
+	}
+	else {
+		for (seed = 0; seed < CIP_MPH_MAX_SEEDS; ++seed) {
+			mph->seed = seed;
+			if (cip_mph_place(mph, &build, nodes, count) == 0)
+				break;
+		}
+
+		if (seed == CIP_MPH_MAX_SEEDS)
+			ret = cip_err_int(ctx, "Failed to build perfect hash");
+		else
+			ret = 0;
+	}
+
+	free(build.hashes);
+	free(build.keys);
+	free(build.starts);
+	free(build.order);
+	free(build.sizes);
+	free(build.slots);
+	free(build.taken);
+	return ret;
+}
+
+struct cip_avl_node *cip_mph_get(const struct cip_mph *mph, const char *name,
+				 size_t len)
+{
+	const struct cip_mph_slot *slot;
+
+	slot = &mph->slots[cip_mph_slot(mph, cip_hash(name, len, mph->seed))];
+
+	if (slot->len != len || memcmp(slot->node->name, name, len) != 0)
+		return NULL;
+
+	return slot->node;
+}
@@ -0,0 +1,623 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE	/* for strtod_l and strtof_l */
+
+#include "libcip.h"
+
+#include <string.h>
+#include <errno.h>
+#include <float.h>
+#include <locale.h>
+#include <pthread.h>
+
+/*
+ * Integer parsing.  The syntax is that of strtoull() with base 0 in the C
+ * locale, but without the locale lookups and generic base handling.  Runs of
+ * 8 decimal digits are converted at once (SWAR), after checking byte by byte
+ * that they are all digits, so nothing past the end of the string is read.
+ */
+
+__attribute__((always_inline))
+static inline unsigned cip_digit(char c)
+{
+	return (unsigned char)c - '0';
+}
+
+static unsigned cip_xdigit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return 16;
+}
+
+static int cip_8_digits(const char *s)
+{
+	unsigned i;
+
+	for (i = 0; i < 8; ++i) {
+		if (cip_digit(s[i]) > 9)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* s points to 8 ASCII digits */
+static uint64_t cip_swar_8_digits(const char *s)
+{
+	uint64_t v;
+
+	memcpy(&v, s, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	v -= 0x3030303030303030ULL;
+
+	/* Pairs, then quads, then all 8 (most significant digit is lowest) */
+	v = v * 10 + (v >> 8);
+	v = ((v & 0x000000ff000000ffULL) * (100 + (1000000ULL << 32)) +
+	     ((v >> 16) & 0x000000ff000000ffULL) * (1 + (10000ULL << 32)))
+		>> 32;
+
+	return v;
+}
+
+/* Consumes all of the digits, even after an overflow */
+static const char *cip_parse_digits(const char *s, unsigned base,
+				    uint64_t *value, int *overflow)
+{
+	uint64_t v;
+	unsigned d;
+
+	v = 0;
+	*overflow = 0;
+
+	if (base == 10) {
+		while (cip_8_digits(s)) {
+			if (__builtin_mul_overflow(v, 100000000, &v) ||
+				__builtin_add_overflow(v, cip_swar_8_digits(s),
+						       &v)) {
+				*overflow = 1;
+			}
+			s += 8;
+		}
+	}
+
+	while ((d = cip_xdigit(*s)) < base) {
+		if (__builtin_mul_overflow(v, base, &v) ||
+			__builtin_add_overflow(v, d, &v)) {
+			*overflow = 1;
+		}
+		++s;
+	}
+
+	*value = v;
+	return s;
+}
+
+/* Magnitude after any sign; NULL if there are no digits */
+static const char *cip_parse_mag(const char *s, uint64_t *value,
+				 int *overflow)
+{
+	if (*s == '0') {
+
+		if ((s[1] == 'x' || s[1] == 'X') && cip_xdigit(s[2]) < 16)
+			return cip_parse_digits(s + 2, 16, value, overflow);
+
+		/* Octal; "08" is 0 followed by '8', as with strtol() */
+		return cip_parse_digits(s, 8, value, overflow);
+	}
+
+	if (cip_digit(*s) > 9)
+		return NULL;
+
+	return cip_parse_digits(s, 10, value, overflow);
+}
+
+static const char *cip_parse_sign(const char *s, int *negative)
+{
+	while (*s == ' ' || (*s >= '\t' && *s <= '\r'))
+		++s;
+
+	*negative = (*s == '-');
+	if (*s == '-' || *s == '+')
+		++s;
+
+	return s;
+}
+
+/*
+ * Floating-point parsing.  Decimal numbers whose significand and power of 10
+ * are both exact doubles are converted with a single (correctly rounded)
+ * multiplication or division (Clinger's fast path); everything else, including
+ * hex floats, infinities and NaNs, goes to strtod_l() in the C locale.
+ */
+
+#define CIP_FLOAT_MAX_SIG	((uint64_t)1 << 53)
+
+static const double cip_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static pthread_once_t cip_c_locale_once = PTHREAD_ONCE_INIT;
+static locale_t cip_c_locale;
+
+static void cip_c_locale_init(void)
+{
+	/* Fall back to the current locale if this fails */
+	cip_c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+
+static locale_t cip_get_c_locale(void)
+{
+	pthread_once(&cip_c_locale_once, cip_c_locale_init);
+	return cip_c_locale;
+}
+
+/* Returns 0 if the slow path is needed */
+static int cip_float_fast(const char *s, double *value, char **endptr)
+{
+	uint64_t sig;
+	int negative, exp, e, exp_neg, digits, sig_digits;
+	double d;
+
+#if FLT_EVAL_METHOD != 0
+	/* Intermediate results in extended precision would round twice */
+	(void)s;
+	(void)value;
+	(void)endptr;
+	return 0;
+#endif
+
+	s = cip_parse_sign(s, &negative);
+
+	/* Hex floats */
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+		return 0;
+
+	sig = 0;
+	exp = 0;
+	digits = 0;
+	sig_digits = 0;
+
+	for (; cip_digit(*s) <= 9; ++s, ++digits) {
+		if (sig_digits != 0 || *s != '0') {
+			if (++sig_digits > 19)
+				return 0;
+			sig = sig * 10 + cip_digit(*s);
+		}
+	}
+
+	if (*s == '.') {
+		for (++s; cip_digit(*s) <= 9; ++s, ++digits) {
+			if (sig_digits != 0 || *s != '0') {
+				if (++sig_digits > 19)
+					return 0;
+				sig = sig * 10 + cip_digit(*s);
+			}
+			--exp;
+		}
+	}
+
+	/* Also infinities, NaNs and errors */
+	if (digits == 0)
+		return 0;
+
+	if (*s == 'e' || *s == 'E') {
+
+		e = 1;
+		exp_neg = (s[e] == '-');
+		if (s[e] == '-' || s[e] == '+')
+			++e;
+
+		if (cip_digit(s[e]) <= 9) {
+
+			for (s += e, e = 0; cip_digit(*s) <= 9; ++s) {
+				if (e < 10000)
+					e = e * 10 + cip_digit(*s);
+			}
+
+			exp += exp_neg ? -e : e;
+		}
+	}
+
+	/* Move powers of 10 into the significand while it stays exact */
+	while (exp > 22 && sig != 0 && sig <= CIP_FLOAT_MAX_SIG / 10) {
+		sig *= 10;
+		--exp;
+	}
+
+	if (sig == 0) {
+		d = 0.0;
+	}
+	else {
+		if (sig > CIP_FLOAT_MAX_SIG || exp < -22 || exp > 22)
+			return 0;
+
+		d = (double)sig;
+		if (exp >= 0)
+			d *= cip_pow10[exp];
+		else
+			d /= cip_pow10[-exp];
+	}
+
+	*value = negative ? -d : d;
+	*endptr = (char *)s;
+	return 1;
+}
+
+/*
+ * Formatting.  Integers are written two digits at a time from a table.
+ * Floating-point numbers get the shortest string that reads back as the same
+ * value.  For each number of significant digits in turn, the value is scaled
+ * by an exact power of 10 and rounded, and the candidate is converted back
+ * with Clinger's fast path; the first one that matches is the answer.  Values
+ * out of the fast path's range, or needing more than DBL_DIG digits, fall back
+ * to snprintf(): a number with at most DBL_DIG (or FLT_DIG) significant digits
+ * is printed exactly by "%.15g" (or "%.6g"), so only a few precisions need to
+ * be tried.
+ */
+
+static const char cip_digit_pairs[200] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"6869707172737475767778798081828384858687888990919293949596979899";
+
+/* Writes v backwards from end; returns the first digit */
+static char *cip_u64_digits(char *end, uint64_t v)
+{
+	while (v >= 100) {
+		end -= 2;
+		memcpy(end, cip_digit_pairs + (v % 100) * 2, 2);
+		v /= 100;
+	}
+
+	if (v >= 10) {
+		end -= 2;
+		memcpy(end, cip_digit_pairs + v * 2, 2);
+	}
+	else {
+		*--end = '0' + v;
+	}
+
+	return end;
+}
+
+/*
+ * Finds the fewest significant digits (up to max_digits) m, such that
+ * m / 10^*scale reads back as a (which is positive and finite).  For a float,
+ * a is its exact value, and the conversion back must round to the same float.
+ */
+static int cip_shortest(double a, int max_digits, int is_float, uint64_t *m,
+			int *scale)
+{
+	int exp10, digits, k;
+	double scaled, back;
+	uint64_t bits;
+
+	/* Estimate, then fix, the decimal exponent of the first digit */
+	memcpy(&bits, &a, sizeof bits);
+	exp10 = ((int)((bits >> 52) & 0x7ff) - 1023) * 1233 >> 12;
+
+	if (exp10 < -22 || exp10 > 21)
+		return 0;
+
+	if (exp10 >= 0 ? a < cip_pow10[exp10] : a * cip_pow10[-exp10] < 1.0)
+		--exp10;
+	else if (exp10 + 1 >= 0 && a >= cip_pow10[exp10 + 1])
+		++exp10;
+
+	for (digits = 1; digits <= max_digits; ++digits) {
+
+		k = digits - 1 - exp10;
+		if (k > 22 || k < -22)
+			return 0;
+
+		scaled = (k >= 0) ? a * cip_pow10[k] : a / cip_pow10[-k];
+		*m = (uint64_t)(scaled + 0.5);
+
+		/* Exact operands, so back is correctly rounded */
+		if (k >= 0)
+			back = (double)*m / cip_pow10[k];
+		else
+			back = (double)*m * cip_pow10[-k];
+
+		if (is_float) {
+			/*
+			 * Rounding to float again is only safe off midpoints,
+			 * or on one that is the candidate's exact value.
+			 */
+			memcpy(&bits, &back, sizeof bits);
+			if ((bits & 0x1fffffff) == 0x10000000 &&
+					(k > 0 || back >= 0x1p53)) {
+				continue;
+			}
+			back = (float)back;
+		}
+
+		if (back == a) {
+			*scale = k;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Like "%g" with just enough precision: m / 10^scale */
+static int cip_format_decimal(char *buf, size_t size, int negative,
+			      uint64_t m, int scale)
+{
+	char digits[24], tmp[40], *d, *p;
+	int num_digits, exp10, i;
+
+	while (m % 10 == 0) {
+		m /= 10;
+		--scale;
+	}
+
+	d = cip_u64_digits(digits + sizeof digits, m);
+	num_digits = digits + sizeof digits - d;
+	exp10 = num_digits - 1 - scale;
+
+	p = tmp;
+	if (negative)
+		*p++ = '-';
+
+	if (exp10 < -4 || exp10 >= 17) {
+		*p++ = d[0];
+		if (num_digits > 1) {
+			*p++ = '.';
+			memcpy(p, d + 1, num_digits - 1);
+			p += num_digits - 1;
+		}
+		*p++ = 'e';
+		*p++ = (exp10 < 0) ? '-' : '+';
+		if (exp10 < 0)
+			exp10 = -exp10;
+		if (exp10 >= 100)
+			*p++ = '0' + exp10 / 100;
+		memcpy(p, cip_digit_pairs + exp10 % 100 * 2, 2);
+		p += 2;
+	}
+	else if (exp10 < 0) {
+		*p++ = '0';
+		*p++ = '.';
+		for (i = -1; i > exp10; --i)
+			*p++ = '0';
+		memcpy(p, d, num_digits);
+		p += num_digits;
+	}
+	else if (num_digits <= exp10 + 1) {
+		memcpy(p, d, num_digits);
+		p += num_digits;
+		for (i = num_digits; i <= exp10; ++i)
+			*p++ = '0';
+	}
+	else {
+		memcpy(p, d, exp10 + 1);
+		p += exp10 + 1;
+		*p++ = '.';
+		memcpy(p, d + exp10 + 1, num_digits - exp10 - 1);
+		p += num_digits - exp10 - 1;
+	}
+
+	return cip_format_str(buf, size, tmp, p - tmp);
+}
+
+/* Integral values that are exact in an int64_t, except -0 */
+static int cip_float_integral(double d, double limit)
+{
+	return d == __builtin_trunc(d) && __builtin_fabs(d) < limit &&
+		!(d == 0.0 && __builtin_signbit(d));
+}
+
+/*
+ * Public API
+ */
+
+char *cip_parse_i64(const char *s, int64_t *value)
+{
+	int negative, overflow;
+	uint64_t mag;
+
+	s = cip_parse_mag(cip_parse_sign(s, &negative), &mag, &overflow);
+	if (s == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (overflow || mag > (uint64_t)INT64_MAX + negative) {
+		errno = ERANGE;
+		return NULL;
+	}
+
+	*value = negative ? (int64_t)-mag : (int64_t)mag;
+	return (char *)s;
+}
+
+char *cip_parse_u64(const char *s, uint64_t *value)
+{
+	int negative, overflow;
+	uint64_t mag;
+
+	s = cip_parse_sign(s, &negative);
+	if (negative) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	s = cip_parse_mag(s, &mag, &overflow);
+	if (s == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (overflow) {
+		errno = ERANGE;
+		return NULL;
+	}
+
+	*value = mag;
+	return (char *)s;
+}
+
+double cip_strtod(const char *s, char **endptr)
+{
+	locale_t c_locale;
+	char *end;
+	double d;
+
+	if (cip_float_fast(s, &d, &end)) {
+		if (endptr != NULL)
+			*endptr = end;
+		return d;
+	}
+
+	c_locale = cip_get_c_locale();
+	if (c_locale == (locale_t)0)
+		return strtod(s, endptr);
+
+	return strtod_l(s, endptr, c_locale);
+}
+
+float cip_strtof(const char *s, char **endptr)
+{
+	locale_t c_locale;
+	uint64_t bits;
+	char *end;
+	double d;
+
+	/*
+	 * Rounding the correctly rounded double to float gives the correctly
+	 * rounded float, unless the double is exactly halfway between two
+	 * floats (or the float would be denormal or overflow).
+	 */
+	if (cip_float_fast(s, &d, &end)) {
+
+		memcpy(&bits, &d, sizeof bits);
+
+		if (d == 0.0 || ((bits & 0x1fffffff) != 0x10000000 &&
+				 __builtin_fabs(d) >= FLT_MIN &&
+				 __builtin_fabs(d) <= FLT_MAX)) {
+			if (endptr != NULL)
+				*endptr = end;
+			return (float)d;
+		}
+	}
+
+	c_locale = cip_get_c_locale();
+	if (c_locale == (locale_t)0)
+		return strtof(s, endptr);
+
+	return strtof_l(s, endptr, c_locale);
+}
+
+int cip_format_i64(char *buf, size_t size, int64_t value)
+{
+	char tmp[24], *p;
+
+	if (value < 0) {
+		p = cip_u64_digits(tmp + sizeof tmp, -(uint64_t)value);
+		*--p = '-';
+	}
+	else {
+		p = cip_u64_digits(tmp + sizeof tmp, value);
+	}
+
+	return cip_format_str(buf, size, p, tmp + sizeof tmp - p);
+}
+
+int cip_format_u64(char *buf, size_t size, uint64_t value)
+{
+	char tmp[24], *p;
+
+	p = cip_u64_digits(tmp + sizeof tmp, value);
+	return cip_format_str(buf, size, p, tmp + sizeof tmp - p);
+}
+
+int cip_format_double(char *buf, size_t size, double value)
+{
+	locale_t c_locale, old;
+	char tmp[32];
+	int len, prec, scale;
+	uint64_t m;
+
+	if (cip_float_integral(value, 0x1p53))
+		return cip_format_i64(buf, size, (int64_t)value);
+
+	if (FLT_EVAL_METHOD == 0 &&
+			cip_shortest(__builtin_fabs(value), DBL_DIG, 0, &m,
+				     &scale)) {
+		return cip_format_decimal(buf, size, value < 0, m, scale);
+	}
+
+	old = (locale_t)0;
+	c_locale = cip_get_c_locale();
+	if (c_locale != (locale_t)0)
+		old = uselocale(c_locale);
+
+	for (prec = DBL_DIG; ; ++prec) {
+		len = snprintf(tmp, sizeof tmp, "%.*g", prec, value);
+		if (prec == DBL_DECIMAL_DIG || cip_strtod(tmp, NULL) == value)
+			break;
+	}
+
+	if (c_locale != (locale_t)0)
+		uselocale(old);
+
+	return cip_format_str(buf, size, tmp, len);
+}
+
+int cip_format_float(char *buf, size_t size, float value)
+{
+	locale_t c_locale, old;
+	char tmp[32];
+	int len, prec, scale;
+	uint64_t m;
+
+	if (cip_float_integral(value, 0x1p24))
+		return cip_format_i64(buf, size, (int64_t)value);
+
+	if (FLT_EVAL_METHOD == 0 &&
+			cip_shortest(__builtin_fabs(value), FLT_DECIMAL_DIG, 1,
+				     &m, &scale)) {
+		return cip_format_decimal(buf, size, value < 0, m, scale);
+	}
+
+	old = (locale_t)0;
+	c_locale = cip_get_c_locale();
+	if (c_locale != (locale_t)0)
+		old = uselocale(c_locale);
+
+	for (prec = FLT_DIG; ; ++prec) {
+		len = snprintf(tmp, sizeof tmp, "%.*g", prec, (double)value);
+		if (prec == FLT_DECIMAL_DIG || cip_strtof(tmp, NULL) == value)
+			break;
+	}
+
+	if (c_locale != (locale_t)0)
+		uselocale(old);
+
+	return cip_format_str(buf, size, tmp, len);
+}
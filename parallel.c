@@ -0,0 +1,1215 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Parallel parsing.  The buffer is split into chunks at section headers, and
+ * each chunk is parsed into its own cip_ini_file by a pool of threads.  The
+ * results are then merged, and the file-level checks and post-parse callbacks
+ * are run, on the calling thread.
+ *
+ * The outcome is the same as cip_parse_buffer() -- including which error is
+ * reported and which warnings are passed to warning_fn (in order) before it.
+ * Workers record warnings rather than calling warning_fn (or the schema's
+ * diag_fn), and the check of
+ * each chunk's last section is deferred, because it must be reported after any
+ * error in the next chunk's first line.
+ *
+ * Batches of files are also parsed on a pool of threads, one file per task.
+ * Again, warnings are replayed in order afterwards, so warning_fn and diag_fn
+ * are only ever called by the calling thread.
+ */
+
+#ifndef CIP_MT_MIN_CHUNK
+#define CIP_MT_MIN_CHUNK	(256 * 1024)	/* bytes */
+#endif
+
+#define CIP_MT_CHUNKS_PER_THREAD	4
+
+struct cip_mt_warning {
+	char *msg;			/* for warning_fn */
+	cip_diag *diag;			/* or for diag_fn, with its strings */
+	int line;
+};
+
+struct cip_mt_warnings {
+	struct cip_mt_warning *list;
+	size_t count;
+	size_t size;
+	cip_err_ctx *err;
+	const int *line_num;		/* NULL if lines aren't needed */
+};
+
+struct cip_mt_pool {
+	void (*task_fn)(void *arg, unsigned i);
+	void *arg;
+	unsigned num_tasks;
+	unsigned next;
+};
+
+struct cip_mt_chunk {
+	const char *start;
+	size_t len;
+	int base;			/* lines before this chunk */
+	int lines;			/* newlines in this chunk */
+	cip_ini_file *file;
+	cip_err_ctx err;
+	int err_line;			/* 0 if no error */
+	int end_err;			/* error is from last section check */
+	struct cip_mt_warnings warnings;
+};
+
+struct cip_mt_job {
+	struct cip_mt_chunk *chunks;
+	unsigned num_chunks;
+	const char *name;
+	const cip_file_schema *schema;
+	int (*warning_fn)(const char *warn_msg);
+};
+
+/* One per section schema; shells[i] is the section from the i-th chunk in
+   which it appears, and insts holds the IDs of each, as sorted runs */
+struct cip_mt_sect {
+	const cip_sect_schema *schema;
+	cip_ini_sect **shells;
+	unsigned num_shells;
+	struct cip_avl_node **insts;
+	size_t num_insts;
+	size_t insts_size;
+	size_t *run_ends;
+};
+
+struct cip_mt_dup {
+	const cip_ini_sect *sect;
+	int line;			/* INT_MAX if none */
+};
+
+/*
+ * Worker threads
+ */
+
+/* Warnings are recorded by workers and replayed by the calling thread */
+
+static __thread struct cip_mt_warnings *cip_mt_current;
+
+/* Takes ownership of msg or diag, whether or not it succeeds */
+static int cip_mt_record(char *msg, cip_diag *diag)
+{
+	struct cip_mt_warning *new_list;
+	struct cip_mt_warnings *w;
+	size_t new_size;
+
+	w = cip_mt_current;
+
+	if (msg == NULL && diag == NULL)
+		return cip_err_int(w->err, "%s", strerror(ENOMEM));
+
+	if (w->count == w->size) {
+
+		new_size = (w->size != 0) ? w->size * 2 : 16;
+
+		new_list = realloc(w->list, new_size * sizeof *new_list);
+		if (new_list == NULL) {
+			free(msg);
+			free(diag);
+			return cip_err_int(w->err, "%s", strerror(ENOMEM));
+		}
+
+		w->list = new_list;
+		w->size = new_size;
+	}
+
+	w->list[w->count].msg = msg;
+	w->list[w->count].diag = diag;
+	w->list[w->count].line = (w->line_num != NULL) ? *w->line_num : 0;
+	++w->count;
+
+	return 0;
+}
+
+static int cip_mt_warning_fn(const char *warn_msg)
+{
+	return cip_mt_record(strdup(warn_msg), NULL);
+}
+
+/* Copies s to *p, and moves *p past it */
+static const char *cip_mt_diag_str(char **p, const char *s)
+{
+	const char *copy;
+	size_t size;
+
+	if (s == NULL)
+		return NULL;
+
+	size = strlen(s) + 1;
+	copy = memcpy(*p, s, size);
+	*p += size;
+
+	return copy;
+}
+
+static int cip_mt_diag_fn(const cip_diag *diag)
+{
+	const char *strs[5];
+	cip_diag *copy;
+	size_t size;
+	unsigned i;
+	char *p;
+
+	strs[0] = diag->file_name;
+	strs[1] = diag->sect;
+	strs[2] = diag->id;
+	strs[3] = diag->opt;
+	strs[4] = diag->detail;
+
+	size = sizeof *copy;
+	for (i = 0; i < 5; ++i) {
+		if (strs[i] != NULL)
+			size += strlen(strs[i]) + 1;
+	}
+
+	copy = malloc(size);
+	if (copy == NULL)
+		return cip_mt_record(NULL, NULL);
+
+	*copy = *diag;
+	p = (char *)(copy + 1);
+	copy->file_name = cip_mt_diag_str(&p, diag->file_name);
+	copy->sect = cip_mt_diag_str(&p, diag->sect);
+	copy->id = cip_mt_diag_str(&p, diag->id);
+	copy->opt = cip_mt_diag_str(&p, diag->opt);
+	copy->detail = cip_mt_diag_str(&p, diag->detail);
+
+	return cip_mt_record(NULL, copy);
+}
+
+/* Starts recording this thread's warnings in w */
+static void cip_mt_record_start(struct cip_mt_warnings *w,
+				const cip_file_schema *schema)
+{
+	cip_mt_current = w;
+	cip_diag_record = (schema->diag_fn != 0) ? cip_mt_diag_fn : 0;
+}
+
+static void cip_mt_record_stop(void)
+{
+	cip_mt_current = NULL;
+	cip_diag_record = 0;
+}
+
+/* Passes a recorded warning on; on failure, err gets the message */
+static int cip_mt_replay(const struct cip_mt_warning *w,
+			 const cip_file_schema *schema,
+			 int (*warning_fn)(const char *warn_msg),
+			 cip_err_ctx *err)
+{
+	if (w->diag != NULL) {
+		if (schema->diag_fn(w->diag, schema->diag_data) != -1)
+			return 0;
+		cip_err_diag(err, w->diag);
+		return -1;
+	}
+
+	if (warning_fn(w->msg) != -1)
+		return 0;
+
+	return cip_err_int(err, "%s", w->msg);
+}
+
+static void cip_mt_warnings_free(struct cip_mt_warnings *w)
+{
+	size_t i;
+
+	for (i = 0; i < w->count; ++i) {
+		free(w->list[i].msg);
+		free(w->list[i].diag);
+	}
+
+	free(w->list);
+}
+
+static void *cip_mt_worker(void *arg)
+{
+	struct cip_mt_pool *pool;
+	unsigned i;
+
+	pool = arg;
+
+	while (1) {
+		i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+		if (i >= pool->num_tasks)
+			break;
+		pool->task_fn(pool->arg, i);
+	}
+
+	return NULL;
+}
+
+/* If a thread can't be created, the others (and this one) do its share */
+static void cip_mt_run(void (*task_fn)(void *arg, unsigned i), void *arg,
+		       unsigned num_tasks, pthread_t *threads,
+		       unsigned num_threads)
+{
+	struct cip_mt_pool pool;
+	unsigned i;
+
+	pool.task_fn = task_fn;
+	pool.arg = arg;
+	pool.num_tasks = num_tasks;
+	pool.next = 0;
+
+	for (i = 0; i < num_threads - 1; ++i) {
+		if (pthread_create(&threads[i], NULL, cip_mt_worker,
+				   &pool) != 0) {
+			break;
+		}
+	}
+
+	cip_mt_worker(&pool);
+
+	while (i-- > 0)
+		pthread_join(threads[i], NULL);
+}
+
+static unsigned cip_mt_threads(unsigned threads)
+{
+	long cpus;
+
+	if (threads != 0)
+		return threads;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? cpus : 1;
+}
+
+/*
+ * Parsing chunks
+ */
+
+static void cip_mt_count_chunk(void *arg, unsigned i)
+{
+	struct cip_mt_chunk *chunk;
+	struct cip_mt_job *job;
+	const char *p, *end;
+	int lines;
+
+	job = arg;
+	chunk = &job->chunks[i];
+	p = chunk->start;
+	end = p + chunk->len;
+
+	for (lines = 0; (p = memchr(p, '\n', end - p)) != NULL; ++p)
+		++lines;
+
+	chunk->lines = lines;
+}
+
+static void cip_mt_parse_chunk(void *arg, unsigned i)
+{
+	struct cip_parse_ctx ctx;
+	struct cip_mt_chunk *chunk;
+	struct cip_arena *prev;
+	struct cip_mt_job *job;
+
+	job = arg;
+	chunk = &job->chunks[i];
+	chunk->warnings.err = &chunk->err;
+	chunk->warnings.line_num = &ctx.line_num;
+
+	if (cip_parse_ctx_init(&ctx, &chunk->err, job->name, job->schema,
+			       job->warning_fn ? cip_mt_warning_fn : 0) == -1) {
+		chunk->err_line = chunk->base + 1;
+		return;
+	}
+
+	cip_mt_record_start(&chunk->warnings, job->schema);
+
+	ctx.keep_source = 1;
+	ctx.line_num = chunk->base;
+	prev = cip_arena_enter(ctx.file->arena);
+
+	if (cip_parse_mem(&ctx, chunk->start, chunk->len) == -1) {
+		chunk->err_line = ctx.line_num;
+	}
+	else {
+		/* Last section ends at the next chunk's first line */
+		if (i + 1 < job->num_chunks)
+			ctx.line_num = job->chunks[i + 1].base + 1;
+
+		if (cip_check_prev_sect(&ctx) == -1) {
+			chunk->err_line = ctx.line_num;
+			chunk->end_err = 1;
+		}
+	}
+
+	cip_arena_leave(prev);
+	cip_mt_record_stop();
+
+	free(ctx.scratch);
+	chunk->file = ctx.file;
+}
+
+/*
+ * Splitting
+ */
+
+static unsigned cip_mt_split(struct cip_mt_chunk *chunks, unsigned max_chunks,
+			     const char *buf, size_t len)
+{
+	size_t start, pos;
+	unsigned i, n;
+
+	start = 0;
+	n = 0;
+
+	for (i = 1; i < max_chunks; ++i) {
+
+		pos = len / max_chunks * i;
+		if (pos < start)
+			pos = start;
+
+		pos = cip_next_header(buf, len, pos);
+		if (pos == len)
+			break;
+
+		chunks[n].start = buf + start;
+		chunks[n].len = pos - start;
+		++n;
+
+		start = pos;
+	}
+
+	chunks[n].start = buf + start;
+	chunks[n].len = len - start;
+
+	return n + 1;
+}
+
+/*
+ * Merging
+ */
+
+static int cip_mt_inst_cb(struct cip_avl_node *node, void *context)
+{
+	struct cip_avl_node **new_insts;
+	struct cip_mt_sect *sect;
+	size_t new_size;
+
+	sect = context;
+
+	if (sect->num_insts == sect->insts_size) {
+
+		new_size = (sect->insts_size != 0) ? sect->insts_size * 2 : 64;
+
+		new_insts = realloc(sect->insts, new_size * sizeof *new_insts);
+		if (new_insts == NULL)
+			return 0;
+
+		sect->insts = new_insts;
+		sect->insts_size = new_size;
+	}
+
+	sect->insts[sect->num_insts++] = node;
+	return 1;
+}
+
+struct cip_mt_collect_ctx {
+	struct cip_mt_sect *sects;
+	unsigned next;
+};
+
+static int cip_mt_sect_cb(struct cip_avl_node *node, void *context)
+{
+	struct cip_mt_collect_ctx *ctx;
+	struct cip_mt_sect *sect;
+	cip_ini_sect *shell;
+
+	ctx = context;
+	shell = (cip_ini_sect *)node;
+
+	/* Both trees are sorted by name, so this never passes the end */
+	while (ctx->sects[ctx->next].schema != shell->schema)
+		++ctx->next;
+
+	sect = &ctx->sects[ctx->next];
+	sect->shells[sect->num_shells] = shell;
+
+	if (shell->schema->flags & CIP_SECT_MULTIPLE) {
+
+		if (cip_avl_foreach((struct cip_avl_node *)shell->instances,
+				    cip_mt_inst_cb, sect) == 0) {
+			return 0;
+		}
+
+		sect->run_ends[sect->num_shells] = sect->num_insts;
+	}
+
+	++sect->num_shells;
+	return 1;
+}
+
+static int cip_mt_schema_cb(struct cip_avl_node *node, void *context)
+{
+	struct cip_mt_collect_ctx *ctx;
+
+	ctx = context;
+	ctx->sects[ctx->next++].schema = (cip_sect_schema *)node;
+	return 1;
+}
+
+static void cip_mt_dup_check(struct cip_mt_dup *dup, struct cip_avl_node *a,
+			     struct cip_avl_node *b)
+{
+	const cip_ini_sect *later;
+
+	later = (cip_ini_sect *)a;
+	if (((cip_ini_sect *)b)->line > later->line)
+		later = (cip_ini_sect *)b;
+
+	if (later->line < dup->line) {
+		dup->sect = later;
+		dup->line = later->line;
+	}
+}
+
+/* Merges the runs of instances, noting the first duplicate (by line) */
+static int cip_mt_merge_runs(struct cip_mt_sect *sect, struct cip_mt_dup *dup)
+{
+	struct cip_avl_node **in, **out, **a, **a_end, **b, **b_end, **tmp;
+	unsigned num_runs, i, j;
+	size_t start;
+	int cmp;
+
+	num_runs = sect->num_shells;
+	if (num_runs < 2)
+		return 0;
+
+	tmp = malloc(sect->num_insts * sizeof *tmp);
+	if (tmp == NULL)
+		return -1;
+
+	in = sect->insts;
+	out = tmp;
+
+	while (num_runs > 1) {
+
+		start = 0;
+
+		for (i = 0, j = 0; i < num_runs; i += 2, ++j) {
+
+			a = in + start;
+			a_end = in + sect->run_ends[i];
+			b = a_end;
+			b_end = (i + 1 < num_runs) ?
+					in + sect->run_ends[i + 1] : a_end;
+
+			while (a < a_end && b < b_end) {
+				cmp = strcmp((*a)->name, (*b)->name);
+				if (cmp == 0)
+					cip_mt_dup_check(dup, *a, *b);
+				out[start++] = (cmp <= 0) ? *a++ : *b++;
+			}
+
+			while (a < a_end)
+				out[start++] = *a++;
+			while (b < b_end)
+				out[start++] = *b++;
+
+			sect->run_ends[j] = start;
+		}
+
+		num_runs = j;
+		tmp = in;
+		in = out;
+		out = tmp;
+	}
+
+	/* The sorted instances are in 'in'; the other buffer is scratch */
+	free(out);
+	sect->insts = in;
+
+	return 0;
+}
+
+static void cip_mt_sects_free(struct cip_mt_sect *sects, unsigned num_sects)
+{
+	unsigned i;
+
+	for (i = 0; i < num_sects; ++i) {
+		free(sects[i].shells);
+		free(sects[i].insts);
+		free(sects[i].run_ends);
+	}
+
+	free(sects);
+}
+
+static struct cip_mt_sect *cip_mt_collect(struct cip_mt_job *job,
+					  unsigned num_sects,
+					  struct cip_mt_dup *dup)
+{
+	struct cip_mt_collect_ctx ctx;
+	struct cip_mt_sect *sects;
+	cip_ini_sect *shell;
+	unsigned i;
+
+	sects = calloc(num_sects, sizeof *sects);
+	if (sects == NULL)
+		return NULL;
+
+	ctx.sects = sects;
+	ctx.next = 0;
+	cip_avl_foreach((struct cip_avl_node *)job->schema->sections,
+			cip_mt_schema_cb, &ctx);
+
+	for (i = 0; i < num_sects; ++i) {
+
+		sects[i].shells = malloc(job->num_chunks *
+						sizeof *sects[i].shells);
+		if (sects[i].shells == NULL)
+			goto error;
+
+		if (sects[i].schema->flags & CIP_SECT_MULTIPLE) {
+			sects[i].run_ends = malloc(job->num_chunks *
+						sizeof *sects[i].run_ends);
+			if (sects[i].run_ends == NULL)
+				goto error;
+		}
+	}
+
+	for (i = 0; i < job->num_chunks; ++i) {
+
+		ctx.next = 0;
+		if (cip_avl_foreach((struct cip_avl_node *)
+						job->chunks[i].file->sections,
+				    cip_mt_sect_cb, &ctx) == 0) {
+			goto error;
+		}
+	}
+
+	for (i = 0; i < num_sects; ++i) {
+
+		if (sects[i].schema->flags & CIP_SECT_MULTIPLE) {
+			if (cip_mt_merge_runs(&sects[i], dup) == -1)
+				goto error;
+		}
+		else if (sects[i].num_shells > 1) {
+			/* Sections are seen in chunk (and line) order */
+			shell = sects[i].shells[1];
+			if (shell->line < dup->line) {
+				dup->sect = shell;
+				dup->line = shell->line;
+			}
+		}
+	}
+
+	return sects;
+
+error:
+	cip_mt_sects_free(sects, num_sects);
+	return NULL;
+}
+
+static int cip_mt_num_sects_cb(struct cip_avl_node *node
+					__attribute__((unused)),
+			       void *context)
+{
+	++*(unsigned *)context;
+	return 1;
+}
+
+static int cip_mt_err(cip_err_ctx *err_ctx, const char *name,
+		      const struct cip_mt_dup *dup,
+		      const struct cip_mt_chunk *c)
+{
+	const cip_ini_sect *sect;
+
+	if (c != NULL)
+		return cip_err_int(err_ctx, "%s", cip_last_err(&c->err));
+
+	sect = dup->sect;
+
+	if (sect->schema->flags & CIP_SECT_MULTIPLE) {
+		return cip_err_int(err_ctx, "%s:%d: Duplicate section [%s:%s]",
+				   name, dup->line, sect->schema->node.name,
+				   sect->node.name);
+	}
+
+	return cip_err_int(err_ctx, "%s:%d: Duplicate section [%s]", name,
+			   dup->line, sect->node.name);
+}
+
+/* Replays warnings and reports the first error, in file order */
+static int cip_mt_report(struct cip_mt_job *job, cip_err_ctx *err_ctx,
+			 const struct cip_mt_dup *dup)
+{
+	const struct cip_mt_chunk *chunk, *pending;
+	const struct cip_mt_warning *w;
+	int dup_line, next_base;
+	unsigned i;
+	size_t j;
+
+	pending = NULL;
+
+	for (i = 0; i < job->num_chunks; ++i) {
+
+		chunk = &job->chunks[i];
+
+		next_base = (i + 1 < job->num_chunks) ?
+					job->chunks[i + 1].base : INT_MAX;
+		dup_line = (dup->line > chunk->base &&
+				dup->line <= next_base) ? dup->line : INT_MAX;
+
+		if (pending != NULL) {
+
+			/* Errors in a header line come before the check of
+			   the previous section */
+
+			if (dup_line == chunk->base + 1) {
+				return cip_mt_err(err_ctx, job->name, dup,
+						  NULL);
+			}
+
+			if (chunk->err_line == chunk->base + 1 &&
+							!chunk->end_err) {
+				return cip_mt_err(err_ctx, job->name, dup,
+						  chunk);
+			}
+
+			return cip_mt_err(err_ctx, job->name, dup, pending);
+		}
+
+		for (j = 0; j < chunk->warnings.count; ++j) {
+
+			w = &chunk->warnings.list[j];
+			if (w->line >= dup_line)
+				break;
+
+			if (cip_mt_replay(w, job->schema, job->warning_fn,
+					  err_ctx) == -1) {
+				return -1;
+			}
+		}
+
+		if (dup_line != INT_MAX)
+			return cip_mt_err(err_ctx, job->name, dup, NULL);
+
+		if (chunk->err_line != 0) {
+			if (!chunk->end_err)
+				return cip_mt_err(err_ctx, job->name, dup,
+						  chunk);
+			pending = chunk;
+		}
+	}
+
+	if (pending != NULL)
+		return cip_mt_err(err_ctx, job->name, dup, pending);
+
+	return 0;
+}
+
+/* Moves all sections (and the chunks' arenas) into file */
+static void cip_mt_build(cip_ini_file *file, struct cip_mt_job *job,
+			 struct cip_mt_sect *sects, unsigned num_sects,
+			 struct cip_avl_node **nodes)
+{
+	struct cip_arena *prev;
+	cip_ini_file *chunk;
+	cip_ini_sect *shell;
+	unsigned i, j, n;
+
+	for (i = 0; i < job->num_chunks; ++i) {
+		chunk = job->chunks[i].file;
+		file->flags |= chunk->flags & CIP_INI_SOURCE;
+		if (file->arena != NULL)
+			cip_arena_adopt(file->arena, chunk->arena);
+	}
+
+	prev = cip_arena_enter(file->arena);
+
+	for (i = 0, n = 0; i < num_sects; ++i) {
+
+		if (sects[i].num_shells == 0)
+			continue;
+
+		shell = sects[i].shells[0];
+
+		if (shell->schema->flags & CIP_SECT_MULTIPLE) {
+
+			shell->instances = (cip_ini_sect *)
+				cip_avl_build(sects[i].insts,
+					      sects[i].num_insts);
+
+			for (j = 1; j < sects[i].num_shells; ++j)
+				cip_free(sects[i].shells[j]);
+		}
+
+		nodes[n++] = &shell->node;
+	}
+
+	cip_arena_leave(prev);
+
+	file->sections = (cip_ini_sect *)cip_avl_build(nodes, n);
+	cip_mt_sects_free(sects, num_sects);
+	free(nodes);
+}
+
+static void cip_mt_chunks_free(struct cip_mt_job *job, int free_files)
+{
+	struct cip_mt_chunk *chunk;
+	unsigned i;
+
+	for (i = 0; i < job->num_chunks; ++i) {
+
+		chunk = &job->chunks[i];
+
+		if (chunk->file != NULL) {
+			if (free_files)
+				cip_ini_file_free(chunk->file);
+			else if (chunk->file->arena == NULL)
+				free(chunk->file);
+		}
+
+		cip_mt_warnings_free(&chunk->warnings);
+		cip_err_ctx_fini(&chunk->err);
+	}
+
+	free(job->chunks);
+}
+
+static cip_ini_file *cip_mt_merge(struct cip_mt_job *job, cip_err_ctx *err_ctx,
+				  int total_lines)
+{
+	struct cip_avl_node **nodes;
+	struct cip_parse_ctx ctx;
+	struct cip_mt_sect *sects;
+	struct cip_mt_dup dup;
+	unsigned num_sects, i;
+
+	num_sects = 0;
+	cip_avl_foreach((struct cip_avl_node *)job->schema->sections,
+			cip_mt_num_sects_cb, &num_sects);
+
+	/* Trees of failed chunks are incomplete, but may be examined */
+
+	dup.sect = NULL;
+	dup.line = INT_MAX;
+
+	for (i = 0; i < job->num_chunks; ++i) {
+		if (job->chunks[i].file == NULL)
+			break;
+	}
+
+	if (i < job->num_chunks) {
+		sects = NULL;
+	}
+	else {
+		sects = cip_mt_collect(job, num_sects, &dup);
+		if (sects == NULL) {
+			cip_err(err_ctx, "%s", strerror(ENOMEM));
+			goto error;
+		}
+	}
+
+	if (cip_mt_report(job, err_ctx, &dup) == -1) {
+		if (sects != NULL)
+			cip_mt_sects_free(sects, num_sects);
+		goto error;
+	}
+
+	nodes = malloc((num_sects + 1) * sizeof *nodes);
+	if (nodes == NULL) {
+		cip_err(err_ctx, "%s", strerror(ENOMEM));
+		cip_mt_sects_free(sects, num_sects);
+		goto error;
+	}
+
+	if (cip_parse_ctx_init(&ctx, err_ctx, job->name, job->schema,
+			       job->warning_fn) == -1) {
+		free(nodes);
+		cip_mt_sects_free(sects, num_sects);
+		goto error;
+	}
+
+	cip_mt_build(ctx.file, job, sects, num_sects, nodes);
+	cip_mt_chunks_free(job, 0);
+
+	ctx.line_num = total_lines;
+	return cip_parse_finish(&ctx);
+
+error:
+	cip_mt_chunks_free(job, 1);
+	return NULL;
+}
+
+/*
+ * Batch parsing
+ */
+
+struct cip_mt_batch {
+	cip_parse_result *results;
+	struct cip_mt_warnings *warnings;
+	const cip_file_schema *schema;
+	int (*warning_fn)(const char *warn_msg);
+};
+
+static void cip_mt_parse_file(void *arg, unsigned i)
+{
+	struct cip_mt_batch *batch;
+	cip_parse_result *result;
+
+	batch = arg;
+	result = &batch->results[i];
+	batch->warnings[i].err = &result->err;
+	cip_mt_record_start(&batch->warnings[i], batch->schema);
+
+	result->file = cip_parse_mmap(&result->err, result->file_name,
+				      batch->schema,
+				      batch->warning_fn ? cip_mt_warning_fn : 0);
+
+	cip_mt_record_stop();
+}
+
+/* Takes ownership of results (whose file names are set) */
+static cip_parse_result *cip_mt_batch_run(cip_err_ctx *err_ctx,
+					  cip_parse_result *results,
+					  unsigned count,
+					  const cip_file_schema *schema,
+					  int (*warning_fn)(const char *warn_msg),
+					  unsigned threads)
+{
+	struct cip_mt_batch batch;
+	cip_parse_result *result;
+	struct cip_mt_warning *w;
+	pthread_t *tids;
+	unsigned i;
+	size_t j;
+
+	threads = cip_mt_threads(threads);
+	if (threads > count)
+		threads = count;
+
+	batch.results = results;
+	batch.schema = schema;
+	batch.warning_fn = warning_fn;
+	batch.warnings = calloc(count + 1, sizeof *batch.warnings);
+	tids = malloc((threads + 1) * sizeof *tids);
+
+	if (batch.warnings == NULL || tids == NULL) {
+		cip_err(err_ctx, "%s", strerror(ENOMEM));
+		free(batch.warnings);
+		free(tids);
+		cip_parse_results_free(results, count);
+		return NULL;
+	}
+
+	if (count != 0)
+		cip_mt_run(cip_mt_parse_file, &batch, count, tids, threads);
+
+	free(tids);
+
+	/* Same outcome as a warning_fn failure during a serial parse */
+
+	for (i = 0; i < count; ++i) {
+
+		result = &results[i];
+
+		for (j = 0; j < batch.warnings[i].count; ++j) {
+
+			w = &batch.warnings[i].list[j];
+			if (cip_mt_replay(w, schema, warning_fn,
+					  &result->err) != -1) {
+				continue;
+			}
+
+			if (result->file != NULL) {
+				cip_ini_file_free(result->file);
+				result->file = NULL;
+			}
+
+			break;
+		}
+
+		cip_mt_warnings_free(&batch.warnings[i]);
+	}
+
+	free(batch.warnings);
+
+	return results;
+}
+
+static int cip_mt_name_cmp(const void *a, const void *b)
+{
+	return strcmp(((const cip_parse_result *)a)->file_name,
+		      ((const cip_parse_result *)b)->file_name);
+}
+
+/*
+ * Regular files, or symlinks to them; d_type doesn't say where a symlink
+ * points, and some filesystems don't set it at all.  An entry that can't be
+ * stat'ed (e.g. a dangling symlink) is kept, so that parsing reports it.
+ */
+static int cip_mt_dir_match(DIR *dir, const struct dirent *entry,
+			    const char *suffix)
+{
+	size_t name_len, suffix_len;
+	struct stat st;
+
+	if (entry->d_name[0] == '.')
+		return 0;
+
+	if (suffix != NULL) {
+
+		name_len = strlen(entry->d_name);
+		suffix_len = strlen(suffix);
+
+		if (name_len <= suffix_len ||
+				strcmp(entry->d_name + name_len - suffix_len,
+				       suffix) != 0) {
+			return 0;
+		}
+	}
+
+	if (entry->d_type == DT_REG)
+		return 1;
+
+	if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
+		return 0;
+
+	if (fstatat(dirfd(dir), entry->d_name, &st, 0) == -1)
+		return 1;
+
+	return S_ISREG(st.st_mode);
+}
+
+static cip_parse_result *cip_mt_dir_list(cip_err_ctx *err_ctx,
+					 const char *dir_name,
+					 const char *suffix, unsigned *count)
+{
+	cip_parse_result *results, *new_results;
+	struct dirent *entry;
+	unsigned n, size;
+	char *path;
+	DIR *dir;
+
+	dir = opendir(dir_name);
+	if (dir == NULL)
+		return cip_err_ptr(err_ctx, "%s: %m", dir_name);
+
+	results = NULL;
+	n = 0;
+	size = 0;
+
+	while (1) {
+
+		errno = 0;
+		entry = readdir(dir);
+		if (entry == NULL) {
+			if (errno != 0) {
+				cip_err(err_ctx, "%s: %m", dir_name);
+				goto error;
+			}
+			break;
+		}
+
+		if (!cip_mt_dir_match(dir, entry, suffix))
+			continue;
+
+		if (n == size) {
+
+			size = (size != 0) ? size * 2 : 64;
+
+			new_results = realloc(results, size * sizeof *results);
+			if (new_results == NULL) {
+				cip_err(err_ctx, "%s", strerror(ENOMEM));
+				goto error;
+			}
+
+			results = new_results;
+		}
+
+		if (asprintf(&path, "%s/%s", dir_name, entry->d_name) == -1) {
+			cip_err(err_ctx, "%s", strerror(ENOMEM));
+			goto error;
+		}
+
+		results[n].file_name = path;
+		results[n].file = NULL;
+		cip_err_ctx_init(&results[n].err);
+		++n;
+	}
+
+	closedir(dir);
+
+	/* No matches isn't a failure, so it can't be NULL */
+	if (results == NULL) {
+		results = calloc(1, sizeof *results);
+		if (results == NULL)
+			return cip_err_ptr(err_ctx, "%s", strerror(ENOMEM));
+	}
+
+	/* Not alphasort(), which depends on the locale */
+	if (n != 0)
+		qsort(results, n, sizeof *results, cip_mt_name_cmp);
+
+	*count = n;
+	return results;
+
+error:
+	closedir(dir);
+	cip_parse_results_free(results, n);
+	return NULL;
+}
+
+/*
+ * Public API
+ */
+
+cip_ini_file *cip_parse_buffer_mt(cip_err_ctx *err_ctx, const char *buf,
+				  size_t len, const char *name,
+				  const cip_file_schema *schema,
+				  int (*warning_fn)(const char *warn_msg),
+				  unsigned threads)
+{
+	struct cip_mt_chunk *last;
+	struct cip_mt_job job;
+	size_t max_chunks;
+	pthread_t *tids;
+	unsigned i;
+	int lines;
+
+	threads = cip_mt_threads(threads);
+
+	max_chunks = len / CIP_MT_MIN_CHUNK;
+	if (max_chunks > (size_t)threads * CIP_MT_CHUNKS_PER_THREAD)
+		max_chunks = (size_t)threads * CIP_MT_CHUNKS_PER_THREAD;
+
+	if (threads == 1 || max_chunks < 2) {
+		return cip_parse_buffer(err_ctx, buf, len, name, schema,
+					warning_fn);
+	}
+
+	job.chunks = calloc(max_chunks, sizeof *job.chunks);
+	if (job.chunks == NULL)
+		return cip_err_ptr(err_ctx, "%s", strerror(ENOMEM));
+
+	job.num_chunks = cip_mt_split(job.chunks, max_chunks, buf, len);
+	job.name = name;
+	job.schema = schema;
+	job.warning_fn = warning_fn;
+
+	if (threads > job.num_chunks)
+		threads = job.num_chunks;
+
+	tids = malloc(threads * sizeof *tids);
+	if (tids == NULL) {
+		free(job.chunks);
+		return cip_err_ptr(err_ctx, "%s", strerror(ENOMEM));
+	}
+
+	for (i = 0; i < job.num_chunks; ++i)
+		cip_err_ctx_init(&job.chunks[i].err);
+
+	/* Line numbers are needed before the chunks can be parsed */
+
+	cip_mt_run(cip_mt_count_chunk, &job, job.num_chunks, tids, threads);
+
+	for (i = 0, lines = 0; i < job.num_chunks; ++i) {
+		job.chunks[i].base = lines;
+		lines += job.chunks[i].lines;
+	}
+
+	cip_mt_run(cip_mt_parse_chunk, &job, job.num_chunks, tids, threads);
+	free(tids);
+
+	last = &job.chunks[job.num_chunks - 1];
+	if (last->len != 0 && last->start[last->len - 1] != '\n')
+		++lines;
+
+	return cip_mt_merge(&job, err_ctx, lines);
+}
+
+void cip_parse_results_free(cip_parse_result *results, unsigned count)
+{
+	unsigned i;
+
+	for (i = 0; i < count; ++i) {
+		free(results[i].file_name);
+		if (results[i].file != NULL)
+			cip_ini_file_free(results[i].file);
+		cip_err_ctx_fini(&results[i].err);
+	}
+
+	free(results);
+}
+
+cip_parse_result *cip_parse_files(cip_err_ctx *err_ctx,
+				  const char *const *file_names,
+				  unsigned count,
+				  const cip_file_schema *schema,
+				  int (*warning_fn)(const char *warn_msg),
+				  unsigned threads)
+{
+	cip_parse_result *results;
+	unsigned i;
+
+	results = calloc(count + 1, sizeof *results);
+	if (results == NULL)
+		return cip_err_ptr(err_ctx, "%s", strerror(ENOMEM));
+
+	for (i = 0; i < count; ++i) {
+
+		results[i].file_name = strdup(file_names[i]);
+		if (results[i].file_name == NULL) {
+			cip_parse_results_free(results, i);
+			return cip_err_ptr(err_ctx, "%s", strerror(ENOMEM));
+		}
+
+		cip_err_ctx_init(&results[i].err);
+	}
+
+	return cip_mt_batch_run(err_ctx, results, count, schema, warning_fn,
+				threads);
+}
+
+cip_parse_result *cip_parse_dir(cip_err_ctx *err_ctx, const char *dir_name,
+				const char *suffix, unsigned *count,
+				const cip_file_schema *schema,
+				int (*warning_fn)(const char *warn_msg),
+				unsigned threads)
+{
+	cip_parse_result *results;
+
+	results = cip_mt_dir_list(err_ctx, dir_name, suffix, count);
+	if (results == NULL)
+		return NULL;
+
+	return cip_mt_batch_run(err_ctx, results, *count, schema, warning_fn,
+				threads);
+}
@@ -14,144 +14,40 @@
  *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
  */
 
-#if 0
-#define SUBSTR_DEBUG
-#endif
-
-#define _GNU_SOURCE	/* for rawmemchr */
+#define _GNU_SOURCE	/* for memrchr */
 
 #include "libcip.h"
 #include "libcip_p.h"
 
 #include <string.h>
 #include <stdarg.h>
-#include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
-
-/*
- * String splitting and whitespace trimming
- */
-
-struct cip_substr {
-	char *start;
-	char *end;
-	char restore;
-};
-
-static inline void cip_str_restore(const struct cip_substr *substr)
-{
-	*(substr->end) = substr->restore;
-}
-
-static void cip_str_trim(struct cip_substr *substr, char *s)
-{
-	char *end;
-
-	/* It isn't 100% clear that isspace(0) ALWAYS returns 0 */
-
-	while (1) {
-
-		if (*s == 0) {
-			substr->start = s;
-			substr->end = s;
-			substr->restore = 0;
-			return;
-		}
-
-		if (!isspace(*s))
-			break;
-
-		++s;
-	}
-
-	/* s now points to the first non-whitespace (and non-0) character */
-
-	end = rawmemchr(s, 0) - 1;
-
-	while (isspace(*end))
-		--end;
-
-	++end;
-
-	/* end now points to the char AFTER the last non-whitespace char */
-
-	substr->start = s;
-	substr->end = end;
-	substr->restore = *end;
-
-	*end = 0;
-}
-
-static char *cip_str_split(struct cip_substr *before, char *s, char delim)
-{
-	char *d;
-
-	d = strchr(s, delim);
-	if (d == NULL)
-		return NULL;
-
-	*d = 0;
-	cip_str_trim(before, s);
-
-	if (before->restore == 0)
-		before->restore = delim;
-	else
-		*d = delim;
-
-	return d + 1;
-}
-
-static int cip_str_split_trim(struct cip_substr *before,
-			      struct cip_substr *after, char *s, char delim)
-{
-	char *aftr;
-
-	aftr = cip_str_split(before, s, delim);
-	if (aftr == NULL)
-		return -1;
-
-	cip_str_trim(after, aftr);
-
-	return 0;
-}
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /*
  * Actual parsing stuff
  */
 
-struct cip_parse_ctx {
-	cip_err_ctx *err;
-	cip_file_schema *file_schema;
-	cip_ini_file *file;
-	cip_ini_sect *sect;
-	const char *file_name;
-	int (*warning_fn)(const char *warn_msg);
-	union {
-		int line_num;
-		struct {
-			char succeeded;
-			char deferred;
-		};
-	};
-};
-
 static cip_ini_sect *cip_line_sect_single(struct cip_parse_ctx *ctx,
-					  const char *title)
+					  const char *title, size_t title_len)
 {
 	cip_sect_schema *sect_schema;
 	cip_ini_sect *sect;
 
-	sect_schema = cip_sect_schema_get(ctx->file_schema, title);
+	sect_schema = cip_sect_schema_get_n(ctx->file_schema, title, title_len);
 	if (sect_schema == NULL) {
-		cip_err(ctx->err, "%s:%d: Unknown section title [%s]",
-			ctx->file_name, ctx->line_num, title);
+		cip_err(ctx->err, "%s:%d: Unknown section title [%.*s]",
+			ctx->file_name, ctx->line_num, (int)title_len, title);
 		return NULL;
 	}
 
 	if (sect_schema->flags & CIP_SECT_MULTIPLE) {
-		cip_err(ctx->err, "%s:%d: Missing ID for section [%s]",
-			ctx->file_name, ctx->line_num, title);
+		cip_err(ctx->err, "%s:%d: Missing ID for section [%.*s]",
+			ctx->file_name, ctx->line_num, (int)title_len, title);
 		return NULL;
 	}
 
@@ -162,30 +58,34 @@ static cip_ini_sect *cip_line_sect_single(struct cip_parse_ctx *ctx,
 		return NULL;
 	}
 
+	sect->line = ctx->line_num;
 	return sect;
 }
 
 static cip_ini_sect *cip_line_sect_multi(struct cip_parse_ctx *ctx,
-					 const char *title, const char *id)
+					 const char *title, size_t title_len,
+					 const char *id, size_t id_len)
 {
 	cip_sect_schema *sect_schema;
 	cip_ini_sect *sect, *inst;
 	char *id_copy;
 
-	sect_schema = cip_sect_schema_get(ctx->file_schema, title);
+	sect_schema = cip_sect_schema_get_n(ctx->file_schema, title, title_len);
 	if (sect_schema == NULL) {
-		cip_err(ctx->err, "%s:%d: Unknown section title [%s:*]",
-			ctx->file_name, ctx->line_num, title);
+		cip_err(ctx->err, "%s:%d: Unknown section title [%.*s:*]",
+			ctx->file_name, ctx->line_num, (int)title_len, title);
 		return NULL;
 	}
 
 	if (!(sect_schema->flags & CIP_SECT_MULTIPLE)) {
-		cip_err(ctx->err, "%s:%d: Unexpected ID for section [%s:%s]",
-			ctx->file_name, ctx->line_num, title, id);
+		cip_err(ctx->err,
+			"%s:%d: Unexpected ID for section [%.*s:%.*s]",
+			ctx->file_name, ctx->line_num, (int)title_len, title,
+			(int)id_len, id);
 		return NULL;
 	}
 
-	sect = cip_ini_sect_get_p(ctx->file, title);
+	sect = cip_ini_sect_get_pn(ctx->file, title, title_len);
 	if (sect == NULL) {
 		sect = cip_ini_sect_new(ctx->err, ctx->file, sect_schema);
 		if (sect == NULL) {
@@ -193,44 +93,102 @@ static cip_ini_sect *cip_line_sect_multi(struct cip_parse_ctx *ctx,
 				    ctx->line_num, cip_last_err(ctx->err));
 			return NULL;
 		}
+
+		sect->line = ctx->line_num;
 	}
 
-	id_copy = strdup(id);
+	id_copy = cip_malloc(id_len + 1);
 	if (id_copy == NULL)
 		return cip_err_ptr(ctx->err, "%s", strerror(ENOMEM));
 
+	memcpy(id_copy, id, id_len);
+	id_copy[id_len] = 0;
+
 	inst = cip_ini_inst_new(ctx->err, sect, sect_schema, id_copy);
 	if (inst == NULL) {
 		cip_err_use(ctx->err, "%s:%d: %s", ctx->file_name,
 			    ctx->line_num, cip_last_err(ctx->err));
-		free(id_copy);
+		cip_free(id_copy);
 		return NULL;
 	}
 
+	inst->line = ctx->line_num;
 	return inst;
 }
 
-static int cip_check_remainder(struct cip_parse_ctx *ctx, char *remainder)
+static void cip_diag_init(cip_diag *diag, const struct cip_parse_ctx *ctx,
+			  enum cip_diag_code code, const char *opt)
 {
-	struct cip_substr rem;
-	int ret;
+	const cip_ini_sect *sect;
 
-	if (ctx->warning_fn == 0)
-		return 0;
+	sect = ctx->sect;
 
-	cip_str_trim(&rem, remainder);
+	diag->code = code;
+	diag->file_name = ctx->file_name;
+	diag->line = ctx->line_num;
+	diag->opt = opt;
+	diag->detail = NULL;
 
-	if (*rem.start == 0 || *rem.start == ';' || *rem.start == '#') {
-		ret = 0;
+	if (sect == NULL) {
+		diag->sect = NULL;
+		diag->id = NULL;
+	}
+	else if (sect->schema->flags & CIP_SECT_MULTIPLE) {
+		diag->sect = sect->schema->node.name;
+		diag->id = sect->node.name;
 	}
 	else {
-		cip_err(ctx->err, "%s:%d: Unexpected extra characters",
-			ctx->file_name, ctx->line_num);
-		ret = ctx->warning_fn(cip_last_err(ctx->err));
+		diag->sect = sect->node.name;
+		diag->id = NULL;
 	}
+}
 
-	cip_str_restore(&rem);
-	return ret;
+__thread int (*cip_diag_record)(const cip_diag *diag);
+
+/*
+ * Warnings go to the schema's diag_fn, if it has one; only otherwise are they
+ * formatted (into ctx->err) for warning_fn.
+ */
+static int cip_parse_warn(struct cip_parse_ctx *ctx, const cip_diag *diag)
+{
+	const cip_file_schema *schema;
+
+	schema = ctx->file_schema;
+
+	if (schema->diag_fn != 0) {
+		if (cip_diag_record != 0)
+			return cip_diag_record(diag);
+		if (schema->diag_fn(diag, schema->diag_data) != -1)
+			return 0;
+		cip_err_diag(ctx->err, diag);
+		return -1;
+	}
+
+	if (ctx->warning_fn == 0)
+		return 0;
+
+	cip_err_diag(ctx->err, diag);
+	return ctx->warning_fn(cip_last_err(ctx->err));
+}
+
+static int cip_warn_extra(struct cip_parse_ctx *ctx, const char *opt)
+{
+	cip_diag diag;
+
+	cip_diag_init(&diag, ctx, CIP_DIAG_EXTRA_CHARS, opt);
+	return cip_parse_warn(ctx, &diag);
+}
+
+static int cip_check_remainder(struct cip_parse_ctx *ctx, const char *opt,
+			       const char *remainder)
+{
+	while (cip_isspace(*remainder))
+		++remainder;
+
+	if (*remainder == 0 || cip_cclass(*remainder) == CIP_CC_COMMENT)
+		return 0;
+
+	return cip_warn_extra(ctx, opt);
 }
 
 static int cip_parse_sect_cb(struct cip_avl_node *node, void *context)
@@ -319,7 +277,7 @@ static int cip_parse_file_cb(struct cip_avl_node *node, void *context)
 	return 1;
 }
 
-static int cip_check_prev_sect(struct cip_parse_ctx *ctx)
+int cip_check_prev_sect(struct cip_parse_ctx *ctx)
 {
 	const cip_sect_schema *schema;
 	struct cip_avl_node *tree;
@@ -358,57 +316,29 @@ static int cip_check_prev_sect(struct cip_parse_ctx *ctx)
 	return 0;
 }
 
-static int cip_parse_sect_line(struct cip_parse_ctx *ctx, char *line)
-{
-	struct cip_substr sect_all, sect_title, sect_id;
-	char *remainder, *id;
-	cip_ini_sect *sect;
-
-	++line;		/* skip opening bracket */
-
-	remainder = cip_str_split(&sect_all, line, ']');
-	if (remainder == NULL) {
-		cip_err(ctx->err, "%s:%d: Missing closing bracket (']')",
-			ctx->file_name, ctx->line_num);
-		return -1;
-	}
-
-	id = cip_str_split(&sect_title, sect_all.start, ':');
-	if (id == NULL) {
-		sect = cip_line_sect_single(ctx, sect_all.start);
-		cip_str_restore(&sect_all);
-	}
-	else {
-		cip_str_trim(&sect_id, id);
-		sect = cip_line_sect_multi(ctx, sect_title.start,
-					   sect_id.start);
-		cip_str_restore(&sect_id);
-		cip_str_restore(&sect_title);
-		cip_str_restore(&sect_all);
-	}
-
-	if (sect == NULL)
-		return -1;
-
-	if (cip_check_prev_sect(ctx) == -1)
-		return -1;
-
-	ctx->sect = sect;
-
-	return cip_check_remainder(ctx, remainder);
-}
+/* For cip_value_source(); only set while parse_fn runs */
+static __thread struct cip_parse_ctx *cip_parse_cur;
 
+/* Parses straight into the new value, which is then added to the section */
 static int cip_parse_opt_value(struct cip_parse_ctx *ctx,
 			       cip_opt_schema *schema, char *value)
 {
-	unsigned char buf[schema->type->size];
+	cip_ini_value *new;
 	cip_err_ctx err_ctx;
 	const char *err_msg;
 	char *remainder;
+	cip_diag diag;
+
+	new = cip_ini_value_alloc(ctx->err, schema);
+	if (new == NULL)
+		goto error;
 
 	cip_err_ctx_init(&err_ctx);
 
-	remainder = schema->type->parse_fn(&err_ctx, buf, value);
+	ctx->value_copy = NULL;
+	cip_parse_cur = ctx;
+	remainder = schema->type->parse_fn(&err_ctx, new->value, value);
+	cip_parse_cur = NULL;
 	err_msg = cip_last_err(&err_ctx);
 
 	if (remainder == NULL) {
@@ -418,34 +348,152 @@ static int cip_parse_opt_value(struct cip_parse_ctx *ctx,
 			ctx->file_name, ctx->line_num, schema->type->name,
 			err_msg);
 		cip_err_ctx_fini(&err_ctx);
+		cip_free(new);
 		return -1;
 	}
 
-	if (err_msg != NULL && ctx->warning_fn != 0) {
-		cip_err(ctx->err, "%s:%d: %s", ctx->file_name, ctx->line_num,
-			err_msg);
-		if (ctx->warning_fn(cip_last_err(ctx->err)) == -1) {
+	if (err_msg != NULL) {
+		cip_diag_init(&diag, ctx, CIP_DIAG_VALUE, schema->node.name);
+		diag.detail = err_msg;
+		if (cip_parse_warn(ctx, &diag) == -1) {
 			cip_err_ctx_fini(&err_ctx);
+			cip_free(new);
 			return -1;
 		}
 	}
 
 	cip_err_ctx_fini(&err_ctx);
 
-	if (cip_ini_value_new(ctx->err, ctx->sect, schema, buf) == -1) {
-		cip_err_use(ctx->err, "%s:%d: %s", ctx->file_name,
-			    ctx->line_num, cip_last_err(ctx->err));
-		return -1;
+	if (cip_ini_value_add(ctx->err, ctx->sect, new) == -1)
+		goto error;
+
+	return cip_check_remainder(ctx, schema->node.name, remainder);
+
+error:
+	cip_err_use(ctx->err, "%s:%d: %s", ctx->file_name, ctx->line_num,
+		    cip_last_err(ctx->err));
+	return -1;
+}
+
+/*
+ * Lines are parsed in place (they may be in a read-only mapping); values are
+ * copied to a NUL-terminated scratch buffer for the type parsers, but nothing
+ * else is.
+ */
+
+static int cip_scratch_copy(struct cip_parse_ctx *ctx, const char *s,
+			    size_t len)
+{
+	size_t new_size;
+	char *new_buf;
+
+	if (len >= ctx->scratch_size) {
+
+		new_size = (ctx->scratch_size != 0) ? ctx->scratch_size : 128;
+		while (new_size <= len)
+			new_size *= 2;
+
+		new_buf = realloc(ctx->scratch, new_size);
+		if (new_buf == NULL)
+			return cip_err_int(ctx->err, "%s", strerror(ENOMEM));
+
+		ctx->scratch = new_buf;
+		ctx->scratch_size = new_size;
+	}
+
+	memcpy(ctx->scratch, s, len);
+	ctx->scratch[len] = 0;
+
+	return 0;
+}
+
+/* Copies of values whose source isn't kept go in the file's arena (if any) */
+static char *cip_value_copy(struct cip_parse_ctx *ctx)
+{
+	struct cip_arena *text;
+	cip_ini_file *file;
+	char *copy;
+
+	file = ctx->file;
+
+	if (file->arena != NULL) {
+		text = file->arena;
+	}
+	else {
+		if (file->text == NULL) {
+			file->text = cip_arena_new(ctx->err);
+			if (file->text == NULL)
+				return NULL;
+		}
+
+		text = file->text;
+	}
+
+	copy = cip_arena_alloc(text, ctx->value.len + 1);
+	if (copy == NULL)
+		return NULL;
+
+	memcpy(copy, ctx->scratch, ctx->value.len + 1);
+	return copy;
+}
+
+const char *cip_value_source(const char *s)
+{
+	struct cip_parse_ctx *ctx;
+	size_t offset;
+
+	ctx = cip_parse_cur;
+	if (ctx == NULL || s < ctx->scratch ||
+			s > ctx->scratch + ctx->value.len) {
+		return NULL;
+	}
+
+	offset = s - ctx->scratch;
+
+	if (ctx->keep_source) {
+		ctx->file->flags |= CIP_INI_SOURCE;
+		return ctx->value.start + offset;
+	}
+
+	if (ctx->value_copy == NULL) {
+		ctx->value_copy = cip_value_copy(ctx);
+		if (ctx->value_copy == NULL)
+			return NULL;
+	}
+
+	return ctx->value_copy + offset;
+}
+
+static int cip_parse_sect_line(struct cip_parse_ctx *ctx,
+			       const struct cip_line_tokens *tok)
+{
+	cip_ini_sect *sect;
+
+	if (tok->id.start == NULL) {
+		sect = cip_line_sect_single(ctx, tok->title.start,
+					    tok->title.len);
+	}
+	else {
+		sect = cip_line_sect_multi(ctx, tok->title.start,
+					   tok->title.len, tok->id.start,
+					   tok->id.len);
 	}
 
-	return cip_check_remainder(ctx, remainder);
+	if (sect == NULL)
+		return -1;
+
+	if (cip_check_prev_sect(ctx) == -1)
+		return -1;
+
+	ctx->sect = sect;
+
+	return tok->extra ? cip_warn_extra(ctx, NULL) : 0;
 }
 
-static int cip_parse_opt_line(struct cip_parse_ctx *ctx, char *line)
+static int cip_parse_opt_line(struct cip_parse_ctx *ctx,
+			      const struct cip_line_tokens *tok)
 {
-	struct cip_substr name, value;
 	cip_opt_schema *schema;
-	int ret;
 
 	if (ctx->sect == NULL) {
 		cip_err(ctx->err, "%s:%d: Value outside any section",
@@ -453,99 +501,135 @@ static int cip_parse_opt_line(struct cip_parse_ctx *ctx, char *line)
 		return -1;
 	}
 
-	if (cip_str_split_trim(&name, &value, line, '=') == -1) {
+	if (tok->type == CIP_LINE_NO_EQUALS) {
 		cip_err(ctx->err, "%s:%d: Expected equal sign ('=')",
 			ctx->file_name, ctx->line_num);
 		return -1;
 	}
 
-	schema = cip_opt_schema_get(ctx->sect->schema, name.start);
+	schema = cip_opt_schema_get_n(ctx->sect->schema, tok->title.start,
+				      tok->title.len);
 	if (schema == NULL) {
-		cip_err(ctx->err, "%s:%d: Unknown option [%s]:%s",
+		cip_err(ctx->err, "%s:%d: Unknown option [%s]:%.*s",
 			ctx->file_name, ctx->line_num, ctx->sect->node.name,
-			name.start);
-		ret = -1;
-	}
-	else {
-		ret = cip_parse_opt_value(ctx, schema, value.start);
+			(int)tok->title.len, tok->title.start);
+		return -1;
 	}
 
-	cip_str_restore(&value);
-	cip_str_restore(&name);
+	if (cip_scratch_copy(ctx, tok->value.start, tok->value.len) == -1)
+		return -1;
 
-	return ret;
+	ctx->value = tok->value;
+	return cip_parse_opt_value(ctx, schema, ctx->scratch);
 }
 
-int cip_parse_line(struct cip_parse_ctx *ctx, char *line)
+/* Returns the offset of the newline (or size), or -1 on error */
+static ssize_t cip_parse_line(struct cip_parse_ctx *ctx, const char *line,
+			      size_t size)
 {
-	struct cip_substr trimmed;
+	struct cip_line_tokens tok;
+	size_t eol;
 	int ret;
-#ifdef SUBSTR_DEBUG
-	char *copy;
 
-	copy = strdup(line);
-	if (copy == NULL)
-		abort();
-#endif
-	cip_str_trim(&trimmed, line);
+	eol = cip_lex_line(&tok, line, size);
+
+	switch (tok.type) {
 
-	switch (*trimmed.start) {
+		case CIP_LINE_BLANK:	ret = 0;
+					break;
 
-		case 0:
-		case '\n':
-		case ';':
-		case '#':	ret = 0;
-				break;
+		case CIP_LINE_SECT:	ret = cip_parse_sect_line(ctx, &tok);
+					break;
 
-		case '[':	ret = cip_parse_sect_line(ctx, trimmed.start);
-				break;
+		case CIP_LINE_UNCLOSED:	cip_err(ctx->err, "%s:%d: Missing "
+						"closing bracket (']')",
+						ctx->file_name, ctx->line_num);
+					ret = -1;
+					break;
 
-		default:	ret = cip_parse_opt_line(ctx, trimmed.start);
+		default:		ret = cip_parse_opt_line(ctx, &tok);
 	}
 
-	cip_str_restore(&trimmed);
-#ifdef SUBSTR_DEBUG
-	if (strcmp(line, copy) != 0)
-		abort();
+	if (ret == -1)
+		return -1;
 
-	free(copy);
-#endif
-	return ret;
+	/* For cip_reparse_buffer() */
+	if (ctx->sect != NULL)
+		ctx->sect->hash = cip_hash(line, eol, ctx->sect->hash);
+
+	return eol;
+}
+
+/*
+ * Post-parse callbacks.  One walk over the file runs the callbacks of options
+ * with no dependencies and queues the rest, which then run in order of their
+ * options' ranks (see cip_opt_schema_depend()).  Callbacks that defer
+ * (return > 0) are retried afterwards, until they are done or none of them
+ * makes progress.
+ */
+
+struct cip_post_item {
+	cip_ini_sect *sect;
+	cip_ini_value *value;
+};
+
+struct cip_post_queue {
+	struct cip_post_item *items;
+	size_t count;
+	size_t size;
+};
+
+struct cip_post_state {
+	struct cip_post_queue ranked;	/* rank > 0 */
+	struct cip_post_queue deferred;
+};
+
+static void cip_post_parse_diag(cip_diag *diag, struct cip_parse_ctx *ctx,
+				cip_ini_value *value, const char *err_msg)
+{
+	cip_diag_init(diag, ctx, CIP_DIAG_POST_PARSE, value->node.name);
+	diag->line = 0;		/* not about a line */
+	diag->detail = err_msg;
 }
 
-static void cip_post_parse_err(struct cip_parse_ctx *ctx, cip_ini_value *value,
-			       const char *err_msg)
+static int cip_post_push(struct cip_parse_ctx *ctx, struct cip_post_queue *q,
+			 cip_ini_sect *sect, cip_ini_value *value)
 {
-	if (ctx->sect->schema->flags & CIP_SECT_MULTIPLE) {
+	struct cip_post_item *new_items;
+	size_t new_size;
 
-		cip_err(ctx->err, "%s: [%s:%s]:%s: %s", ctx->file_name,
-			ctx->sect->schema->node.name, ctx->sect->node.name,
-			value->node.name, err_msg);
-	}
-	else {
-		cip_err(ctx->err, "%s: [%s]:%s: %s", ctx->file_name,
-			ctx->sect->node.name, value->node.name, err_msg);
+	if (q->count == q->size) {
+
+		new_size = (q->size != 0) ? q->size * 2 : 64;
+
+		new_items = realloc(q->items, new_size * sizeof *new_items);
+		if (new_items == NULL)
+			return cip_err_int(ctx->err, "%s", strerror(ENOMEM));
+
+		q->items = new_items;
+		q->size = new_size;
 	}
+
+	q->items[q->count].sect = sect;
+	q->items[q->count].value = value;
+	++q->count;
+
+	return 0;
 }
 
-static int cip_post_value_cb(struct cip_avl_node *node, void *context)
+/* Returns -1 on error, 0 if the callback is done, or 1 if it deferred */
+static int cip_post_run(struct cip_parse_ctx *ctx, cip_ini_sect *sect,
+			cip_ini_value *value)
 {
-	struct cip_parse_ctx *parse_ctx;
-	cip_ini_value *value;
 	cip_err_ctx err_ctx;
 	const char *err_msg;
+	cip_diag diag;
 	int ret;
 
-	value = (cip_ini_value *)node;
-
-	if (value->post_parse_done || value->schema->post_parse_fn == 0)
-		return 1;
-
-	parse_ctx = context;
+	ctx->sect = sect;
 	cip_err_ctx_init(&err_ctx);
 
-	ret = value->schema->post_parse_fn(&err_ctx, value, parse_ctx->sect,
-					   parse_ctx->file,
+	ret = value->schema->post_parse_fn(&err_ctx, value, sect, ctx->file,
 					   value->schema->post_parse_data);
 
 	err_msg = cip_last_err(&err_ctx);
@@ -553,177 +637,791 @@ static int cip_post_value_cb(struct cip_avl_node *node, void *context)
 	if (ret < 0) {
 		if (err_msg == NULL)
 			err_msg = "Unknown post-parse error";
-		cip_post_parse_err(parse_ctx, value, err_msg);
+		cip_post_parse_diag(&diag, ctx, value, err_msg);
+		cip_err_diag(ctx->err, &diag);
 		cip_err_ctx_fini(&err_ctx);
-		return 0;
+		return -1;
 	}
 
-	if (err_msg != NULL && parse_ctx->warning_fn != 0) {
-		cip_post_parse_err(parse_ctx, value, err_msg);
-		if (parse_ctx->warning_fn(cip_last_err(parse_ctx->err)) == -1) {
+	if (err_msg != NULL) {
+		cip_post_parse_diag(&diag, ctx, value, err_msg);
+		if (cip_parse_warn(ctx, &diag) == -1) {
 			cip_err_ctx_fini(&err_ctx);
-			return 0;
+			return -1;
 		}
 	}
 
 	cip_err_ctx_fini(&err_ctx);
 
-	if (ret == 0) {
-		value->post_parse_done = 1;
-		parse_ctx->succeeded = 1;
-	}
-	else {
-		parse_ctx->deferred = 1;
-	}
+	if (ret != 0)
+		return 1;
 
-	return 1;
+	value->post_parse_done = 1;
+	return 0;
 }
 
-static int cip_post_inst_cb(struct cip_avl_node *node, void *context)
+static int cip_post_values(struct cip_parse_ctx *ctx,
+			   struct cip_post_state *state, cip_ini_sect *sect)
 {
-	struct cip_avl_node *values;
-	struct cip_parse_ctx *ctx;
-	cip_ini_sect *instance;
+	struct cip_avl_node *node;
+	struct cip_avl_iter iter;
+	cip_ini_value *value;
+	int ret;
+
+	/* Values of a reused section are done; see cip_reparse_sect() */
+	if (sect->flags & CIP_INI_BORROWED)
+		return 0;
 
-	instance = (cip_ini_sect *)node;
-	values = (struct cip_avl_node *)instance->values;
+	cip_avl_iter_init(&iter, (struct cip_avl_node *)sect->values);
 
-	if (values != NULL) {
+	while ((node = cip_avl_iter_next(&iter)) != NULL) {
 
-		ctx = context;
-		ctx->sect = instance;
+		value = (cip_ini_value *)node;
 
-		return cip_avl_foreach(values, cip_post_value_cb, ctx);
-	}
-	else {
-		return 1;
+		if (value->post_parse_done || value->schema->post_parse_fn == 0)
+			continue;
+
+		if (value->schema->post_rank != 0) {
+			ret = cip_post_push(ctx, &state->ranked, sect, value);
+		}
+		else {
+			ret = cip_post_run(ctx, sect, value);
+			if (ret == 1)
+				ret = cip_post_push(ctx, &state->deferred,
+						    sect, value);
+		}
+
+		if (ret == -1)
+			return -1;
 	}
+
+	return 0;
 }
 
-static int cip_post_sect_cb(struct cip_avl_node *node, void *context)
+static int cip_post_walk(struct cip_parse_ctx *ctx,
+			 struct cip_post_state *state)
 {
-	struct cip_avl_node *tree;
-	struct cip_parse_ctx *ctx;
-	cip_ini_sect *section;
+	struct cip_avl_iter sects, insts;
+	struct cip_avl_node *node, *inst;
+	cip_ini_sect *sect;
 
-	section = (cip_ini_sect *)node;
+	cip_avl_iter_init(&sects, (struct cip_avl_node *)ctx->file->sections);
 
-	if (section->schema->flags & CIP_SECT_MULTIPLE) {
+	while ((node = cip_avl_iter_next(&sects)) != NULL) {
 
-		tree = (struct cip_avl_node *)section->instances;
-		/* tree != NULL (must have parsed instance to create section) */
-		return cip_avl_foreach(tree, cip_post_inst_cb, context);
-	}
-	else {
-		tree = (struct cip_avl_node *)section->values;
+		sect = (cip_ini_sect *)node;
 
-		if (tree != NULL) {
+		if (!(sect->schema->flags & CIP_SECT_MULTIPLE)) {
+			if (cip_post_values(ctx, state, sect) == -1)
+				return -1;
+			continue;
+		}
 
-			ctx = context;
-			ctx->sect = section;
+		cip_avl_iter_init(&insts,
+				  (struct cip_avl_node *)sect->instances);
 
-			return cip_avl_foreach(tree, cip_post_value_cb, ctx);
-		}
-		else {
-			return 1;
+		while ((inst = cip_avl_iter_next(&insts)) != NULL) {
+			if (cip_post_values(ctx, state,
+					    (cip_ini_sect *)inst) == -1) {
+				return -1;
+			}
 		}
 	}
+
+	return 0;
 }
 
-static int cip_post_parse(struct cip_parse_ctx *ctx)
+/* Counting sort by rank; items of the same rank stay in file order */
+static int cip_post_sort(struct cip_parse_ctx *ctx, struct cip_post_queue *q)
 {
-	struct cip_avl_node *sections;
+	struct cip_post_item *sorted;
+	unsigned max_rank, rank;
+	size_t *start, i;
+
+	max_rank = ctx->file_schema->max_post_rank;
+
+	start = calloc(max_rank + 1, sizeof *start);
+	sorted = malloc(q->count * sizeof *sorted);
+	if (start == NULL || sorted == NULL) {
+		free(start);
+		free(sorted);
+		return cip_err_int(ctx->err, "%s", strerror(ENOMEM));
+	}
 
-	sections = (struct cip_avl_node *)ctx->file->sections;
-	if (sections == NULL)
-		return 0;
+	for (i = 0; i < q->count; ++i) {
+		rank = q->items[i].value->schema->post_rank;
+		if (rank < max_rank)
+			++start[rank + 1];
+	}
 
-	do {
-		ctx->succeeded = 0;
-		ctx->deferred = 0;
+	for (rank = 1; rank <= max_rank; ++rank)
+		start[rank] += start[rank - 1];
 
-		if (cip_avl_foreach(sections, cip_post_sect_cb, ctx) == 0)
-			return -1;
+	for (i = 0; i < q->count; ++i) {
+		rank = q->items[i].value->schema->post_rank;
+		sorted[start[rank]++] = q->items[i];
 	}
-	while (ctx->deferred && ctx->succeeded);
 
-	if (ctx->deferred) {
-		cip_err(ctx->err, "Infinite loop processing file: %s",
-			ctx->file_name);
+	free(start);
+	free(q->items);
+	q->items = sorted;
+	q->size = q->count;
+
+	return 0;
+}
+
+static int cip_post_ranked(struct cip_parse_ctx *ctx,
+			   struct cip_post_state *state)
+{
+	struct cip_post_item *item;
+	size_t i;
+	int ret;
+
+	if (cip_post_sort(ctx, &state->ranked) == -1)
 		return -1;
+
+	for (i = 0; i < state->ranked.count; ++i) {
+
+		item = &state->ranked.items[i];
+
+		ret = cip_post_run(ctx, item->sect, item->value);
+		if (ret == 1)
+			ret = cip_post_push(ctx, &state->deferred, item->sect,
+					    item->value);
+		if (ret == -1)
+			return -1;
 	}
 
 	return 0;
 }
 
-cip_ini_file *cip_parse_stream(cip_err_ctx *err_ctx, FILE *stream,
-			       const char *name, cip_file_schema *schema,
-			       int (*warning_fn)(const char *warn_msg))
+static int cip_post_retry(struct cip_parse_ctx *ctx, struct cip_post_queue *q)
+{
+	struct cip_post_item *item;
+	size_t i, kept;
+	cip_diag diag;
+	int ret;
+
+	while (q->count != 0) {
+
+		for (i = kept = 0; i < q->count; ++i) {
+
+			item = &q->items[i];
+
+			ret = cip_post_run(ctx, item->sect, item->value);
+			if (ret == -1)
+				return -1;
+			if (ret == 1)
+				q->items[kept++] = *item;
+		}
+
+		if (kept == q->count) {
+			item = &q->items[0];
+			ctx->sect = item->sect;
+			cip_post_parse_diag(&diag, ctx, item->value,
+					    "Post-parse callback never "
+					    "stops deferring");
+			cip_err_diag(ctx->err, &diag);
+			return -1;
+		}
+
+		q->count = kept;
+	}
+
+	return 0;
+}
+
+static int cip_post_parse(struct cip_parse_ctx *ctx)
+{
+	struct cip_post_state state;
+	int ret;
+
+	if (ctx->file->sections == NULL)
+		return 0;
+
+	memset(&state, 0, sizeof state);
+
+	ret = cip_post_walk(ctx, &state);
+
+	if (ret == 0 && state.ranked.count != 0)
+		ret = cip_post_ranked(ctx, &state);
+
+	if (ret == 0)
+		ret = cip_post_retry(ctx, &state.deferred);
+
+	free(state.ranked.items);
+	free(state.deferred.items);
+
+	return ret;
+}
+
+int cip_parse_ctx_init(struct cip_parse_ctx *ctx, cip_err_ctx *err_ctx,
+		       const char *name, const cip_file_schema *schema,
+		       int (*warning_fn)(const char *warn_msg))
+{
+	ctx->err = err_ctx;
+	ctx->file_schema = schema;
+	ctx->file_name = name;
+	ctx->warning_fn = warning_fn;
+	ctx->scratch = NULL;
+	ctx->scratch_size = 0;
+	ctx->old = NULL;
+	ctx->borrowed = NULL;
+	ctx->num_borrowed = 0;
+	ctx->borrowed_size = 0;
+	ctx->keep_source = 0;
+	ctx->line_num = 0;
+	ctx->sect = NULL;
+
+	ctx->file = cip_ini_file_new(ctx->err, ctx->file_schema);
+	if (ctx->file == NULL)
+		return -1;
+
+	return 0;
+}
+
+void cip_parse_ctx_abort(struct cip_parse_ctx *ctx)
+{
+	free(ctx->scratch);
+	free(ctx->borrowed);
+	cip_ini_file_free(ctx->file);
+}
+
+/* Checks the last section, then required sections, then post-parse */
+static cip_ini_file *cip_parse_check(struct cip_parse_ctx *ctx)
 {
 	struct cip_avl_node *tree;
+
+	free(ctx->scratch);
+	ctx->scratch = NULL;
+
+	if (cip_check_prev_sect(ctx) == -1) {
+		cip_ini_file_free(ctx->file);
+		return NULL;
+	}
+
+	tree = (struct cip_avl_node *)ctx->file_schema->sections;
+	if (tree != NULL) {
+		if (cip_avl_foreach(tree, cip_parse_file_cb, ctx) == 0) {
+			cip_ini_file_free(ctx->file);
+			return NULL;
+		}
+	}
+
+	if (cip_post_parse(ctx) == -1) {
+		cip_ini_file_free(ctx->file);
+		return NULL;
+	}
+
+	return ctx->file;
+}
+
+cip_ini_file *cip_parse_finish(struct cip_parse_ctx *ctx)
+{
+	struct cip_arena *prev;
+	cip_ini_file *file;
+
+	prev = cip_arena_enter(ctx->file->arena);
+	file = cip_parse_check(ctx);
+	cip_arena_leave(prev);
+
+	return file;
+}
+
+int cip_parse_mem(struct cip_parse_ctx *ctx, const char *buf, size_t len)
+{
+	struct cip_arena *prev;
+	ssize_t eol;
+	int ret;
+
+	prev = cip_arena_enter(ctx->file->arena);
+	ret = 0;
+
+	while (len != 0) {
+
+		++(ctx->line_num);
+
+		eol = cip_parse_line(ctx, buf, len);
+		if (eol == -1) {
+			ret = -1;
+			break;
+		}
+
+		if ((size_t)eol == len)
+			break;
+
+		buf += eol + 1;
+		len -= eol + 1;
+	}
+
+	cip_arena_leave(prev);
+	return ret;
+}
+
+cip_ini_file *cip_parse_buffer(cip_err_ctx *err_ctx, const char *buf,
+			       size_t len, const char *name,
+			       const cip_file_schema *schema,
+			       int (*warning_fn)(const char *warn_msg))
+{
 	struct cip_parse_ctx ctx;
-	char *lineptr;
-	size_t n;
+
+	if (cip_parse_ctx_init(&ctx, err_ctx, name, schema, warning_fn) == -1)
+		return NULL;
+
+	ctx.keep_source = 1;
+
+	if (cip_parse_mem(&ctx, buf, len) == -1) {
+		cip_parse_ctx_abort(&ctx);
+		return NULL;
+	}
+
+	return cip_parse_finish(&ctx);
+}
+
+/* Runs post-parse callbacks on a file loaded from a cache */
+cip_ini_file *cip_parse_loaded(cip_err_ctx *err_ctx, cip_ini_file *file,
+			       const char *name,
+			       int (*warning_fn)(const char *warn_msg))
+{
+	struct cip_parse_ctx ctx;
+	struct cip_arena *prev;
+	int ret;
 
 	ctx.err = err_ctx;
-	ctx.file_schema = schema;
+	ctx.file_schema = file->schema;
+	ctx.file = file;
+	ctx.sect = NULL;
 	ctx.file_name = name;
 	ctx.warning_fn = warning_fn;
 
-	ctx.file = cip_ini_file_new(ctx.err, ctx.file_schema);
-	if (ctx.file == NULL)
+	prev = cip_arena_enter(file->arena);
+	ret = cip_post_parse(&ctx);
+	cip_arena_leave(prev);
+
+	if (ret == -1) {
+		cip_ini_file_free(file);
 		return NULL;
+	}
 
-	lineptr = NULL;
-	ctx.line_num = 0;
-	ctx.sect = NULL;
+	return file;
+}
 
-	if (stream != NULL) {
+/*
+ * Reloading.  A section whose lines hash to the same value as in the old file
+ * is not parsed again; a new section node shares the old one's values (and
+ * ID).  Ownership moves to the new file only if the whole reload succeeds, so
+ * the old file is untouched on failure.
+ */
 
-		while (getline(&lineptr, &n, stream) > 0) {
+static int cip_borrow_add(struct cip_parse_ctx *ctx, cip_ini_sect *new,
+			  cip_ini_sect *old)
+{
+	cip_ini_sect **new_borrowed;
+	size_t new_size;
 
-			++(ctx.line_num);
+	if (ctx->num_borrowed == ctx->borrowed_size) {
 
-			if (cip_parse_line(&ctx, lineptr) == -1) {
-				free(lineptr);
-				cip_ini_file_free(ctx.file);
-				return NULL;
-			}
+		new_size = (ctx->borrowed_size != 0) ?
+						ctx->borrowed_size * 2 : 64;
+
+		new_borrowed = realloc(ctx->borrowed,
+				       new_size * sizeof *new_borrowed);
+		if (new_borrowed == NULL)
+			return cip_err_int(ctx->err, "%s", strerror(ENOMEM));
+
+		ctx->borrowed = new_borrowed;
+		ctx->borrowed_size = new_size;
+	}
+
+	ctx->borrowed[ctx->num_borrowed++] = new;
+	ctx->borrowed[ctx->num_borrowed++] = old;
+
+	return 0;
+}
+
+static cip_ini_sect *cip_line_sect_borrow(struct cip_parse_ctx *ctx,
+					  cip_ini_sect *old)
+{
+	const cip_sect_schema *schema;
+	cip_ini_sect *sect, *new;
+
+	schema = old->schema;
+
+	if (schema->flags & CIP_SECT_MULTIPLE) {
+
+		sect = cip_ini_sect_get_p(ctx->file, schema->node.name);
+		if (sect == NULL) {
+			sect = cip_ini_sect_new(ctx->err, ctx->file, schema);
+			if (sect == NULL)
+				goto error;
+			sect->line = ctx->line_num;
 		}
 
-		if (ferror(stream)) {
-			cip_err(ctx.err, "%s: %m", ctx.file_name);
-			free(lineptr);
-			cip_ini_file_free(ctx.file);
-			return NULL;
+		new = cip_ini_inst_borrow(ctx->err, sect, old);
+	}
+	else {
+		new = cip_ini_sect_borrow(ctx->err, ctx->file, old);
+	}
+
+	if (new == NULL)
+		goto error;
+
+	new->line = ctx->line_num;
+
+	if (cip_borrow_add(ctx, new, old) == -1)
+		return NULL;	/* new is freed with the file */
+
+	return new;
+
+error:
+	cip_err_use(ctx->err, "%s:%d: %s", ctx->file_name, ctx->line_num,
+		    cip_last_err(ctx->err));
+	return NULL;
+}
+
+static cip_ini_sect *cip_reparse_find(const cip_ini_file *old,
+				      const struct cip_line_tokens *tok)
+{
+	cip_ini_sect *sect;
+
+	sect = cip_ini_sect_get_pn(old, tok->title.start, tok->title.len);
+	if (sect == NULL)
+		return NULL;
+
+	if (!(sect->schema->flags & CIP_SECT_MULTIPLE))
+		return (tok->id.start == NULL) ? sect : NULL;
+
+	if (tok->id.start == NULL)
+		return NULL;
+
+	return (cip_ini_sect *)cip_avl_get_n((struct cip_avl_node *)
+							sect->instances,
+					     tok->id.start, tok->id.len);
+}
+
+/*
+ * Returns the length of the reused section, 0 if it can't be reused.  Sections
+ * with CIP_OPT_POST_GLOBAL options are never reused, because their callbacks
+ * must run again against the new file, and the values they would mark belong
+ * to the old one (which may still be in use, e.g. through a cip_config).
+ *
+ * A section is reused when its text hashes the same as the old one's; the old
+ * text is gone by now, so a hash collision would keep the old values.
+ */
+static ssize_t cip_reparse_sect(struct cip_parse_ctx *ctx, const char *buf,
+				size_t len)
+{
+	struct cip_line_tokens tok;
+	size_t end, pos, eol;
+	const char *nl, *p;
+	cip_ini_sect *old;
+	uint64_t hash;
+	int lines;
+
+	for (p = buf; p < buf + len && cip_isspace(*p); ++p);
+
+	if (p == buf + len || cip_cclass(*p) != CIP_CC_LBRACKET)
+		return 0;
+
+	cip_lex_line(&tok, buf, len);
+	if (tok.type != CIP_LINE_SECT)
+		return 0;
+
+	old = cip_reparse_find(ctx->old, &tok);
+	if (old == NULL || (old->schema->flags & CIP_SECT_POST_GLOBAL))
+		return 0;
+
+	/* Same lines as cip_parse_mem() */
+
+	end = cip_next_header(buf, len, 0);
+	hash = 0;
+	lines = 0;
+
+	for (pos = 0; pos < end; pos = eol + 1) {
+		nl = memchr(buf + pos, '\n', end - pos);
+		eol = (nl != NULL) ? (size_t)(nl - buf) : end;
+		hash = cip_hash(buf + pos, eol - pos, hash);
+		++lines;
+	}
+
+	if (hash != old->hash)
+		return 0;
+
+	if (cip_line_sect_borrow(ctx, old) == NULL)
+		return -1;
+
+	if (cip_check_prev_sect(ctx) == -1)
+		return -1;
+
+	/* Values (and defaults) are complete */
+	ctx->sect = NULL;
+	ctx->line_num += lines - 1;
+
+	return end;
+}
+
+static int cip_reparse_mem(struct cip_parse_ctx *ctx, const char *buf,
+			   size_t len)
+{
+	ssize_t eol, skip;
+
+	while (len != 0) {
+
+		++(ctx->line_num);
+
+		skip = cip_reparse_sect(ctx, buf, len);
+		if (skip == -1)
+			return -1;
+
+		if (skip != 0) {
+			buf += skip;
+			len -= skip;
+			continue;
 		}
 
-		free(lineptr);
+		eol = cip_parse_line(ctx, buf, len);
+		if (eol == -1)
+			return -1;
 
-		if (cip_check_prev_sect(&ctx) == -1) {
-			cip_ini_file_free(ctx.file);
-			return NULL;
+		if ((size_t)eol == len)
+			break;
+
+		buf += eol + 1;
+		len -= eol + 1;
+	}
+
+	return 0;
+}
+
+static cip_ini_file *cip_reparse_finish(struct cip_parse_ctx *ctx)
+{
+	cip_ini_sect **borrowed;
+	cip_ini_file *file;
+	size_t i;
+
+	borrowed = ctx->borrowed;
+	file = cip_parse_finish(ctx);
+
+	if (file != NULL) {
+		for (i = 0; i < ctx->num_borrowed; i += 2) {
+			borrowed[i]->flags &= ~CIP_INI_BORROWED;
+			borrowed[i + 1]->flags |= CIP_INI_BORROWED;
 		}
 	}
 
-	tree = (struct cip_avl_node *)schema->sections;
-	if (tree != NULL) {
-		if (cip_avl_foreach(tree, cip_parse_file_cb, &ctx) == 0) {
-			cip_ini_file_free(ctx.file);
-			return NULL;
+	free(borrowed);
+	return file;
+}
+
+cip_ini_file *cip_reparse_buffer(cip_err_ctx *err_ctx, cip_ini_file *old,
+				 const char *buf, size_t len, const char *name,
+				 int (*warning_fn)(const char *warn_msg))
+{
+	struct cip_parse_ctx ctx;
+
+	/*
+	 * Nothing in a cache image or an arena can be shared, and neither can
+	 * values that point into old's text, which goes away with old
+	 */
+	if (old->image != NULL || old->arena != NULL ||
+			(old->schema->flags & CIP_FILE_ARENA) ||
+			old->source != NULL || old->text != NULL ||
+			(old->flags & CIP_INI_SOURCE)) {
+		return cip_parse_buffer(err_ctx, buf, len, name, old->schema,
+					warning_fn);
+	}
+
+	if (cip_parse_ctx_init(&ctx, err_ctx, name, old->schema,
+			       warning_fn) == -1) {
+		return NULL;
+	}
+
+	ctx.old = old;
+	ctx.keep_source = 1;
+
+	if (cip_reparse_mem(&ctx, buf, len) == -1) {
+		cip_parse_ctx_abort(&ctx);
+		return NULL;
+	}
+
+	return cip_reparse_finish(&ctx);
+}
+
+/*
+ * Incremental ("push") parsing; only a line that is split between chunks is
+ * copied, and only until the rest of it arrives.
+ */
+
+struct cip_parser {
+	struct cip_parse_ctx ctx;
+	char *partial;
+	size_t partial_len;
+	size_t partial_size;
+	int failed;
+};
+
+cip_parser *cip_parser_new(cip_err_ctx *err_ctx, const char *name,
+			   const cip_file_schema *schema,
+			   int (*warning_fn)(const char *warn_msg))
+{
+	cip_parser *new;
+
+	new = malloc(sizeof *new);
+	if (new == NULL)
+		return cip_err_ptr(err_ctx, "%s", strerror(ENOMEM));
+
+	if (cip_parse_ctx_init(&new->ctx, err_ctx, name, schema,
+			       warning_fn) == -1) {
+		free(new);
+		return NULL;
+	}
+
+	new->partial = NULL;
+	new->partial_len = 0;
+	new->partial_size = 0;
+	new->failed = 0;
+
+	return new;
+}
+
+void cip_parser_free(cip_parser *parser)
+{
+	cip_parse_ctx_abort(&parser->ctx);
+	free(parser->partial);
+	free(parser);
+}
+
+static int cip_parser_save(cip_parser *parser, const char *s, size_t len)
+{
+	size_t new_size;
+	char *new_buf;
+
+	if (len == 0)
+		return 0;
+
+	if (parser->partial_len + len > parser->partial_size) {
+
+		new_size = (parser->partial_size != 0) ?
+					parser->partial_size : 128;
+		while (new_size < parser->partial_len + len)
+			new_size *= 2;
+
+		new_buf = realloc(parser->partial, new_size);
+		if (new_buf == NULL) {
+			return cip_err_int(parser->ctx.err, "%s",
+					   strerror(ENOMEM));
+		}
+
+		parser->partial = new_buf;
+		parser->partial_size = new_size;
+	}
+
+	memcpy(parser->partial + parser->partial_len, s, len);
+	parser->partial_len += len;
+
+	return 0;
+}
+
+int cip_parser_feed(cip_parser *parser, const char *chunk, size_t len)
+{
+	const char *nl;
+	size_t n;
+
+	if (parser->failed)
+		return cip_err_int(parser->ctx.err, "%s: Parser already failed",
+				   parser->ctx.file_name);
+
+	if (parser->partial_len != 0) {
+
+		nl = memchr(chunk, '\n', len);
+		if (nl == NULL)
+			return cip_parser_save(parser, chunk, len);
+
+		n = nl - chunk + 1;
+
+		if (cip_parser_save(parser, chunk, n) == -1 ||
+			cip_parse_mem(&parser->ctx, parser->partial,
+				      parser->partial_len) == -1) {
+			parser->failed = 1;
+			return -1;
 		}
+
+		parser->partial_len = 0;
+		chunk += n;
+		len -= n;
+	}
+
+	nl = memrchr(chunk, '\n', len);
+	n = (nl != NULL) ? (size_t)(nl - chunk + 1) : 0;
+
+	if (cip_parse_mem(&parser->ctx, chunk, n) == -1 ||
+			cip_parser_save(parser, chunk + n, len - n) == -1) {
+		parser->failed = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+cip_ini_file *cip_parser_finish(cip_parser *parser)
+{
+	cip_ini_file *file;
+
+	if (parser->failed) {
+		cip_parser_free(parser);
+		return NULL;
+	}
+
+	/* Last line, without a newline */
+
+	if (cip_parse_mem(&parser->ctx, parser->partial,
+			  parser->partial_len) == -1) {
+		cip_parser_free(parser);
+		return NULL;
 	}
 
-	if (cip_post_parse(&ctx) == -1) {
-		cip_ini_file_free(ctx.file);
+	file = cip_parse_finish(&parser->ctx);
+
+	free(parser->partial);
+	free(parser);
+
+	return file;
+}
+
+cip_ini_file *cip_parse_stream(cip_err_ctx *err_ctx, FILE *stream,
+			       const char *name, const cip_file_schema *schema,
+			       int (*warning_fn)(const char *warn_msg))
+{
+	cip_parser *parser;
+	char buf[65536];
+	size_t len;
+
+	parser = cip_parser_new(err_ctx, name, schema, warning_fn);
+	if (parser == NULL)
 		return NULL;
+
+	if (stream != NULL) {
+
+		while ((len = fread(buf, 1, sizeof buf, stream)) != 0) {
+
+			if (cip_parser_feed(parser, buf, len) == -1) {
+				cip_parser_free(parser);
+				return NULL;
+			}
+		}
+
+		if (ferror(stream)) {
+			cip_err(err_ctx, "%s: %m", name);
+			cip_parser_free(parser);
+			return NULL;
+		}
 	}
 
-	return ctx.file;
+	return cip_parser_finish(parser);
 }
 
 cip_ini_file *cip_parse_file(cip_err_ctx *err_ctx, const char *file_name,
-			     cip_file_schema *schema,
+			     const cip_file_schema *schema,
 			     int (*warning_fn)(const char *warn_msg))
 {
 	cip_ini_file *file;
@@ -748,6 +1446,139 @@ cip_ini_file *cip_parse_file(cip_err_ctx *err_ctx, const char *file_name,
 	return file;
 }
 
+static cip_ini_file *cip_parse_fd_stream(cip_err_ctx *err_ctx, int fd,
+					 const char *file_name,
+					 const cip_file_schema *schema,
+					 int (*warning_fn)(const char *warn_msg))
+{
+	cip_ini_file *file;
+	FILE *stream;
+
+	stream = fdopen(fd, "r");
+	if (stream == NULL) {
+		cip_err(err_ctx, "%s: %m", file_name);
+		close(fd);
+		return NULL;
+	}
+
+	file = cip_parse_stream(err_ctx, stream, file_name, schema, warning_fn);
+	if (file == NULL) {
+		fclose(stream);
+		return NULL;
+	}
+
+	if (fclose(stream) == EOF) {
+		cip_err(err_ctx, "%s: %m", file_name);
+		cip_ini_file_free(file);
+		return NULL;
+	}
+
+	return file;
+}
+
+/* Reparses old if it isn't NULL (and the file is mappable) */
+static cip_ini_file *cip_parse_mapped(cip_err_ctx *err_ctx,
+				      const char *file_name,
+				      const cip_file_schema *schema,
+				      int (*warning_fn)(const char *warn_msg),
+				      unsigned threads, cip_ini_file *old)
+{
+	cip_ini_file *file;
+	struct stat st;
+	size_t len;
+	void *map;
+	int fd;
+
+	fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return cip_err_ptr(err_ctx, "%s: %m", file_name);
+
+	if (fstat(fd, &st) == -1) {
+		cip_err(err_ctx, "%s: %m", file_name);
+		close(fd);
+		return NULL;
+	}
+
+	/* Pipes, character devices, etc. can't be mapped */
+
+	if (!S_ISREG(st.st_mode)) {
+		return cip_parse_fd_stream(err_ctx, fd, file_name, schema,
+					   warning_fn);
+	}
+
+	len = st.st_size;
+
+	if (len == 0) {
+		map = NULL;
+	}
+	else {
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			cip_err(err_ctx, "%s: %m", file_name);
+			close(fd);
+			return NULL;
+		}
+
+		madvise(map, len, MADV_SEQUENTIAL);
+	}
+
+	close(fd);
+
+	if (old != NULL) {
+		file = cip_reparse_buffer(err_ctx, old, map, len, file_name,
+					  warning_fn);
+	}
+	else if (threads == 1) {
+		file = cip_parse_buffer(err_ctx, map, len, file_name, schema,
+					warning_fn);
+	}
+	else {
+		file = cip_parse_buffer_mt(err_ctx, map, len, file_name, schema,
+					   warning_fn, threads);
+	}
+
+	if (map != NULL)
+		cip_parse_unmap(file, map, len);
+
+	return file;
+}
+
+void cip_parse_unmap(cip_ini_file *file, void *map, size_t len)
+{
+	if (file != NULL && (file->flags & CIP_INI_SOURCE)) {
+		file->source = map;
+		file->source_size = len;
+	}
+	else {
+		munmap(map, len);
+	}
+}
+
+cip_ini_file *cip_parse_mmap(cip_err_ctx *err_ctx, const char *file_name,
+			     const cip_file_schema *schema,
+			     int (*warning_fn)(const char *warn_msg))
+{
+	return cip_parse_mapped(err_ctx, file_name, schema, warning_fn, 1,
+				NULL);
+}
+
+cip_ini_file *cip_parse_mmap_mt(cip_err_ctx *err_ctx, const char *file_name,
+				const cip_file_schema *schema,
+				int (*warning_fn)(const char *warn_msg),
+				unsigned threads)
+{
+	return cip_parse_mapped(err_ctx, file_name, schema, warning_fn,
+				threads, NULL);
+}
+
+cip_ini_file *cip_reparse_mmap(cip_err_ctx *err_ctx, cip_ini_file *old,
+			       const char *file_name,
+			       int (*warning_fn)(const char *warn_msg))
+{
+	return cip_parse_mapped(err_ctx, file_name, old->schema, warning_fn,
+				1, old);
+}
+
 /*
  * Temporary testing stuff
  */
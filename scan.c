@@ -0,0 +1,446 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CIP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Character classes; independent of the current locale
+ */
+
+const unsigned char cip_char_classes[256] = {
+	[0]	= CIP_CC_EOL,
+	['\n']	= CIP_CC_EOL,
+	['\t']	= CIP_CC_SPACE,
+	['\v']	= CIP_CC_SPACE,
+	['\f']	= CIP_CC_SPACE,
+	['\r']	= CIP_CC_SPACE,
+	[' ']	= CIP_CC_SPACE,
+	['=']	= CIP_CC_EQUALS,
+	['[']	= CIP_CC_LBRACKET,
+	[']']	= CIP_CC_RBRACKET,
+	[':']	= CIP_CC_COLON,
+	[';']	= CIP_CC_COMMENT,
+	['#']	= CIP_CC_COMMENT,
+};
+
+/*
+ * Finds the end of a line, the first '=', ']' and ':', the first and last
+ * non-whitespace characters, and the non-whitespace characters either side of
+ * the first '=' (so an option's name and value come out already trimmed), in
+ * a single pass.  A NUL ends the line (as it would a C string), but the scan
+ * still continues to the newline, so that the next line is found correctly.
+ */
+
+struct cip_line_scan {
+	size_t eol;		/* newline (or end of buffer) */
+	size_t len;		/* end of line content (newline or NUL) */
+	size_t first;		/* first non-whitespace character */
+	size_t last;		/* after last non-whitespace character */
+	size_t equals;		/* first '=' (len if none) */
+	size_t rbracket;	/* first ']' (len if none) */
+	size_t colon;		/* first ':' (len if none) */
+	size_t key_end;		/* after last non-whitespace before equals */
+	size_t value_start;	/* first non-whitespace after equals, or last */
+};
+
+static inline void cip_scan_start(struct cip_line_scan *scan)
+{
+	scan->first = SIZE_MAX;
+	scan->last = 0;
+	scan->equals = SIZE_MAX;
+	scan->rbracket = SIZE_MAX;
+	scan->colon = SIZE_MAX;
+	scan->key_end = SIZE_MAX;
+	scan->value_start = SIZE_MAX;
+}
+
+static inline void cip_scan_end(struct cip_line_scan *scan, const char *s,
+				size_t size, size_t pos)
+{
+	const char *nl;
+
+	if (pos >= size) {
+		scan->eol = size;
+		scan->len = size;
+	}
+	else if (s[pos] == '\n') {
+		scan->eol = pos;
+		scan->len = pos;
+	}
+	else {
+		/* NUL; the rest of the line is ignored */
+		scan->len = pos;
+		nl = memchr(s + pos, '\n', size - pos);
+		scan->eol = (nl != NULL) ? (size_t)(nl - s) : size;
+	}
+
+	if (scan->first == SIZE_MAX)
+		scan->first = 0;
+	if (scan->equals > scan->len)
+		scan->equals = scan->len;
+	if (scan->rbracket > scan->len)
+		scan->rbracket = scan->len;
+	if (scan->colon > scan->len)
+		scan->colon = scan->len;
+	if (scan->key_end > scan->equals)
+		scan->key_end = scan->equals;
+	if (scan->value_start > scan->last)
+		scan->value_start = scan->last;
+}
+
+/* The first '=' is at i; first and last cover the characters before it */
+static inline void cip_scan_eq(struct cip_line_scan *scan, size_t i)
+{
+	scan->equals = i;
+	scan->key_end = (scan->first != SIZE_MAX) ? scan->last : i;
+}
+
+static void cip_scan_line_scalar(struct cip_line_scan *scan, const char *s,
+				 size_t size)
+{
+	size_t i;
+
+	cip_scan_start(scan);
+
+	for (i = 0; i < size; ++i) {
+
+		switch (cip_cclass(s[i])) {
+
+			case CIP_CC_EOL:	cip_scan_end(scan, s, size, i);
+						return;
+
+			case CIP_CC_SPACE:	continue;
+
+			case CIP_CC_EQUALS:	if (scan->equals == SIZE_MAX)
+							cip_scan_eq(scan, i);
+						break;
+
+			case CIP_CC_RBRACKET:	if (scan->rbracket == SIZE_MAX)
+							scan->rbracket = i;
+						break;
+
+			case CIP_CC_COLON:	if (scan->colon == SIZE_MAX)
+							scan->colon = i;
+						break;
+		}
+
+		if (scan->first == SIZE_MAX)
+			scan->first = i;
+		else if (scan->value_start == SIZE_MAX && scan->equals < i)
+			scan->value_start = i;
+		scan->last = i + 1;
+	}
+
+	cip_scan_end(scan, s, size, size);
+}
+
+#ifdef CIP_SCAN_X86
+
+/*
+ * Processes the match masks for one block of 16 or 32 characters (block has
+ * a bit set for each character in the block); returns 1 if the block contains
+ * the end of the line.
+ */
+static inline int cip_scan_block(struct cip_line_scan *scan, const char *s,
+				 size_t size, size_t base, uint32_t block,
+				 uint32_t end, uint32_t space, uint32_t equals,
+				 uint32_t rbracket, uint32_t colon)
+{
+	uint32_t keep, chars, before, after;
+	unsigned e;
+
+	if (end != 0)
+		keep = (end & -end) - 1;	/* bits before the end */
+	else
+		keep = block;
+
+	chars = ~space & keep;
+	equals &= keep;
+	rbracket &= keep;
+	colon &= keep;
+
+	/* first and last still cover only the earlier blocks here */
+
+	if (equals != 0 && scan->equals == SIZE_MAX) {
+		e = __builtin_ctz(equals);
+		scan->equals = base + e;
+		before = chars & (((uint32_t)1 << e) - 1);
+		if (before != 0)
+			scan->key_end = base + 32 - __builtin_clz(before);
+		else if (scan->first != SIZE_MAX)
+			scan->key_end = scan->last;
+		else
+			scan->key_end = base + e;
+	}
+
+	if (scan->value_start == SIZE_MAX && scan->equals != SIZE_MAX) {
+		after = chars;
+		if (scan->equals >= base)
+			after &= UINT32_MAX << (scan->equals - base) << 1;
+		if (after != 0)
+			scan->value_start = base + __builtin_ctz(after);
+	}
+	if (rbracket != 0 && scan->rbracket == SIZE_MAX)
+		scan->rbracket = base + __builtin_ctz(rbracket);
+	if (colon != 0 && scan->colon == SIZE_MAX)
+		scan->colon = base + __builtin_ctz(colon);
+
+	if (chars != 0) {
+		if (scan->first == SIZE_MAX)
+			scan->first = base + __builtin_ctz(chars);
+		scan->last = base + 32 - __builtin_clz(chars);
+	}
+
+	if (end == 0)
+		return 0;
+
+	cip_scan_end(scan, s, size, base + __builtin_ctz(end));
+	return 1;
+}
+
+/*
+ * Loads a block; the partial block at the end of the buffer is copied and
+ * padded with newlines, so nothing past the end of the buffer is ever read.
+ */
+#define CIP_SCAN_LOAD(type, load, s, size, base, tail)			\
+	((size) - (base) >= sizeof(type)				\
+		? load((const type *)((s) + (base)))			\
+		: (memset((tail), '\n', sizeof(type)),			\
+		   memcpy((tail), (s) + (base), (size) - (base)),	\
+		   load((const type *)(tail))))
+
+__attribute__((target("sse2")))
+static void cip_scan_line_sse2(struct cip_line_scan *scan, const char *s,
+			       size_t size)
+{
+	__m128i v, t, nl, nul, sp, ws_base, ws_range, eq, rb, co;
+	char tail[sizeof(__m128i)];
+	uint32_t end, space;
+	size_t base;
+
+	nl = _mm_set1_epi8('\n');
+	nul = _mm_setzero_si128();
+	sp = _mm_set1_epi8(' ');
+	ws_base = _mm_set1_epi8('\t');
+	ws_range = _mm_set1_epi8('\r' - '\t');
+	eq = _mm_set1_epi8('=');
+	rb = _mm_set1_epi8(']');
+	co = _mm_set1_epi8(':');
+
+	cip_scan_start(scan);
+
+	for (base = 0; ; base += sizeof(__m128i)) {
+
+		v = CIP_SCAN_LOAD(__m128i, _mm_loadu_si128, s, size, base,
+				  tail);
+
+		end = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl),
+						     _mm_cmpeq_epi8(v, nul)));
+
+		/* '\t' - '\r' (unsigned v - '\t' <= '\r' - '\t') or ' ' */
+		t = _mm_sub_epi8(v, ws_base);
+		t = _mm_cmpeq_epi8(_mm_min_epu8(t, ws_range), t);
+		space = _mm_movemask_epi8(_mm_or_si128(t,
+						_mm_cmpeq_epi8(v, sp)));
+
+		if (cip_scan_block(scan, s, size, base, UINT16_MAX, end, space,
+			_mm_movemask_epi8(_mm_cmpeq_epi8(v, eq)),
+			_mm_movemask_epi8(_mm_cmpeq_epi8(v, rb)),
+			_mm_movemask_epi8(_mm_cmpeq_epi8(v, co)))) {
+			return;
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void cip_scan_line_avx2(struct cip_line_scan *scan, const char *s,
+			       size_t size)
+{
+	__m256i v, t, nl, nul, sp, ws_base, ws_range, eq, rb, co;
+	char tail[sizeof(__m256i)];
+	uint32_t end, space;
+	size_t base;
+
+	nl = _mm256_set1_epi8('\n');
+	nul = _mm256_setzero_si256();
+	sp = _mm256_set1_epi8(' ');
+	ws_base = _mm256_set1_epi8('\t');
+	ws_range = _mm256_set1_epi8('\r' - '\t');
+	eq = _mm256_set1_epi8('=');
+	rb = _mm256_set1_epi8(']');
+	co = _mm256_set1_epi8(':');
+
+	cip_scan_start(scan);
+
+	for (base = 0; ; base += sizeof(__m256i)) {
+
+		v = CIP_SCAN_LOAD(__m256i, _mm256_loadu_si256, s, size, base,
+				  tail);
+
+		end = _mm256_movemask_epi8(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+						_mm256_cmpeq_epi8(v, nul)));
+
+		t = _mm256_sub_epi8(v, ws_base);
+		t = _mm256_cmpeq_epi8(_mm256_min_epu8(t, ws_range), t);
+		space = _mm256_movemask_epi8(_mm256_or_si256(t,
+						_mm256_cmpeq_epi8(v, sp)));
+
+		if (cip_scan_block(scan, s, size, base, UINT32_MAX, end, space,
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, eq)),
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, rb)),
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, co)))) {
+			return;
+		}
+	}
+}
+
+#endif	/* CIP_SCAN_X86 */
+
+static void (*cip_scan_fn)(struct cip_line_scan *scan, const char *s,
+			   size_t size) = cip_scan_line_scalar;
+
+__attribute__((constructor))
+static void cip_scan_select(void)
+{
+#ifdef CIP_SCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		cip_scan_fn = cip_scan_line_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		cip_scan_fn = cip_scan_line_sse2;
+#endif
+}
+
+/*
+ * Splits a line into tokens, from the offsets found by the scan.  Option names
+ * and values are trimmed by the scan itself; only the (short) parts of section
+ * headers and comments are trimmed afterwards.  Returns the offset of the
+ * newline (or size, if there isn't one).
+ */
+size_t cip_lex_line(struct cip_line_tokens *tok, const char *s, size_t size)
+{
+	struct cip_line_scan scan;
+	const char *title, *rest;
+	size_t len;
+
+	cip_scan_fn(&scan, s, size);
+
+	tok->comment.start = NULL;
+	tok->comment.len = 0;
+
+	if (scan.first == scan.last) {
+		tok->type = CIP_LINE_BLANK;
+		return scan.eol;
+	}
+
+	switch (cip_cclass(s[scan.first])) {
+
+		case CIP_CC_COMMENT:
+
+			tok->type = CIP_LINE_BLANK;
+			cip_slice_trim(&tok->comment, s + scan.first + 1,
+				       scan.last - scan.first - 1);
+			break;
+
+		case CIP_CC_LBRACKET:
+
+			if (scan.rbracket == scan.len) {
+				tok->type = CIP_LINE_UNCLOSED;
+				break;
+			}
+
+			tok->type = CIP_LINE_SECT;
+			title = s + scan.first + 1;
+
+			if (scan.colon < scan.rbracket) {
+				cip_slice_trim(&tok->title, title,
+					       s + scan.colon - title);
+				cip_slice_trim(&tok->id, s + scan.colon + 1,
+					       scan.rbracket - scan.colon - 1);
+			}
+			else {
+				cip_slice_trim(&tok->title, title,
+					       s + scan.rbracket - title);
+				tok->id.start = NULL;
+				tok->id.len = 0;
+			}
+
+			/* ']' isn't whitespace, so scan.last > scan.rbracket */
+
+			rest = s + scan.rbracket + 1;
+			len = scan.last - scan.rbracket - 1;
+
+			while (len != 0 && cip_isspace(*rest)) {
+				++rest;
+				--len;
+			}
+
+			tok->extra = (len != 0 &&
+				      cip_cclass(*rest) != CIP_CC_COMMENT);
+			if (len != 0 && !tok->extra) {
+				cip_slice_trim(&tok->comment, rest + 1,
+					       len - 1);
+			}
+			break;
+
+		default:
+
+			if (scan.equals == scan.len) {
+				tok->type = CIP_LINE_NO_EQUALS;
+				break;
+			}
+
+			tok->type = CIP_LINE_OPT;
+			tok->title.start = s + scan.first;
+			tok->title.len = scan.key_end - scan.first;
+			tok->value.start = s + scan.value_start;
+			tok->value.len = scan.last - scan.value_start;
+	}
+
+	return scan.eol;
+}
+
+size_t cip_next_header(const char *buf, size_t len, size_t pos)
+{
+	const char *nl, *p, *end;
+
+	end = buf + len;
+
+	while (1) {
+
+		nl = memchr(buf + pos, '\n', len - pos);
+		if (nl == NULL)
+			return len;
+
+		pos = nl - buf + 1;
+
+		for (p = nl + 1; p < end && cip_isspace(*p); ++p);
+
+		if (p < end && cip_cclass(*p) == CIP_CC_LBRACKET)
+			return pos;
+	}
+}
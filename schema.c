@@ -19,6 +19,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
 /*
  * Type-safe AVL tree putters (getters are in libcip_p.h)
@@ -47,6 +48,122 @@ static inline int cip_sect_schema_put(cip_file_schema *file,
 	return ret;
 }
 
+/*
+ * Sections and options in name order (indexes used by lookups and caches)
+ */
+
+static int cip_order_count_opt_cb(struct cip_avl_node *node
+					__attribute__((unused)),
+				  void *context)
+{
+	++*(size_t *)context;
+	return 1;
+}
+
+static int cip_order_count_cb(struct cip_avl_node *node, void *context)
+{
+	struct cip_schema_order *order;
+	cip_sect_schema *sect;
+
+	order = context;
+	sect = (cip_sect_schema *)node;
+
+	++order->num_sects;
+	cip_avl_foreach((struct cip_avl_node *)sect->options,
+			cip_order_count_opt_cb, &order->num_opts);
+
+	return 1;
+}
+
+static int cip_order_opt_cb(struct cip_avl_node *node, void *context)
+{
+	struct cip_schema_order *order;
+
+	order = context;
+	order->opts[order->num_opts++] = (cip_opt_schema *)node;
+
+	return 1;
+}
+
+static int cip_order_sect_cb(struct cip_avl_node *node, void *context)
+{
+	struct cip_schema_order *order;
+	cip_sect_schema *sect;
+
+	order = context;
+	sect = (cip_sect_schema *)node;
+
+	order->first_opt[order->num_sects] = order->num_opts;
+	order->sects[order->num_sects++] = sect;
+	cip_avl_foreach((struct cip_avl_node *)sect->options,
+			cip_order_opt_cb, order);
+
+	return 1;
+}
+
+int cip_schema_order_init(cip_err_ctx *ctx, struct cip_schema_order *order,
+			  const cip_file_schema *schema)
+{
+	struct cip_avl_node *tree;
+
+	tree = (struct cip_avl_node *)schema->sections;
+
+	order->num_sects = 0;
+	order->num_opts = 0;
+	cip_avl_foreach(tree, cip_order_count_cb, order);
+
+	order->sects = malloc((order->num_sects + 1) * sizeof *order->sects);
+	order->opts = malloc((order->num_opts + 1) * sizeof *order->opts);
+	order->first_opt = malloc((order->num_sects + 1) *
+				  sizeof *order->first_opt);
+
+	if (order->sects == NULL || order->opts == NULL ||
+		order->first_opt == NULL) {
+		cip_schema_order_fini(order);
+		return cip_err_int(ctx, "%s", strerror(ENOMEM));
+	}
+
+	order->num_sects = 0;
+	order->num_opts = 0;
+	cip_avl_foreach(tree, cip_order_sect_cb, order);
+	order->first_opt[order->num_sects] = order->num_opts;
+
+	return 0;
+}
+
+void cip_schema_order_fini(struct cip_schema_order *order)
+{
+	free(order->sects);
+	free(order->opts);
+	free(order->first_opt);
+}
+
+uint64_t cip_schema_names_hash(const struct cip_schema_order *order)
+{
+	const char *name;
+	size_t s, o, end;
+	uint64_t hash;
+
+	hash = 0;
+
+	for (s = 0; s < order->num_sects; ++s) {
+
+		name = order->sects[s]->node.name;
+		hash = cip_hash(name, strlen(name) + 1, hash);
+		end = order->first_opt[s + 1];
+
+		for (o = order->first_opt[s]; o < end; ++o) {
+			name = order->opts[o]->node.name;
+			hash = cip_hash(name, strlen(name) + 1, hash);
+		}
+
+		/* End of section (an empty name can't be an option's) */
+		hash = cip_hash("", 1, hash);
+	}
+
+	return hash;
+}
+
 /*
  * Public schema API
  */
@@ -60,6 +177,19 @@ cip_file_schema *cip_file_schema_new1(cip_err_ctx *ctx)
 		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
 
 	new->sections = NULL;
+	new->flags = 0;
+	new->lookup = NULL;
+	new->order.sects = NULL;
+	new->order.opts = NULL;
+	new->order.first_opt = NULL;
+	new->mph = NULL;
+	new->diag_fn = 0;
+	new->diag_data = NULL;
+	new->num_deps = 0;
+	new->max_post_rank = 0;
+	new->mark = 0;
+	new->num_sects = 0;
+
 	return new;
 }
 
@@ -80,12 +210,32 @@ cip_file_schema *cip_file_schema_new2(cip_err_ctx *ctx,
 	return new;
 }
 
+void cip_file_schema_set_flags(cip_file_schema *file_schema,
+			       unsigned char flags)
+{
+	file_schema->flags = flags;
+}
+
+void cip_file_schema_set_diag_fn(cip_file_schema *file_schema,
+				 int (*diag_fn)(const cip_diag *diag,
+						void *data),
+				 void *data)
+{
+	file_schema->diag_fn = diag_fn;
+	file_schema->diag_data = data;
+}
+
 cip_sect_schema *cip_sect_schema_new1(cip_err_ctx *ctx,
 				      cip_file_schema *file_schema, char *name,
 				      unsigned char flags)
 {
 	cip_sect_schema *new;
 
+	if (file_schema->lookup != NULL || file_schema->mph != NULL) {
+		return cip_err_ptr(ctx, "Can't add section '%s' to frozen "
+				   "schema", name);
+	}
+
 	new = malloc(sizeof *new);
 	if (new == NULL)
 		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
@@ -93,6 +243,13 @@ cip_sect_schema *cip_sect_schema_new1(cip_err_ctx *ctx,
 	new->node.name = name;
 	new->flags = flags;
 	new->options = NULL;
+	new->lookup = NULL;
+	new->opt_order = NULL;
+	new->index = -1;
+	new->mph = NULL;
+	new->num_opts = 0;
+	new->offset = 0;
+	new->struct_size = 0;
 
 	if (cip_sect_schema_put(file_schema, new) == -1) {
 		cip_err(ctx, "Schema section '%s' already exists", name);
@@ -100,6 +257,8 @@ cip_sect_schema *cip_sect_schema_new1(cip_err_ctx *ctx,
 		return NULL;
 	}
 
+	new->id = file_schema->num_sects++;
+
 	return new;
 }
 
@@ -109,11 +268,20 @@ cip_sect_schema *cip_sect_schema_new2(cip_err_ctx *ctx,
 {
 	cip_sect_schema *sect_schema;
 
+	if ((section->flags & CIP_SECT_MULTIPLE) && section->struct_size != 0 &&
+		section->struct_size < sizeof(char *)) {
+		return cip_err_ptr(ctx, "Section '%s' struct has no room for "
+				   "its ID", section->name);
+	}
+
 	sect_schema = cip_sect_schema_new1(ctx, file_schema, section->name,
 					   section->flags);
 	if (sect_schema == NULL)
 		return NULL;
 
+	sect_schema->offset = section->offset;
+	sect_schema->struct_size = section->struct_size;
+
 	if (cip_opt_schema_new3(ctx, sect_schema, section->options) == -1)
 		return NULL;
 
@@ -133,19 +301,45 @@ int cip_sect_schema_new3(cip_err_ctx *ctx, cip_file_schema *file_schema,
 	return 0;
 }
 
-int cip_opt_schema_new1(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
-			char *name, const cip_opt_type *type,
-		        int (*post_parse_fn)(cip_err_ctx *ctx,
-					     const cip_ini_value *value,
-					     const cip_ini_sect *sect,
-					     const cip_ini_file *file,
-			                     void *post_parse_data),
-		        void *post_parse_data, unsigned char flags,
-		        const void *default_value)
+/* Bound options must fit in the section's struct, after any instance ID */
+static int cip_opt_schema_fits(const cip_sect_schema *sect_schema,
+			       const cip_opt_type *type, size_t offset)
+{
+	size_t size;
+
+	size = sect_schema->struct_size;
+
+	if ((sect_schema->flags & CIP_SECT_MULTIPLE) && offset < sizeof(char *))
+		return 0;
+
+	return size != 0 && offset <= size && type->size <= size - offset;
+}
+
+static int cip_opt_schema_add(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
+			      char *name, const cip_opt_type *type,
+			      int (*post_parse_fn)(cip_err_ctx *ctx,
+						   const cip_ini_value *value,
+						   const cip_ini_sect *sect,
+						   const cip_ini_file *file,
+						   void *post_parse_data),
+			      void *post_parse_data, unsigned char flags,
+			      const void *default_value, size_t offset)
 {
 	cip_opt_schema *new;
 	int has_default;
 
+	if (sect_schema->lookup != NULL || sect_schema->mph != NULL) {
+		return cip_err_int(ctx, "Can't add option '[%s]:%s' to frozen "
+				   "schema", sect_schema->node.name, name);
+	}
+
+	if ((flags & CIP_OPT_BIND) &&
+		!cip_opt_schema_fits(sect_schema, type, offset)) {
+		return cip_err_int(ctx, "Option '[%s]:%s' doesn't fit in its "
+				   "section's struct", sect_schema->node.name,
+				   name);
+	}
+
 	has_default = flags & CIP_OPT_DEFAULT;
 
 	new = malloc(sizeof *new + (has_default ? type->size : 0));
@@ -157,6 +351,10 @@ int cip_opt_schema_new1(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
 	new->post_parse_fn = post_parse_fn;
 	new->post_parse_data = post_parse_data;
 	new->flags = flags;
+	new->offset = offset;
+	new->deps = NULL;
+	new->post_rank = 0;
+	new->mark = 0;
 
 	if (has_default)
 		memcpy(new->default_value, default_value, type->size);
@@ -168,16 +366,35 @@ int cip_opt_schema_new1(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
 		return -1;
 	}
 
+	new->slot = sect_schema->num_opts++;
+
+	if (flags & CIP_OPT_POST_GLOBAL)
+		sect_schema->flags |= CIP_SECT_POST_GLOBAL;
+
 	return 0;
 }
 
+int cip_opt_schema_new1(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
+			char *name, const cip_opt_type *type,
+		        int (*post_parse_fn)(cip_err_ctx *ctx,
+					     const cip_ini_value *value,
+					     const cip_ini_sect *sect,
+					     const cip_ini_file *file,
+			                     void *post_parse_data),
+		        void *post_parse_data, unsigned char flags,
+		        const void *default_value)
+{
+	return cip_opt_schema_add(ctx, sect_schema, name, type, post_parse_fn,
+				  post_parse_data, flags, default_value, 0);
+}
+
 int cip_opt_schema_new2(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
 			const cip_opt_info *option)
 {
-	return cip_opt_schema_new1(ctx, sect_schema, option->name, option->type,
-				   option->post_parse_fn,
-				   option->post_parse_data, option->flags,
-				   option->default_value);
+	return cip_opt_schema_add(ctx, sect_schema, option->name, option->type,
+				  option->post_parse_fn,
+				  option->post_parse_data, option->flags,
+				  option->default_value, option->offset);
 }
 
 int cip_opt_schema_new3(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
@@ -193,14 +410,384 @@ int cip_opt_schema_new3(cip_err_ctx *ctx, cip_sect_schema *sect_schema,
 	return 0;
 }
 
+int cip_file_schema_set_lookup(cip_err_ctx *ctx, cip_file_schema *file_schema,
+			       const cip_schema_lookup *lookup)
+{
+	struct cip_schema_order *order;
+	cip_sect_schema *sect;
+	size_t i;
+
+	if (file_schema->lookup != NULL || file_schema->mph != NULL)
+		return cip_err_int(ctx, "Schema is already frozen");
+
+	order = &file_schema->order;
+
+	if (cip_schema_order_init(ctx, order, file_schema) == -1)
+		return -1;
+
+	if (cip_schema_names_hash(order) != lookup->names_hash) {
+		cip_schema_order_fini(order);
+		order->sects = NULL;
+		order->opts = NULL;
+		order->first_opt = NULL;
+		return cip_err_int(ctx, "Lookup was generated from a different "
+				   "schema");
+	}
+
+	for (i = 0; i < order->num_sects; ++i) {
+		sect = order->sects[i];
+		sect->lookup = lookup;
+		sect->opt_order = order->opts + order->first_opt[i];
+		sect->index = i;
+	}
+
+	file_schema->lookup = lookup;
+
+	return 0;
+}
+
+/* All of the tables share one allocation, owned by the file schema */
+int cip_file_schema_freeze(cip_err_ctx *ctx, cip_file_schema *file_schema)
+{
+	struct cip_schema_order order;
+	size_t s, size, first, count;
+	unsigned char *block;
+	struct cip_mph *mph;
+
+	if (file_schema->lookup != NULL || file_schema->mph != NULL)
+		return cip_err_int(ctx, "Schema is already frozen");
+
+	if (cip_schema_order_init(ctx, &order, file_schema) == -1)
+		return -1;
+
+	size = cip_mph_size(order.num_sects);
+	for (s = 0; s < order.num_sects; ++s) {
+		count = order.first_opt[s + 1] - order.first_opt[s];
+		size += cip_mph_size(count);
+	}
+
+	block = malloc(size);
+	if (block == NULL) {
+		cip_schema_order_fini(&order);
+		return cip_err_int(ctx, "%s", strerror(ENOMEM));
+	}
+
+	mph = (struct cip_mph *)block;
+	if (cip_mph_init(ctx, mph, (struct cip_avl_node **)order.sects,
+			 order.num_sects) == -1) {
+		goto error;
+	}
+
+	block += cip_mph_size(order.num_sects);
+
+	for (s = 0; s < order.num_sects; ++s) {
+
+		first = order.first_opt[s];
+		count = order.first_opt[s + 1] - first;
+
+		order.sects[s]->mph = (struct cip_mph *)block;
+		if (cip_mph_init(ctx, (struct cip_mph *)block,
+				 (struct cip_avl_node **)order.opts + first,
+				 count) == -1) {
+			goto error;
+		}
+
+		block += cip_mph_size(count);
+	}
+
+	file_schema->mph = mph;
+	cip_schema_order_fini(&order);
+
+	return 0;
+
+error:
+	for (s = 0; s < order.num_sects; ++s)
+		order.sects[s]->mph = NULL;
+
+	free(mph);
+	cip_schema_order_fini(&order);
+	return -1;
+}
+
+int cip_opt_handle(cip_err_ctx *ctx, const cip_file_schema *file_schema,
+		   const char *sect_name, const char *opt_name)
+{
+	const cip_sect_schema *sect_schema;
+	const cip_opt_schema *opt_schema;
+
+	sect_schema = cip_sect_schema_get_n(file_schema, sect_name,
+					    strlen(sect_name));
+	if (sect_schema == NULL)
+		return cip_err_int(ctx, "Unknown section [%s]", sect_name);
+
+	opt_schema = cip_opt_schema_get_n(sect_schema, opt_name,
+					  strlen(opt_name));
+	if (opt_schema == NULL) {
+		return cip_err_int(ctx, "Unknown option [%s]:%s", sect_name,
+				   opt_name);
+	}
+
+	if (sect_schema->id > CIP_HANDLE_MAX_ID ||
+			opt_schema->slot > CIP_HANDLE_SLOT_MASK) {
+		return cip_err_int(ctx, "Too many sections or options for a "
+				   "handle to [%s]:%s", sect_name, opt_name);
+	}
+
+	return (int)(sect_schema->id << CIP_HANDLE_SLOT_BITS |
+		     opt_schema->slot);
+}
+
+/*
+ * Post-parse dependencies.  Each option's rank is one more than the highest
+ * rank among the options it depends on (0 if none), so running callbacks in
+ * order of rank runs every one after its dependencies.
+ */
+
+static cip_opt_schema *cip_opt_schema_find(cip_err_ctx *ctx,
+					   const cip_file_schema *file_schema,
+					   const char *sect_name,
+					   const char *opt_name,
+					   const cip_sect_schema **sect)
+{
+	cip_opt_schema *opt_schema;
+
+	*sect = cip_sect_schema_get_n(file_schema, sect_name,
+				      strlen(sect_name));
+	if (*sect == NULL)
+		return cip_err_ptr(ctx, "Unknown section [%s]", sect_name);
+
+	if (opt_name == NULL)
+		return NULL;
+
+	opt_schema = cip_opt_schema_get_n(*sect, opt_name, strlen(opt_name));
+	if (opt_schema == NULL) {
+		return cip_err_ptr(ctx, "Unknown option [%s]:%s", sect_name,
+				   opt_name);
+	}
+
+	return opt_schema;
+}
+
+/*
+ * Looks for a chain of dependencies from opt to target, and stores it in path
+ * (which has room for every dependency).  Returns its length, or 0 if none.
+ */
+static unsigned cip_post_path(cip_opt_schema *opt,
+			      const cip_opt_schema *target,
+			      const struct cip_post_dep **path, unsigned mark)
+{
+	const struct cip_post_dep *dep;
+	unsigned len;
+
+	if (opt->mark == mark)
+		return 0;
+
+	opt->mark = mark;
+
+	for (dep = opt->deps; dep != NULL; dep = dep->next) {
+
+		if (dep->opt == target)
+			len = 0;
+		else if ((len = cip_post_path(dep->opt, target, path + 1,
+					      mark)) == 0)
+			continue;
+
+		path[0] = dep;
+		return len + 1;
+	}
+
+	return 0;
+}
+
+/* Fails if opt depending on dep would close a cycle, and describes it */
+static int cip_post_check(cip_err_ctx *ctx, cip_file_schema *file_schema,
+			  const cip_sect_schema *sect, cip_opt_schema *opt,
+			  const cip_sect_schema *dep_sect,
+			  cip_opt_schema *dep)
+{
+	const struct cip_post_dep **path;
+	unsigned len, i;
+
+	if (dep == opt) {
+		return cip_err_int(ctx, "Post-parse dependency cycle: "
+				   "[%s]:%s -> [%s]:%s", sect->node.name,
+				   opt->node.name, sect->node.name,
+				   opt->node.name);
+	}
+
+	path = malloc((file_schema->num_deps + 1) * sizeof *path);
+	if (path == NULL)
+		return cip_err_int(ctx, "%s", strerror(ENOMEM));
+
+	len = cip_post_path(dep, opt, path, ++file_schema->mark);
+
+	if (len != 0) {
+
+		cip_err(ctx, "Post-parse dependency cycle: [%s]:%s -> [%s]:%s",
+			sect->node.name, opt->node.name, dep_sect->node.name,
+			dep->node.name);
+
+		for (i = 0; i < len; ++i) {
+			cip_err_use(ctx, "%s -> [%s]:%s", cip_last_err(ctx),
+				    path[i]->sect->node.name,
+				    path[i]->opt->node.name);
+		}
+	}
+
+	free(path);
+
+	return (len != 0) ? -1 : 0;
+}
+
+static int cip_post_add(cip_err_ctx *ctx, cip_file_schema *file_schema,
+			cip_opt_schema *opt, const cip_sect_schema *dep_sect,
+			cip_opt_schema *dep)
+{
+	struct cip_post_dep *new;
+
+	for (new = opt->deps; new != NULL; new = new->next) {
+		if (new->opt == dep)
+			return 0;
+	}
+
+	new = malloc(sizeof *new);
+	if (new == NULL)
+		return cip_err_int(ctx, "%s", strerror(ENOMEM));
+
+	new->sect = dep_sect;
+	new->opt = dep;
+	new->next = opt->deps;
+	opt->deps = new;
+	++file_schema->num_deps;
+
+	return 0;
+}
+
+static unsigned cip_post_rank(cip_opt_schema *opt, unsigned mark)
+{
+	const struct cip_post_dep *dep;
+	unsigned rank, dep_rank;
+
+	if (opt->mark == mark)
+		return opt->post_rank;
+
+	rank = 0;
+
+	for (dep = opt->deps; dep != NULL; dep = dep->next) {
+		dep_rank = cip_post_rank(dep->opt, mark) + 1;
+		if (dep_rank > rank)
+			rank = dep_rank;
+	}
+
+	opt->mark = mark;
+	opt->post_rank = rank;
+
+	return rank;
+}
+
+static void cip_post_rank_all(cip_file_schema *file_schema)
+{
+	struct cip_avl_iter sects, opts;
+	struct cip_avl_node *sect, *opt;
+	unsigned mark, rank;
+
+	mark = ++file_schema->mark;
+	file_schema->max_post_rank = 0;
+
+	cip_avl_iter_init(&sects, (struct cip_avl_node *)file_schema->sections);
+
+	while ((sect = cip_avl_iter_next(&sects)) != NULL) {
+
+		cip_avl_iter_init(&opts, (struct cip_avl_node *)
+					((cip_sect_schema *)sect)->options);
+
+		while ((opt = cip_avl_iter_next(&opts)) != NULL) {
+			rank = cip_post_rank((cip_opt_schema *)opt, mark);
+			if (rank > file_schema->max_post_rank)
+				file_schema->max_post_rank = rank;
+		}
+	}
+}
+
+int cip_opt_schema_depend(cip_err_ctx *ctx, cip_file_schema *file_schema,
+			  const char *sect_name, const char *opt_name,
+			  const char *dep_sect, const char *dep_opt)
+{
+	const cip_sect_schema *sect, *d_sect;
+	struct cip_avl_node *node;
+	struct cip_avl_iter iter;
+	cip_opt_schema *opt, *dep;
+	int pass, ret;
+
+	opt = cip_opt_schema_find(ctx, file_schema, sect_name, opt_name, &sect);
+	if (opt == NULL)
+		return -1;
+
+	dep = cip_opt_schema_find(ctx, file_schema, dep_sect, dep_opt, &d_sect);
+	if (d_sect == NULL || (dep_opt != NULL && dep == NULL))
+		return -1;
+
+	if (dep != NULL) {
+		if (cip_post_check(ctx, file_schema, sect, opt, d_sect,
+				   dep) == -1 ||
+				cip_post_add(ctx, file_schema, opt, d_sect,
+					     dep) == -1) {
+			return -1;
+		}
+		cip_post_rank_all(file_schema);
+		return 0;
+	}
+
+	/* Check all of the section's options before adding any of them */
+	ret = 0;
+
+	for (pass = 0; pass < 2 && ret == 0; ++pass) {
+
+		cip_avl_iter_init(&iter,
+				  (struct cip_avl_node *)d_sect->options);
+
+		while ((node = cip_avl_iter_next(&iter)) != NULL) {
+
+			dep = (cip_opt_schema *)node;
+			if (dep == opt || dep->post_parse_fn == 0)
+				continue;
+
+			if (pass == 0)
+				ret = cip_post_check(ctx, file_schema, sect,
+						     opt, d_sect, dep);
+			else
+				ret = cip_post_add(ctx, file_schema, opt,
+						   d_sect, dep);
+			if (ret == -1)
+				break;
+		}
+	}
+
+	cip_post_rank_all(file_schema);
+
+	return ret;
+}
+
+static void cip_opt_schema_free(struct cip_avl_node *node)
+{
+	struct cip_post_dep *dep, *next;
+
+	for (dep = ((cip_opt_schema *)node)->deps; dep != NULL; dep = next) {
+		next = dep->next;
+		free(dep);
+	}
+}
+
 static void cip_sect_schema_free(struct cip_avl_node *node)
 {
 	cip_sect_schema *sect_schema;
 
 	sect_schema = (cip_sect_schema *)node;
 
-	if (sect_schema->options != NULL)
-		cip_avl_free((struct cip_avl_node *)sect_schema->options, 0);
+	if (sect_schema->options != NULL) {
+		cip_avl_free((struct cip_avl_node *)sect_schema->options,
+			     cip_opt_schema_free);
+	}
 }
 
 void cip_file_schema_free(cip_file_schema *file_schema)
@@ -210,5 +797,7 @@ void cip_file_schema_free(cip_file_schema *file_schema)
 			     cip_sect_schema_free);
 	}
 
+	cip_schema_order_fini(&file_schema->order);
+	free(file_schema->mph);
 	free(file_schema);
 }
@@ -0,0 +1,385 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Parses a directory of files with cip_parse_dir() and cip_parse_files() from
+ * several threads at once, all sharing one schema (and its post-parse
+ * callback), and checks every result against a single-threaded parse.  The
+ * rounds run once with an unfrozen schema and again after freezing it.  Build
+ * it with "make tsan" to have ThreadSanitizer check that parsing really never
+ * writes to the schema.
+ */
+
+#include "libcip.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define NUM_FILES	48
+#define NUM_CALLERS	4
+#define LINKED_FILE	(NUM_FILES - 1)	/* a symlink to "target.ini" */
+#define ROUNDS		8
+
+struct expected {
+	char *path;
+	char *text;		/* formatted file, or error message */
+	int failed;
+	int warnings;
+};
+
+static struct expected expected[NUM_FILES];
+static const char *paths[NUM_FILES];
+static char dir_name[] = "/tmp/cip_stress.XXXXXX";
+static const cip_file_schema *schema;
+static int failures;
+
+static __thread int warnings;
+
+static int count_warning(const char *warn_msg __attribute__((unused)))
+{
+	++warnings;
+	return 0;
+}
+
+static const int max_port = 60000;
+
+static int check_port(cip_err_ctx *ctx, const cip_ini_value *value,
+		      const cip_ini_sect *sect __attribute__((unused)),
+		      const cip_ini_file *file __attribute__((unused)),
+		      void *post_parse_data)
+{
+	const int *max = post_parse_data;
+
+	if (*(const int *)value->value > *max)
+		cip_err(ctx, "port above %d", *max);
+
+	return 0;
+}
+
+static const int default_weight = 1;
+
+static const cip_opt_info global_opts[] = {
+	{ .name = "name", .type = CIP_OPT_TYPE_STRING,
+	  .flags = CIP_OPT_REQUIRED },
+	{ .name = "ratio", .type = CIP_OPT_TYPE_DOUBLE },
+	{ .name = "levels", .type = CIP_OPT_TYPE_INT_LIST },
+	{ .name = NULL }
+};
+
+static const cip_opt_info server_opts[] = {
+	{ .name = "host", .type = CIP_OPT_TYPE_STRING,
+	  .flags = CIP_OPT_REQUIRED },
+	{ .name = "port", .type = CIP_OPT_TYPE_INT,
+	  .post_parse_fn = check_port,
+	  .post_parse_data = (void *)&max_port },
+	{ .name = "weight", .type = CIP_OPT_TYPE_INT,
+	  .flags = CIP_OPT_DEFAULT, .default_value = &default_weight },
+	{ .name = "tags", .type = CIP_OPT_TYPE_STR_LIST },
+	{ .name = "enabled", .type = CIP_OPT_TYPE_BOOL },
+	{ .name = NULL }
+};
+
+static const cip_sect_info sections[] = {
+	{ .name = "global", .options = global_opts,
+	  .flags = CIP_SECT_REQUIRED },
+	{ .name = "server", .options = server_opts,
+	  .flags = CIP_SECT_MULTIPLE },
+	{ .name = NULL }
+};
+
+static void fail(const char *format, const char *s1, const char *s2)
+{
+	fprintf(stderr, "batch_stress: ");
+	fprintf(stderr, format, s1, s2);
+	fputc('\n', stderr);
+	__atomic_store_n(&failures, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Every 7th file has an option that doesn't parse, every 5th has extra
+ * characters after a section header, and some ports are out of range; the
+ * last two are warnings.  LINKED_FILE is a symlink, which cip_parse_dir()
+ * must follow.
+ */
+static void write_file(unsigned i)
+{
+	char name[sizeof dir_name + 16];
+	FILE *f;
+	unsigned j;
+
+	sprintf(name, "%s/f%02u.conf", dir_name, i);
+	expected[i].path = strdup(name);
+	paths[i] = expected[i].path;
+
+	if (i == LINKED_FILE) {
+		if (symlink("target.ini", name) == -1) {
+			perror(name);
+			exit(1);
+		}
+		sprintf(name, "%s/target.ini", dir_name);
+	}
+
+	if ((f = fopen(name, "w")) == NULL) {
+		perror(name);
+		exit(1);
+	}
+
+	fprintf(f, "; file %u\n[global]%s\nname = file%u\n", i,
+		i % 5 == 1 ? " extra" : "", i);
+	fprintf(f, "ratio = %u.%u\nlevels = %u, %u, %u\n\n", i, i * 7,
+		i, i + 1, i * 3);
+
+	for (j = 0; j < 1 + i % 6; ++j) {
+		fprintf(f, "[server:s%u]\nhost = h%u.example\n", j, i * 10 + j);
+		if (i % 7 == 3 && j == i % 6)
+			fputs("port = eighty\n", f);
+		else
+			fprintf(f, "port = %u\n", 1000 + i * 2500 + j);
+		if (j % 2 == 0)
+			fprintf(f, "weight = %u\n", j + 2);
+		fprintf(f, "tags = a%u, \"b %u\", c\nenabled = %s\n\n",
+			j, i, j % 3 == 0 ? "yes" : "no");
+	}
+
+	fclose(f);
+}
+
+static void write_skipped(const char *base)
+{
+	char name[sizeof dir_name + 16];
+	FILE *f;
+
+	sprintf(name, "%s/%s", dir_name, base);
+	if ((f = fopen(name, "w")) == NULL) {
+		perror(name);
+		exit(1);
+	}
+	fputs("this isn't INI\n", f);
+	fclose(f);
+}
+
+/* A directory, and a symlink to it, whose names match the suffix */
+static void write_skipped_dirs(void)
+{
+	char name[sizeof dir_name + 16];
+
+	sprintf(name, "%s/sub.conf", dir_name);
+	if (mkdir(name, 0700) == -1) {
+		perror(name);
+		exit(1);
+	}
+	sprintf(name, "%s/link.conf", dir_name);
+	if (symlink("sub.conf", name) == -1) {
+		perror(name);
+		exit(1);
+	}
+}
+
+static char *describe(cip_err_ctx *err_ctx, const cip_ini_file *file,
+		      const char *err)
+{
+	char *text;
+	size_t len;
+
+	if (file == NULL)
+		return strdup(err != NULL ? err : "(no error message)");
+
+	if ((text = cip_ini_file_format(err_ctx, file, &len)) == NULL) {
+		fprintf(stderr, "batch_stress: %s\n", cip_last_err(err_ctx));
+		exit(1);
+	}
+
+	return text;
+}
+
+static void check_results(const char *caller, cip_parse_result *results,
+			  unsigned count)
+{
+	cip_err_ctx err_ctx;
+	unsigned i;
+	char *text;
+
+	if (count != NUM_FILES) {
+		fail("%s: wrong number of results%s", caller, "");
+		return;
+	}
+
+	cip_err_ctx_init(&err_ctx);
+
+	for (i = 0; i < count; ++i) {
+
+		if (strcmp(results[i].file_name, expected[i].path) != 0) {
+			fail("%s: unexpected file %s", caller,
+			     results[i].file_name);
+			continue;
+		}
+
+		text = describe(&err_ctx, results[i].file,
+				cip_last_err(&results[i].err));
+
+		if ((results[i].file == NULL) != expected[i].failed ||
+				strcmp(text, expected[i].text) != 0) {
+			fail("%s: %s differs from a serial parse", caller,
+			     expected[i].path);
+		}
+
+		free(text);
+	}
+
+	cip_err_ctx_fini(&err_ctx);
+}
+
+static void *caller_fn(void *arg)
+{
+	unsigned id = (unsigned)(uintptr_t)arg;
+	cip_parse_result *results;
+	cip_err_ctx err_ctx;
+	unsigned round, count;
+	int total;
+
+	cip_err_ctx_init(&err_ctx);
+
+	for (total = 0, round = 0; round < NUM_FILES; ++round)
+		total += expected[round].warnings;
+
+	for (round = 0; round < ROUNDS; ++round) {
+
+		warnings = 0;
+		results = cip_parse_dir(&err_ctx, dir_name, ".conf", &count,
+					schema, count_warning, 2 + id % 3);
+		if (results == NULL) {
+			fail("cip_parse_dir: %s%s", cip_last_err(&err_ctx), "");
+			break;
+		}
+		check_results("cip_parse_dir", results, count);
+		cip_parse_results_free(results, count);
+		if (warnings != total)
+			fail("cip_parse_dir: %s%s", "wrong warning count", "");
+
+		warnings = 0;
+		results = cip_parse_files(&err_ctx, paths, NUM_FILES, schema,
+					  count_warning, 1 + round % 4);
+		if (results == NULL) {
+			fail("cip_parse_files: %s%s", cip_last_err(&err_ctx),
+			     "");
+			break;
+		}
+		check_results("cip_parse_files", results, NUM_FILES);
+		cip_parse_results_free(results, NUM_FILES);
+		if (warnings != total)
+			fail("cip_parse_files: %s%s", "wrong warning count",
+			     "");
+	}
+
+	cip_err_ctx_fini(&err_ctx);
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t callers[NUM_CALLERS];
+	cip_file_schema *file_schema;
+	cip_err_ctx err_ctx;
+	cip_ini_file *file;
+	char skipped[sizeof dir_name + 16];
+	unsigned i, pass;
+
+	cip_err_ctx_init(&err_ctx);
+
+	file_schema = cip_file_schema_new2(&err_ctx, sections);
+	if (file_schema == NULL) {
+		fprintf(stderr, "batch_stress: %s\n", cip_last_err(&err_ctx));
+		return 1;
+	}
+	schema = file_schema;
+
+	if (mkdtemp(dir_name) == NULL) {
+		perror(dir_name);
+		return 1;
+	}
+
+	for (i = 0; i < NUM_FILES; ++i)
+		write_file(i);
+	write_skipped("README");
+	write_skipped(".hidden.conf");
+	write_skipped_dirs();
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		warnings = 0;
+		file = cip_parse_file(&err_ctx, paths[i], schema,
+				      count_warning);
+		expected[i].failed = (file == NULL);
+		expected[i].warnings = warnings;
+		expected[i].text = describe(&err_ctx, file,
+					    cip_last_err(&err_ctx));
+		if (file != NULL)
+			cip_ini_file_free(file);
+	}
+
+	for (pass = 0; pass < 2; ++pass) {
+
+		/* Second pass: same expectations, frozen schema */
+		if (pass == 1 && cip_file_schema_freeze(&err_ctx,
+							file_schema) == -1) {
+			fprintf(stderr, "batch_stress: %s\n",
+				cip_last_err(&err_ctx));
+			return 1;
+		}
+
+		for (i = 0; i < NUM_CALLERS; ++i) {
+			if (pthread_create(&callers[i], NULL, caller_fn,
+					   (void *)(uintptr_t)i) != 0) {
+				fprintf(stderr,
+					"batch_stress: pthread_create\n");
+				return 1;
+			}
+		}
+
+		for (i = 0; i < NUM_CALLERS; ++i)
+			pthread_join(callers[i], NULL);
+	}
+
+	for (i = 0; i < NUM_FILES; ++i) {
+		unlink(expected[i].path);
+		free(expected[i].path);
+		free(expected[i].text);
+	}
+	sprintf(skipped, "%s/README", dir_name);
+	unlink(skipped);
+	sprintf(skipped, "%s/.hidden.conf", dir_name);
+	unlink(skipped);
+	sprintf(skipped, "%s/target.ini", dir_name);
+	unlink(skipped);
+	sprintf(skipped, "%s/link.conf", dir_name);
+	unlink(skipped);
+	sprintf(skipped, "%s/sub.conf", dir_name);
+	rmdir(skipped);
+	rmdir(dir_name);
+
+	cip_file_schema_free(file_schema);
+	cip_err_ctx_fini(&err_ctx);
+
+	if (failures == 0)
+		printf("batch_stress: %d callers x %d rounds x 2 schemas, "
+		       "no differences\n", NUM_CALLERS, ROUNDS);
+
+	return failures != 0;
+}
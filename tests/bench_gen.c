@@ -0,0 +1,56 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Writes the lookup (and parse_fn) for bench_sections to stdout.  Any other
+ * schema table can be built into a generator the same way; see the Makefile.
+ */
+
+#include "libcip.h"
+
+#include <stdio.h>
+
+extern const cip_sect_info bench_sections[];
+
+int main(int argc, char *argv[])
+{
+	cip_file_schema *schema;
+	cip_err_ctx ctx;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s PREFIX\n", argv[0]);
+		return 1;
+	}
+
+	cip_err_ctx_init(&ctx);
+
+	schema = cip_file_schema_new2(&ctx, bench_sections);
+	if (schema == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[0], cip_last_err(&ctx));
+		return 1;
+	}
+
+	if (cip_file_schema_gen(&ctx, schema, stdout, argv[1]) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], cip_last_err(&ctx));
+		cip_file_schema_free(schema);
+		return 1;
+	}
+
+	cip_file_schema_free(schema);
+	cip_err_ctx_fini(&ctx);
+
+	return 0;
+}
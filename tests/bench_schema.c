@@ -0,0 +1,50 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/* The schema of gen_bench, from which bench_lookup.c is generated */
+
+#include "libcip.h"
+
+static const cip_opt_info global_opts[] = {
+	{ .name = "name", .type = CIP_OPT_TYPE_STRING },
+	{ .name = "threads", .type = CIP_OPT_TYPE_INT },
+	{ .name = "timeout", .type = CIP_OPT_TYPE_DOUBLE },
+	{ .name = "verbose", .type = CIP_OPT_TYPE_BOOL },
+	{ .name = "max_size", .type = CIP_OPT_TYPE_SIZE },
+	{ .name = NULL }
+};
+
+static const cip_opt_info server_opts[] = {
+	{ .name = "host", .type = CIP_OPT_TYPE_STRING },
+	{ .name = "port", .type = CIP_OPT_TYPE_INT },
+	{ .name = "weight", .type = CIP_OPT_TYPE_SHORT },
+	{ .name = "limit", .type = CIP_OPT_TYPE_INT64 },
+	{ .name = "bytes", .type = CIP_OPT_TYPE_UINT64 },
+	{ .name = "ratio", .type = CIP_OPT_TYPE_DOUBLE },
+	{ .name = "scale", .type = CIP_OPT_TYPE_FLOAT },
+	{ .name = "retries", .type = CIP_OPT_TYPE_INT },
+	{ .name = "backlog", .type = CIP_OPT_TYPE_INT },
+	{ .name = "enabled", .type = CIP_OPT_TYPE_BOOL },
+	{ .name = "tags", .type = CIP_OPT_TYPE_STR_LIST },
+	{ .name = NULL }
+};
+
+const cip_sect_info bench_sections[] = {
+	{ .name = "global", .options = global_opts },
+	{ .name = "server", .options = server_opts,
+	  .flags = CIP_SECT_MULTIPLE },
+	{ .name = NULL }
+};
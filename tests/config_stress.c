@@ -0,0 +1,203 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+
+/*
+ * Publishes a stream of files through a cip_config while several threads read
+ * it, and checks that every reader only ever sees whole, current-or-newer
+ * files.  The rounds run once with the kernel's membarrier() (if it has one)
+ * and again with the readers' own fences.  Build it with "make tsan" to have
+ * ThreadSanitizer check that no file is freed while a reader still uses it.
+ *
+ * config.c is included, rather than linked, so the test can force the fence.
+ */
+
+#include "../config.c"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define NUM_READERS	4
+#define GENERATIONS	2000
+
+static const cip_opt_info global_opts[] = {
+	{ .name = "generation", .type = CIP_OPT_TYPE_INT,
+	  .flags = CIP_OPT_REQUIRED },
+	{ .name = "check", .type = CIP_OPT_TYPE_INT,
+	  .flags = CIP_OPT_REQUIRED },
+	{ .name = NULL }
+};
+
+static const cip_sect_info sections[] = {
+	{ .name = "global", .options = global_opts,
+	  .flags = CIP_SECT_REQUIRED },
+	{ .name = NULL }
+};
+
+/* Buffers must outlive their files, so all of them live until the end */
+static char bufs[GENERATIONS][64];
+static cip_file_schema *schema;
+static cip_config *config;
+static int done;
+static int failures;
+
+static void fail(const char *format, int i1, int i2)
+{
+	fprintf(stderr, "config_stress: ");
+	fprintf(stderr, format, i1, i2);
+	fputc('\n', stderr);
+	__atomic_store_n(&failures, 1, __ATOMIC_RELAXED);
+}
+
+static cip_ini_file *make_file(int generation)
+{
+	cip_err_ctx err_ctx;
+	cip_ini_file *file;
+	int len;
+
+	len = sprintf(bufs[generation], "[global]\ngeneration = %d\n"
+		      "check = %d\n", generation, generation * 3);
+
+	cip_err_ctx_init(&err_ctx);
+	file = cip_parse_buffer(&err_ctx, bufs[generation], len, "config",
+				schema, NULL);
+	if (file == NULL) {
+		fprintf(stderr, "config_stress: %s\n", cip_last_err(&err_ctx));
+		exit(1);
+	}
+	cip_err_ctx_fini(&err_ctx);
+
+	return file;
+}
+
+/* Returns the file's generation, after checking that it is intact */
+static int read_generation(const cip_ini_file *file)
+{
+	const cip_ini_sect *sect;
+	const cip_ini_value *gen, *check;
+	int g;
+
+	sect = cip_ini_sect_get(file, "global");
+	gen = cip_ini_value_get(sect, "generation");
+	check = cip_ini_value_get(sect, "check");
+
+	g = *(const int *)gen->value;
+	if (*(const int *)check->value != g * 3)
+		fail("generation %d has check %d", g,
+		     *(const int *)check->value);
+
+	return g;
+}
+
+static void *reader_fn(void *arg __attribute__((unused)))
+{
+	cip_config_reader *reader;
+	cip_err_ctx err_ctx;
+	unsigned long reads;
+	int last, g;
+
+	cip_err_ctx_init(&err_ctx);
+
+	reader = cip_config_reader_new(&err_ctx, config);
+	if (reader == NULL) {
+		fprintf(stderr, "config_stress: %s\n", cip_last_err(&err_ctx));
+		exit(1);
+	}
+
+	last = 0;
+
+	for (reads = 0; !__atomic_load_n(&done, __ATOMIC_RELAXED); ++reads) {
+
+		g = read_generation(cip_config_read(reader));
+		if (g < last)
+			fail("generation %d after %d", g, last);
+		last = g;
+
+		/* Half the time, let the next read drop the file */
+		if (reads % 2 == 0)
+			cip_config_done(reader);
+	}
+
+	cip_config_done(reader);
+	cip_config_reader_free(reader);
+	cip_err_ctx_fini(&err_ctx);
+
+	return NULL;
+}
+
+static void run(int fence)
+{
+	pthread_t readers[NUM_READERS];
+	cip_err_ctx err_ctx;
+	int i;
+
+	cip_err_ctx_init(&err_ctx);
+
+	config = cip_config_new(&err_ctx, make_file(0));
+	if (config == NULL) {
+		fprintf(stderr, "config_stress: %s\n", cip_last_err(&err_ctx));
+		exit(1);
+	}
+	if (fence)
+		config->fence = 1;
+
+	__atomic_store_n(&done, 0, __ATOMIC_RELAXED);
+
+	for (i = 0; i < NUM_READERS; ++i) {
+		if (pthread_create(&readers[i], NULL, reader_fn, NULL) != 0) {
+			fprintf(stderr, "config_stress: pthread_create\n");
+			exit(1);
+		}
+	}
+
+	for (i = 1; i < GENERATIONS; ++i)
+		cip_config_publish(config, make_file(i));
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELAXED);
+
+	for (i = 0; i < NUM_READERS; ++i)
+		pthread_join(readers[i], NULL);
+
+	cip_config_free(config);
+	cip_err_ctx_fini(&err_ctx);
+}
+
+int main(void)
+{
+	cip_err_ctx err_ctx;
+
+	cip_err_ctx_init(&err_ctx);
+
+	schema = cip_file_schema_new2(&err_ctx, sections);
+	if (schema == NULL) {
+		fprintf(stderr, "config_stress: %s\n", cip_last_err(&err_ctx));
+		return 1;
+	}
+
+	run(0);
+	run(1);
+
+	cip_file_schema_free(schema);
+	cip_err_ctx_fini(&err_ctx);
+
+	if (failures == 0)
+		printf("config_stress: %d readers x %d generations x 2 "
+		       "barriers, no torn or stale files\n", NUM_READERS,
+		       GENERATIONS);
+
+	return failures != 0;
+}
@@ -0,0 +1,300 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Times cip_parse_stream() and cip_parse_buffer() on the same text with the
+ * generic schema, a frozen one, and one with the generated lookup
+ * (bench_lookup.c), and checks that all of them parse it (and some bad
+ * values) identically.
+ */
+
+#include "libcip.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_SERVERS	5000
+#define ROUNDS		30
+
+extern const cip_sect_info bench_sections[];
+extern const cip_schema_lookup bench_lookup;
+
+enum bench_kind { GENERIC, FROZEN, LOOKUP, NUM_KINDS };
+
+static const char *const bench_names[] = {
+	[GENERIC]	= "generic",
+	[FROZEN]	= "frozen",
+	[LOOKUP]	= "generated",
+};
+
+static char *text;
+static size_t text_len;
+static int num_lines;
+
+static void die(const char *what, const cip_err_ctx *ctx)
+{
+	fprintf(stderr, "gen_bench: %s: %s\n", what, cip_last_err(ctx));
+	exit(1);
+}
+
+static void make_text(void)
+{
+	FILE *f;
+	int i;
+
+	if ((f = open_memstream(&text, &text_len)) == NULL) {
+		perror("open_memstream");
+		exit(1);
+	}
+
+	fprintf(f, "[global]\nname = bench\nthreads = 8\ntimeout = 2.5\n"
+		"verbose = yes\nmax_size = 1048576\n");
+	num_lines = 6;
+
+	for (i = 0; i < NUM_SERVERS; ++i) {
+		fprintf(f, "\n[server:srv%d]\nhost = host%d.example.com\n"
+			"port = %d\nweight = %d\nlimit = %lld\n"
+			"bytes = %llu\nratio = %d.%03d\nscale = %de-3\n"
+			"retries = %d\nbacklog = %d\nenabled = %s\n"
+			"tags = web, \"zone %d\", primary\n", i, i,
+			1024 + i, i % 100, -1000000LL * i,
+			(unsigned long long)i * 4096, i % 7, i % 1000,
+			i % 5000, i % 10, 128 + i % 64,
+			i % 2 ? "true" : "off", i % 16);
+		num_lines += 13;
+	}
+
+	fclose(f);
+}
+
+static cip_file_schema *schema_new(enum bench_kind kind)
+{
+	cip_file_schema *schema;
+	cip_err_ctx ctx;
+	int ret;
+
+	cip_err_ctx_init(&ctx);
+
+	schema = cip_file_schema_new2(&ctx, bench_sections);
+	if (schema == NULL)
+		die("cip_file_schema_new2", &ctx);
+
+	switch (kind) {
+	case FROZEN:
+		ret = cip_file_schema_freeze(&ctx, schema);
+		break;
+	case LOOKUP:
+		ret = cip_file_schema_set_lookup(&ctx, schema, &bench_lookup);
+		break;
+	default:
+		ret = 0;
+	}
+
+	if (ret == -1)
+		die(bench_names[kind], &ctx);
+
+	cip_err_ctx_fini(&ctx);
+	return schema;
+}
+
+static cip_ini_file *parse_stream(const cip_file_schema *schema)
+{
+	cip_ini_file *file;
+	cip_err_ctx ctx;
+	FILE *stream;
+
+	cip_err_ctx_init(&ctx);
+
+	if ((stream = fmemopen(text, text_len, "r")) == NULL) {
+		perror("fmemopen");
+		exit(1);
+	}
+
+	file = cip_parse_stream(&ctx, stream, "bench.ini", schema, NULL);
+	if (file == NULL)
+		die("cip_parse_stream", &ctx);
+
+	fclose(stream);
+	cip_err_ctx_fini(&ctx);
+	return file;
+}
+
+static cip_ini_file *parse_buffer(const cip_file_schema *schema)
+{
+	cip_ini_file *file;
+	cip_err_ctx ctx;
+
+	cip_err_ctx_init(&ctx);
+
+	file = cip_parse_buffer(&ctx, text, text_len, "bench.ini", schema,
+				NULL);
+	if (file == NULL)
+		die("cip_parse_buffer", &ctx);
+
+	cip_err_ctx_fini(&ctx);
+	return file;
+}
+
+static const struct bench_parser {
+	const char *name;
+	cip_ini_file *(*fn)(const cip_file_schema *schema);
+} parsers[] = {
+	{ "cip_parse_stream()", parse_stream },
+	{ "cip_parse_buffer()", parse_buffer },
+};
+
+/* Values that the types' parse_fns reject */
+static const char *const bad_values[] = {
+	"port = 2147483648", "port = -2147483649", "port = 0x",
+	"weight = 32768", "weight = -32769", "weight = many",
+	"limit = 9223372036854775808", "limit = -",
+	"bytes = -1", "bytes = 18446744073709551616",
+	"ratio = 1e999", "ratio = .", "scale = 1e39", "scale = e5",
+	"retries = 12abc", "backlog = 0777", "backlog = 0x1F",
+	"ratio = 0x1p3", "scale = -0", "bytes = 0xFFFFFFFFFFFFFFFF",
+	NULL
+};
+
+static void check_errors(cip_file_schema *const *schemas)
+{
+	const char *const *bad;
+	char buf[100], *results[NUM_KINDS];
+	cip_ini_file *file;
+	size_t len, out_len;
+	cip_err_ctx ctx;
+	int k;
+
+	for (bad = bad_values; *bad != NULL; ++bad) {
+
+		len = snprintf(buf, sizeof buf, "[server:x]\n%s\n", *bad);
+
+		for (k = 0; k < NUM_KINDS; ++k) {
+			cip_err_ctx_init(&ctx);
+			file = cip_parse_buffer(&ctx, buf, len, "bad.ini",
+						schemas[k], NULL);
+			if (file != NULL) {
+				results[k] = cip_ini_file_format(&ctx, file,
+								 &out_len);
+				cip_ini_file_free(file);
+			}
+			else {
+				results[k] = strdup(cip_last_err(&ctx));
+			}
+			cip_err_ctx_fini(&ctx);
+		}
+
+		for (k = 1; k < NUM_KINDS; ++k) {
+			if (strcmp(results[k], results[0]) != 0) {
+				fprintf(stderr, "gen_bench: %s: %s parse "
+					"differs from generic parse:\n%s\n%s\n",
+					*bad, bench_names[k], results[k],
+					results[0]);
+				exit(1);
+			}
+		}
+
+		for (k = 0; k < NUM_KINDS; ++k)
+			free(results[k]);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Interleaved, so that each schema sees the same conditions */
+static void time_parser(const struct bench_parser *parser,
+			cip_file_schema *const *schemas)
+{
+	double best[NUM_KINDS], start, t;
+	cip_ini_file *file;
+	int round, k;
+
+	for (k = 0; k < NUM_KINDS; ++k)
+		best[k] = 1e9;
+
+	for (round = 0; round < ROUNDS; ++round) {
+		for (k = 0; k < NUM_KINDS; ++k) {
+			start = now();
+			file = parser->fn(schemas[k]);
+			t = now() - start;
+			cip_ini_file_free(file);
+			if (t < best[k])
+				best[k] = t;
+		}
+	}
+
+	printf("%s, %d lines (%zu bytes), best of %d:\n", parser->name,
+	       num_lines, text_len, ROUNDS);
+
+	for (k = 0; k < NUM_KINDS; ++k) {
+		printf("  %-10s %8.2f ms %7.1f ns/line %6.2fx\n",
+		       bench_names[k], best[k] * 1e3, best[k] * 1e9 / num_lines,
+		       best[GENERIC] / best[k]);
+	}
+}
+
+int main(void)
+{
+	cip_file_schema *schemas[NUM_KINDS];
+	char *formatted[NUM_KINDS];
+	cip_ini_file *file;
+	cip_err_ctx ctx;
+	unsigned p;
+	size_t len;
+	int k;
+
+	make_text();
+	cip_err_ctx_init(&ctx);
+
+	for (k = 0; k < NUM_KINDS; ++k) {
+
+		schemas[k] = schema_new(k);
+
+		file = parse_buffer(schemas[k]);
+		formatted[k] = cip_ini_file_format(&ctx, file, &len);
+		if (formatted[k] == NULL)
+			die("cip_ini_file_format", &ctx);
+		cip_ini_file_free(file);
+
+		if (strcmp(formatted[k], formatted[0]) != 0) {
+			fprintf(stderr, "gen_bench: %s parse differs from "
+				"generic parse\n", bench_names[k]);
+			return 1;
+		}
+	}
+
+	check_errors(schemas);
+
+	for (p = 0; p < sizeof parsers / sizeof parsers[0]; ++p)
+		time_parser(&parsers[p], schemas);
+
+	for (k = 0; k < NUM_KINDS; ++k) {
+		free(formatted[k]);
+		cip_file_schema_free(schemas[k]);
+	}
+
+	free(text);
+	cip_err_ctx_fini(&ctx);
+
+	return 0;
+}
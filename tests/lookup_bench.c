@@ -0,0 +1,154 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Times option name lookups (cip_opt_schema_get_n(), as the parser does them)
+ * in a section of a generic and of a frozen schema, for a few section sizes.
+ * This is only the lookup; see gen_bench for whole parses.
+ */
+
+#define _GNU_SOURCE	/* for asprintf */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOKUPS		2000000
+
+static const unsigned sizes[] = { 5, 50, 500 };
+
+static void die(const char *what, const cip_err_ctx *ctx)
+{
+	fprintf(stderr, "lookup_bench: %s: %s\n", what, cip_last_err(ctx));
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static cip_file_schema *schema_new(char **names, unsigned count, int frozen)
+{
+	cip_file_schema *schema;
+	cip_sect_schema *sect;
+	cip_err_ctx ctx;
+	unsigned i;
+
+	cip_err_ctx_init(&ctx);
+
+	if ((schema = cip_file_schema_new1(&ctx)) == NULL)
+		die("cip_file_schema_new1", &ctx);
+
+	sect = cip_sect_schema_new1(&ctx, schema, "section", 0);
+	if (sect == NULL)
+		die("cip_sect_schema_new1", &ctx);
+
+	for (i = 0; i < count; ++i) {
+		if (cip_opt_schema_new1(&ctx, sect, names[i],
+					CIP_OPT_TYPE_INT, 0, NULL, 0,
+					NULL) == -1) {
+			die("cip_opt_schema_new1", &ctx);
+		}
+	}
+
+	if (frozen && cip_file_schema_freeze(&ctx, schema) == -1)
+		die("cip_file_schema_freeze", &ctx);
+
+	cip_err_ctx_fini(&ctx);
+	return schema;
+}
+
+/* Looks up the names in a scrambled order, so no branch pattern repeats */
+static double time_lookups(const cip_file_schema *schema, char **names,
+			   const size_t *lens, unsigned count)
+{
+	const cip_sect_schema *sect;
+	const cip_opt_schema *opt;
+	double start;
+	unsigned i, j;
+
+	sect = cip_sect_schema_get_n(schema, "section", 7);
+
+	start = now();
+
+	for (i = 0, j = 0; i < LOOKUPS; ++i) {
+		opt = cip_opt_schema_get_n(sect, names[j], lens[j]);
+		if (opt == NULL) {
+			fprintf(stderr, "lookup_bench: %s not found\n",
+				names[j]);
+			exit(1);
+		}
+		j = (j + 7919) % count;
+	}
+
+	return (now() - start) * 1e9 / LOOKUPS;
+}
+
+int main(void)
+{
+	cip_file_schema *generic, *frozen;
+	unsigned s, i, count;
+	double t_generic, t_frozen;
+	char **names;
+	size_t *lens;
+
+	printf("Option name lookups, ns each:\n"
+	       "  %8s %10s %10s\n", "options", "generic", "frozen");
+
+	for (s = 0; s < sizeof sizes / sizeof sizes[0]; ++s) {
+
+		count = sizes[s];
+		names = malloc(count * sizeof *names);
+		lens = malloc(count * sizeof *lens);
+		if (names == NULL || lens == NULL) {
+			perror("malloc");
+			return 1;
+		}
+
+		for (i = 0; i < count; ++i) {
+			if (asprintf(&names[i], "option_name_%u", i) == -1) {
+				perror("asprintf");
+				return 1;
+			}
+			lens[i] = strlen(names[i]);
+		}
+
+		generic = schema_new(names, count, 0);
+		frozen = schema_new(names, count, 1);
+
+		t_generic = time_lookups(generic, names, lens, count);
+		t_frozen = time_lookups(frozen, names, lens, count);
+
+		printf("  %8u %10.1f %10.1f\n", count, t_generic, t_frozen);
+
+		cip_file_schema_free(generic);
+		cip_file_schema_free(frozen);
+		for (i = 0; i < count; ++i)
+			free(names[i]);
+		free(names);
+		free(lens);
+	}
+
+	return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+/*
+ * Checks that the SSE2 and AVX2 line scanners agree with the scalar one.  The
+ * scanners are static, so scan.c is included directly.  Every buffer is placed
+ * so that it ends at a page that can't be read, so any read past the end of
+ * the buffer faults.
+ */
+
+#include "../scan.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define MAX_SIZE	256
+
+typedef void (*scan_fn)(struct cip_line_scan *scan, const char *s,
+			size_t size);
+
+static const char alphabet[] = {
+	'\n', '\0', ' ', '\t', '\v', '\f', '\r', '=', '[', ']', ':', ';', '#',
+	'a', 'z', '\x08', '\x0e', '\x1f', '\x7f', '\x80', '\x8a', '\xff',
+};
+
+static scan_fn simd_fns[2];
+static const char *simd_names[2];
+static int simd_count;
+
+static char *guard;		/* start of the unreadable page */
+static unsigned long checks, failures;
+
+static void dump(const char *name, const struct cip_line_scan *scan)
+{
+	fprintf(stderr, "  %-6s eol=%zu len=%zu first=%zu last=%zu "
+		"equals=%zu rbracket=%zu colon=%zu key_end=%zu "
+		"value_start=%zu\n", name, scan->eol, scan->len, scan->first,
+		scan->last, scan->equals, scan->rbracket, scan->colon,
+		scan->key_end, scan->value_start);
+}
+
+/* The scan's trimmed option name and value must match cip_slice_trim()'s */
+static int check_trim(const struct cip_line_scan *scan, const char *buf)
+{
+	struct cip_slice key, value;
+
+	if (scan->equals == scan->len)
+		return 1;
+
+	cip_slice_trim(&key, buf + scan->first, scan->equals - scan->first);
+	cip_slice_trim(&value, buf + scan->equals + 1,
+		       scan->last - scan->equals - 1);
+
+	return key.start + key.len == buf + scan->key_end &&
+		(value.len == 0 || value.start == buf + scan->value_start) &&
+		value.start + value.len == buf + scan->last;
+}
+
+/* Scans the size bytes at buf (which must end at guard) with each scanner */
+static void check(const char *buf, size_t size)
+{
+	struct cip_line_scan expected, actual;
+	size_t i;
+	int j;
+
+	cip_scan_line_scalar(&expected, buf, size);
+
+	++checks;
+	if (!check_trim(&expected, buf) && ++failures <= 10) {
+		fprintf(stderr, "scalar trim mismatch, size %zu\n", size);
+		dump("scalar", &expected);
+	}
+
+	for (j = 0; j < simd_count; ++j) {
+
+		memset(&actual, 0xa5, sizeof actual);
+		simd_fns[j](&actual, buf, size);
+		++checks;
+
+		if (memcmp(&expected, &actual, sizeof actual) == 0)
+			continue;
+
+		if (++failures > 10)
+			continue;
+
+		fprintf(stderr, "%s mismatch, size %zu:", simd_names[j], size);
+		for (i = 0; i < size; ++i)
+			fprintf(stderr, " %02x", (unsigned char)buf[i]);
+		fputc('\n', stderr);
+		dump("scalar", &expected);
+		dump(simd_names[j], &actual);
+	}
+}
+
+/* Copies size bytes to the end of the readable page and checks them */
+static void check_at_end(const char *src, size_t size)
+{
+	char *buf = guard - size;
+
+	memcpy(buf, src, size);
+	check(buf, size);
+}
+
+/* Fills buf with random characters, skewed towards the interesting ones */
+static void fill(char *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		if (rand() % 4 == 0)
+			buf[i] = (char)rand();
+		else
+			buf[i] = alphabet[rand() % sizeof alphabet];
+	}
+}
+
+static void check_random(void)
+{
+	char buf[MAX_SIZE];
+	size_t size;
+	int i;
+
+	for (i = 0; i < 200000; ++i) {
+		size = rand() % (i % 8 == 0 ? MAX_SIZE : 40);
+		fill(buf, size);
+		check_at_end(buf, size);
+	}
+}
+
+/*
+ * Puts a newline (or a NUL followed by a later newline) at every offset in
+ * lines of every length up to MAX_SIZE, made of a mix of whitespace and other
+ * characters so that first and last are exercised too.
+ */
+static void check_offsets(void)
+{
+	static const char body[] = " \tkey = [va]l:ue\r";
+	char buf[MAX_SIZE];
+	size_t size, pos, i;
+
+	for (size = 0; size <= MAX_SIZE; ++size) {
+
+		for (i = 0; i < size; ++i)
+			buf[i] = body[i % (sizeof body - 1)];
+
+		check_at_end(buf, size);
+
+		for (pos = 0; pos < size; ++pos) {
+
+			buf[pos] = '\n';
+			check_at_end(buf, size);
+
+			buf[pos] = '\0';
+			check_at_end(buf, size);
+
+			if (pos + 1 < size) {
+				buf[size - 1] = '\n';
+				check_at_end(buf, size);
+				buf[size - 1] = body[(size - 1) %
+							(sizeof body - 1)];
+			}
+
+			buf[pos] = body[pos % (sizeof body - 1)];
+		}
+	}
+}
+
+/* Lines made entirely of whitespace or entirely of one special character */
+static void check_runs(void)
+{
+	static const char fills[] = { ' ', '\t', '\r', '=', ']', ':', 'x' };
+	char buf[MAX_SIZE];
+	size_t size, i;
+
+	for (i = 0; i < sizeof fills; ++i) {
+		memset(buf, fills[i], sizeof buf);
+		for (size = 0; size <= MAX_SIZE; ++size)
+			check_at_end(buf, size);
+	}
+}
+
+int main(void)
+{
+	long page_size;
+	char *pages;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	pages = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	guard = pages + page_size;
+	if (mprotect(guard, page_size, PROT_NONE) != 0) {
+		perror("mprotect");
+		return 1;
+	}
+
+#ifdef CIP_SCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		simd_fns[simd_count] = cip_scan_line_sse2;
+		simd_names[simd_count++] = "sse2";
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		simd_fns[simd_count] = cip_scan_line_avx2;
+		simd_names[simd_count++] = "avx2";
+	}
+	else {
+		puts("scan_test: CPU does not support AVX2; skipping it");
+	}
+#endif
+
+	if (simd_count == 0) {
+		puts("scan_test: no SIMD scanners to check");
+		return 0;
+	}
+
+	srand(1);
+	check_offsets();
+	check_runs();
+	check_random();
+
+	printf("scan_test: %lu checks, %lu failures\n", checks, failures);
+
+	return failures != 0;
+}
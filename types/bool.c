@@ -60,18 +60,13 @@ static char *cip_bool_parse(cip_err_ctx *ctx, void *value, char *s)
 	return NULL;
 }
 
-static int cip_bool_format(cip_err_ctx *ctx, char *buf, size_t size,
-			   const void *value)
+static int cip_bool_format(cip_err_ctx *ctx __attribute__((unused)),
+			   char *buf, size_t size, const void *value)
 {
-	int ret;
+	const char *s;
 
-	ret = snprintf(buf, size, "%s", *(bool *)value ? "true" : "false");
-	if (ret < 0) {
-		cip_err(ctx, "%m");
-		return -1;
-	}
-
-	return ret;
+	s = *(const bool *)value ? "true" : "false";
+	return cip_format_str(buf, size, s, strlen(s));
 }
 
 const cip_opt_type cip_opt_type_bool = {
@@ -112,7 +107,26 @@ static void cip_bool_list_free(void *value)
 	cip_bool_list *list;
 
 	list = value;
-	free(list->values);
+	cip_free(list->values);
+}
+
+static int cip_bool_list_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+			      void *image, const void *value)
+{
+	const cip_bool_list *list;
+
+	list = value;
+	return cip_list_save(ctx, writer, &((cip_bool_list *)image)->values,
+			     &list->values, list->count, &cip_opt_type_bool);
+}
+
+static int cip_bool_list_load(const cip_cache_loader *loader, void *value)
+{
+	cip_bool_list *list;
+
+	list = value;
+	return cip_list_load(loader, &list->values, list->count,
+			     &cip_opt_type_bool);
 }
 
 const cip_opt_type cip_opt_type_bool_list = {
@@ -121,4 +135,6 @@ const cip_opt_type cip_opt_type_bool_list = {
 	.format_fn	= cip_bool_list_format,
 	.free_fn	= cip_bool_list_free,
 	.size		= sizeof(cip_bool_list),
+	.save_fn	= cip_bool_list_save,
+	.load_fn	= cip_bool_list_load,
 };
@@ -25,7 +25,7 @@ static char *cip_float_parse(cip_err_ctx *ctx, void *value, char *s)
 	char *endptr;
 
 	errno = 0;
-	*(float *)value = strtof(s, &endptr);
+	*(float *)value = cip_strtof(s, &endptr);
 
 	if (errno != 0) {
 		cip_err(ctx, "Failed to parse '%.10s' as a "
@@ -43,18 +43,10 @@ static char *cip_float_parse(cip_err_ctx *ctx, void *value, char *s)
 	return endptr;
 }
 
-static int cip_float_format(cip_err_ctx *ctx, char *buf, size_t size,
-			    const void *value)
+static int cip_float_format(cip_err_ctx *ctx __attribute__((unused)),
+			    char *buf, size_t size, const void *value)
 {
-	int ret;
-
-	ret = snprintf(buf, size, "%f", (double)*(float *)value);
-	if (ret < 0) {
-		cip_err(ctx, "%m");
-		return -1;
-	}
-
-	return ret;
+	return cip_format_float(buf, size, *(const float *)value);
 }
 
 const cip_opt_type cip_opt_type_float = {
@@ -95,7 +87,26 @@ static void cip_float_list_free(void *value)
 	cip_float_list *list;
 
 	list = value;
-	free(list->values);
+	cip_free(list->values);
+}
+
+static int cip_float_list_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+			       void *image, const void *value)
+{
+	const cip_float_list *list;
+
+	list = value;
+	return cip_list_save(ctx, writer, &((cip_float_list *)image)->values,
+			     &list->values, list->count, &cip_opt_type_float);
+}
+
+static int cip_float_list_load(const cip_cache_loader *loader, void *value)
+{
+	cip_float_list *list;
+
+	list = value;
+	return cip_list_load(loader, &list->values, list->count,
+			     &cip_opt_type_float);
 }
 
 const cip_opt_type cip_opt_type_float_list = {
@@ -104,4 +115,6 @@ const cip_opt_type cip_opt_type_float_list = {
 	.format_fn	= cip_float_list_format,
 	.free_fn	= cip_float_list_free,
 	.size		= sizeof(cip_float_list),
+	.save_fn	= cip_float_list_save,
+	.load_fn	= cip_float_list_load,
 };
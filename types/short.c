@@ -21,29 +21,28 @@
 #include <errno.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <inttypes.h>
 
 static char *cip_short_parse(cip_err_ctx *ctx, void *value, char *s)
 {
 	char *endptr;
-	long val;
+	int64_t val;
 
-	errno = 0;
-	val = strtol(s, &endptr, 0);
-
-	if (errno != 0) {
+	endptr = cip_parse_i64(s, &val);
+	if (endptr == NULL && errno == ERANGE) {
 		cip_err(ctx, "Failed to parse '%.10s' as a short integer: %m",
 			s);
 		return NULL;
 	}
 
-	if (endptr == s) {
+	if (endptr == NULL) {
 		cip_err(ctx, "Failed to parse '%.10s' as a short integer", s);
 		return NULL;
 	}
 
 	if (val < SHRT_MIN || val > SHRT_MAX) {
-		cip_err(ctx, "Value (%ld) outside short integer range (%d-%d)",
-			val, SHRT_MIN, SHRT_MAX);
+		cip_err(ctx, "Value (%" PRId64 ") outside short integer range "
+			"(%d-%d)", val, SHRT_MIN, SHRT_MAX);
 		return NULL;
 	}
 
@@ -51,18 +50,10 @@ static char *cip_short_parse(cip_err_ctx *ctx, void *value, char *s)
 	return endptr;
 }
 
-static int cip_short_format(cip_err_ctx *ctx, char *buf, size_t size,
-			    const void *value)
+static int cip_short_format(cip_err_ctx *ctx __attribute__((unused)),
+			    char *buf, size_t size, const void *value)
 {
-	int ret;
-
-	ret = snprintf(buf, size, "%hd", *(short *)value);
-	if (ret < 0) {
-		cip_err(ctx, "%m");
-		return -1;
-	}
-
-	return ret;
+	return cip_format_i64(buf, size, *(const short *)value);
 }
 
 const cip_opt_type cip_opt_type_short = {
@@ -103,7 +94,26 @@ static void cip_short_list_free(void *value)
 	cip_short_list *list;
 
 	list = value;
-	free(list->values);
+	cip_free(list->values);
+}
+
+static int cip_short_list_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+			       void *image, const void *value)
+{
+	const cip_short_list *list;
+
+	list = value;
+	return cip_list_save(ctx, writer, &((cip_short_list *)image)->values,
+			     &list->values, list->count, &cip_opt_type_short);
+}
+
+static int cip_short_list_load(const cip_cache_loader *loader, void *value)
+{
+	cip_short_list *list;
+
+	list = value;
+	return cip_list_load(loader, &list->values, list->count,
+			     &cip_opt_type_short);
 }
 
 const cip_opt_type cip_opt_type_short_list = {
@@ -112,4 +122,6 @@ const cip_opt_type cip_opt_type_short_list = {
 	.format_fn	= cip_short_list_format,
 	.free_fn	= cip_short_list_free,
 	.size		= sizeof(cip_short_list),
+	.save_fn	= cip_short_list_save,
+	.load_fn	= cip_short_list_load,
 };
@@ -23,15 +23,13 @@
 #include <stdio.h>
 #include <ctype.h>
 
-static char *cip_str_parse(cip_err_ctx *ctx, void *value, char *s,
-			   const char *delims)
+/* Finds the (unquoted) string at s; returns the remainder */
+static char *cip_str_find(cip_err_ctx *ctx, char **start, size_t *len_out,
+			  char *s, const char *delims)
 {
 	char *end, *remainder;
-	char **val;
 	size_t len;
 
-	val = value;
-
 	if (*s == '"' || *s == '\'') {
 
 		end = strchr(s + 1, *s);
@@ -65,9 +63,28 @@ static char *cip_str_parse(cip_err_ctx *ctx, void *value, char *s,
 		len = end - s + 1;
 	}
 
-	*val = malloc(len + 1);
+	*start = s;
+	*len_out = len;
+
+	return remainder;
+}
+
+static char *cip_str_parse(cip_err_ctx *ctx, void *value, char *s,
+			   const char *delims)
+{
+	char *remainder;
+	char **val;
+	size_t len;
+
+	val = value;
+
+	remainder = cip_str_find(ctx, &s, &len, s, delims);
+	if (remainder == NULL)
+		return NULL;
+
+	*val = cip_malloc(len + 1);
 	if (*val == NULL) {
-		cip_err(ctx, "%m");
+		cip_err(ctx, "%s", strerror(ENOMEM));
 		return NULL;
 	}
 
@@ -82,12 +99,48 @@ static char *cip_string_parse(cip_err_ctx *ctx, void *value, char *s)
 	return cip_str_parse(ctx, value, s, ";#");
 }
 
-static int cip_string_format(cip_err_ctx *ctx, char *buf, size_t size,
-			     const void *value)
+/* Does s need quotes to parse back as itself? */
+static int cip_str_needs_quotes(const char *s, size_t len, const char *delims)
+{
+	if (len == 0 || isspace(s[0]) || isspace(s[len - 1]) ||
+			s[0] == '"' || s[0] == '\'') {
+		return 1;
+	}
+
+	for (; *delims != 0; ++delims) {
+		if (memchr(s, *delims, len) != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* There are no escapes, so a string with both kinds of quote goes as is */
+static int cip_str_format(cip_err_ctx *ctx, char *buf, size_t size,
+			  const char *s, size_t len, const char *delims)
 {
-	int ret;
+	int quote, ret;
+
+	if (!cip_str_needs_quotes(s, len, delims))
+		return cip_format_str(buf, size, s, len);
 
-	ret = snprintf(buf, size, "%s", *(char **)value);
+	if (memchr(s, '"', len) == NULL)
+		quote = '"';
+	else if (memchr(s, '\'', len) == NULL)
+		quote = '\'';
+	else
+		return cip_format_str(buf, size, s, len);
+
+	if (len + 2 < size) {
+		buf[0] = quote;
+		memcpy(buf + 1, s, len);
+		buf[len + 1] = quote;
+		buf[len + 2] = 0;
+		return len + 2;
+	}
+
+	/* Truncated */
+	ret = snprintf(buf, size, "%c%.*s%c", quote, (int)len, s, quote);
 	if (ret < 0) {
 		cip_err(ctx, "%m");
 		return -1;
@@ -96,9 +149,39 @@ static int cip_string_format(cip_err_ctx *ctx, char *buf, size_t size,
 	return ret;
 }
 
+static int cip_string_format(cip_err_ctx *ctx, char *buf, size_t size,
+			     const void *value)
+{
+	const char *s;
+
+	s = *(char *const *)value;
+	return cip_str_format(ctx, buf, size, s, strlen(s), ";#");
+}
+
 static void cip_string_free(void *value)
 {
-	free(*(char **)value);
+	cip_free(*(char **)value);
+}
+
+static int cip_string_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+			   void *image, const void *value)
+{
+	const char *s;
+	size_t offset;
+
+	s = *(char *const *)value;
+
+	offset = cip_cache_put(ctx, writer, s, strlen(s) + 1);
+	if (offset == 0)
+		return -1;
+
+	cip_cache_ref(image, offset);
+	return 0;
+}
+
+static int cip_string_load(const cip_cache_loader *loader, void *value)
+{
+	return cip_cache_load_str(loader, value);
 }
 
 const cip_opt_type cip_opt_type_string = {
@@ -107,6 +190,8 @@ const cip_opt_type cip_opt_type_string = {
 	.format_fn	= cip_string_format,
 	.free_fn	= cip_string_free,
 	.size		= sizeof(char *),
+	.save_fn	= cip_string_save,
+	.load_fn	= cip_string_load,
 };
 
 static char *cip_str_mem_parse(cip_err_ctx *ctx, void *value, char *s)
@@ -114,12 +199,23 @@ static char *cip_str_mem_parse(cip_err_ctx *ctx, void *value, char *s)
 	return cip_str_parse(ctx, value, s, ",;#");
 }
 
+static int cip_str_mem_format(cip_err_ctx *ctx, char *buf, size_t size,
+			      const void *value)
+{
+	const char *s;
+
+	s = *(char *const *)value;
+	return cip_str_format(ctx, buf, size, s, strlen(s), ",;#");
+}
+
 static const cip_opt_type cip_opt_type_str_mem = {
 	.name		= "string list member",
 	.parse_fn	= cip_str_mem_parse,
-	.format_fn	= cip_string_format,
+	.format_fn	= cip_str_mem_format,
 	.free_fn	= cip_string_free,
 	.size		= sizeof(char *),
+	.save_fn	= cip_string_save,
+	.load_fn	= cip_string_load,
 };
 
 static char *cip_str_list_parse(cip_err_ctx *ctx, void *value, char *s)
@@ -155,9 +251,29 @@ static void cip_str_list_free(void *value)
 	list = value;
 
 	for (i = 0; i < list->count; ++i)
-		free(list->values[i]);
+		cip_free(list->values[i]);
 
-	free(list->values);
+	cip_free(list->values);
+}
+
+static int cip_str_list_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+			     void *image, const void *value)
+{
+	const cip_str_list *list;
+
+	list = value;
+	return cip_list_save(ctx, writer, &((cip_str_list *)image)->values,
+			     &list->values, list->count,
+			     &cip_opt_type_str_mem);
+}
+
+static int cip_str_list_load(const cip_cache_loader *loader, void *value)
+{
+	cip_str_list *list;
+
+	list = value;
+	return cip_list_load(loader, &list->values, list->count,
+			     &cip_opt_type_str_mem);
 }
 
 const cip_opt_type cip_opt_type_str_list = {
@@ -166,4 +282,167 @@ const cip_opt_type cip_opt_type_str_list = {
 	.format_fn	= cip_str_list_format,
 	.free_fn	= cip_str_list_free,
 	.size		= sizeof(cip_str_list),
+	.save_fn	= cip_str_list_save,
+	.load_fn	= cip_str_list_load,
+};
+
+/*
+ * String slices point into the parsed text (or the cache image) instead of
+ * being copied, so they have nothing to free.
+ */
+
+static char *cip_slice_parse(cip_err_ctx *ctx, void *value, char *s,
+			     const char *delims)
+{
+	cip_str_slice *slice;
+	char *remainder;
+	size_t len;
+
+	slice = value;
+
+	remainder = cip_str_find(ctx, &s, &len, s, delims);
+	if (remainder == NULL)
+		return NULL;
+
+	slice->start = cip_value_source(s);
+	if (slice->start == NULL) {
+		cip_err(ctx, "%s", strerror(ENOMEM));
+		return NULL;
+	}
+
+	slice->len = len;
+
+	return remainder;
+}
+
+static char *cip_str_slice_parse(cip_err_ctx *ctx, void *value, char *s)
+{
+	return cip_slice_parse(ctx, value, s, ";#");
+}
+
+static int cip_str_slice_format(cip_err_ctx *ctx, char *buf, size_t size,
+				const void *value)
+{
+	const cip_str_slice *slice;
+
+	slice = value;
+	return cip_str_format(ctx, buf, size, slice->start, slice->len, ";#");
+}
+
+static int cip_str_slice_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+			      void *image, const void *value)
+{
+	const cip_str_slice *slice;
+	size_t offset;
+
+	slice = value;
+
+	/* The cache never returns offset 0, even for an empty slice */
+	offset = cip_cache_put(ctx, writer, slice->start, slice->len);
+	if (offset == 0)
+		return -1;
+
+	cip_cache_ref(&((cip_str_slice *)image)->start, offset);
+	return 0;
+}
+
+static int cip_str_slice_load(const cip_cache_loader *loader, void *value)
+{
+	cip_str_slice *slice;
+
+	slice = value;
+	return cip_cache_load_data(loader, &slice->start, slice->len);
+}
+
+const cip_opt_type cip_opt_type_str_slice = {
+	.name		= "string slice",
+	.parse_fn	= cip_str_slice_parse,
+	.format_fn	= cip_str_slice_format,
+	.size		= sizeof(cip_str_slice),
+	.save_fn	= cip_str_slice_save,
+	.load_fn	= cip_str_slice_load,
+};
+
+static char *cip_slice_mem_parse(cip_err_ctx *ctx, void *value, char *s)
+{
+	return cip_slice_parse(ctx, value, s, ",;#");
+}
+
+static int cip_slice_mem_format(cip_err_ctx *ctx, char *buf, size_t size,
+				const void *value)
+{
+	const cip_str_slice *slice;
+
+	slice = value;
+	return cip_str_format(ctx, buf, size, slice->start, slice->len,
+			      ",;#");
+}
+
+static const cip_opt_type cip_opt_type_slice_mem = {
+	.name		= "string slice list member",
+	.parse_fn	= cip_slice_mem_parse,
+	.format_fn	= cip_slice_mem_format,
+	.size		= sizeof(cip_str_slice),
+	.save_fn	= cip_str_slice_save,
+	.load_fn	= cip_str_slice_load,
+};
+
+static char *cip_slice_list_parse(cip_err_ctx *ctx, void *value, char *s)
+{
+	cip_slice_list *list;
+	char *remainder;
+
+	list = value;
+
+	list->values = cip_list_parse(&remainder, &list->count, ctx, s,
+				      &cip_opt_type_slice_mem);
+	if (list->values == NULL)
+		return NULL;
+	else
+		return remainder;
+}
+
+static int cip_slice_list_format(cip_err_ctx *ctx, char *buf, size_t size,
+				 const void *value)
+{
+	const cip_slice_list *list;
+
+	list = value;
+	return cip_list_format(ctx, buf, size, list->values, list->count,
+			       &cip_opt_type_slice_mem);
+}
+
+static void cip_slice_list_free(void *value)
+{
+	cip_free(((cip_slice_list *)value)->values);
+}
+
+static int cip_slice_list_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+			       void *image, const void *value)
+{
+	const cip_slice_list *list;
+
+	list = value;
+	return cip_list_save(ctx, writer, &((cip_slice_list *)image)->values,
+			     &list->values, list->count,
+			     &cip_opt_type_slice_mem);
+}
+
+static int cip_slice_list_load(const cip_cache_loader *loader, void *value)
+{
+	cip_slice_list *list;
+
+	list = value;
+	return cip_list_load(loader, &list->values, list->count,
+			     &cip_opt_type_slice_mem);
+}
+
+const cip_opt_type cip_opt_type_slice_list = {
+	.name		= "list of string slices",
+	.parse_fn	= cip_slice_list_parse,
+	.format_fn	= cip_slice_list_format,
+	.free_fn	= cip_slice_list_free,
+	.size		= sizeof(cip_slice_list),
+	.save_fn	= cip_slice_list_save,
+	.load_fn	= cip_slice_list_load,
 };
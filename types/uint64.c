@@ -0,0 +1,117 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include "../libcip.h"
+
+#include <errno.h>
+
+static char *cip_uint64_parse(cip_err_ctx *ctx, void *value, char *s)
+{
+	char *endptr;
+	uint64_t val;
+
+	endptr = cip_parse_u64(s, &val);
+	if (endptr == NULL && errno == ERANGE) {
+		cip_err(ctx, "Failed to parse '%.10s' as an unsigned 64-bit "
+			"integer: %m", s);
+		return NULL;
+	}
+
+	if (endptr == NULL) {
+		cip_err(ctx, "Failed to parse '%.10s' as an unsigned 64-bit "
+			"integer", s);
+		return NULL;
+	}
+
+	*(uint64_t *)value = val;
+	return endptr;
+}
+
+static int cip_uint64_format(cip_err_ctx *ctx __attribute__((unused)),
+			     char *buf, size_t size, const void *value)
+{
+	return cip_format_u64(buf, size, *(const uint64_t *)value);
+}
+
+const cip_opt_type cip_opt_type_uint64 = {
+	.name		= "unsigned 64-bit integer",
+	.parse_fn	= cip_uint64_parse,
+	.format_fn	= cip_uint64_format,
+	.free_fn	= 0,
+	.size		= sizeof(uint64_t),
+};
+
+static char *cip_uint64_list_parse(cip_err_ctx *ctx, void *value, char *s)
+{
+	cip_uint64_list *list;
+	char *remainder;
+
+	list = value;
+
+	list->values = cip_list_parse(&remainder, &list->count, ctx, s,
+				      &cip_opt_type_uint64);
+	if (list->values == NULL)
+		return NULL;
+	else
+		return remainder;
+}
+
+static int cip_uint64_list_format(cip_err_ctx *ctx, char *buf, size_t size,
+				  const void *value)
+{
+	const cip_uint64_list *list;
+
+	list = value;
+	return cip_list_format(ctx, buf, size, list->values, list->count,
+			       &cip_opt_type_uint64);
+}
+
+static void cip_uint64_list_free(void *value)
+{
+	cip_uint64_list *list;
+
+	list = value;
+	cip_free(list->values);
+}
+
+static int cip_uint64_list_save(cip_err_ctx *ctx, cip_cache_writer *writer,
+				void *image, const void *value)
+{
+	const cip_uint64_list *list;
+
+	list = value;
+	return cip_list_save(ctx, writer, &((cip_uint64_list *)image)->values,
+			     &list->values, list->count, &cip_opt_type_uint64);
+}
+
+static int cip_uint64_list_load(const cip_cache_loader *loader, void *value)
+{
+	cip_uint64_list *list;
+
+	list = value;
+	return cip_list_load(loader, &list->values, list->count,
+			     &cip_opt_type_uint64);
+}
+
+const cip_opt_type cip_opt_type_uint64_list = {
+	.name		= "list of unsigned 64-bit integers",
+	.parse_fn	= cip_uint64_list_parse,
+	.format_fn	= cip_uint64_list_format,
+	.free_fn	= cip_uint64_list_free,
+	.size		= sizeof(cip_uint64_list),
+	.save_fn	= cip_uint64_list_save,
+	.load_fn	= cip_uint64_list_load,
+};
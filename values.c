@@ -19,6 +19,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 /*
  * Type-safe AVL tree putters (const/non-const getters are in header files)
@@ -57,20 +58,58 @@ static inline int cip_ini_sect_put(cip_ini_file *file, cip_ini_sect *sect)
 	return ret;
 }
 
+/* Allocates a section with num_slots empty value slots */
+static cip_ini_sect *cip_ini_sect_alloc(cip_err_ctx *ctx, unsigned num_slots)
+{
+	cip_ini_sect *new;
+
+	new = cip_malloc(sizeof *new + num_slots * sizeof *new->slots);
+	if (new == NULL)
+		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+
+	new->num_slots = num_slots;
+	new->index = NULL;
+	memset(new->slots, 0, num_slots * sizeof *new->slots);
+
+	return new;
+}
+
 /*
  * Internal API
  */
 
 cip_ini_file *cip_ini_file_new(cip_err_ctx *ctx, const cip_file_schema *schema)
 {
+	struct cip_arena *arena;
 	cip_ini_file *new;
 
-	new = malloc(sizeof *new);
-	if (new == NULL)
-		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+	if (schema->flags & CIP_FILE_ARENA) {
+
+		arena = cip_arena_new(ctx);
+		if (arena == NULL)
+			return NULL;
+
+		/* The first block always has room */
+		new = cip_arena_alloc(arena, sizeof *new);
+	}
+	else {
+		arena = NULL;
+
+		new = malloc(sizeof *new);
+		if (new == NULL)
+			return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+	}
 
 	new->schema = schema;
+	new->arena = arena;
 	new->sections = NULL;
+	new->image = NULL;
+	new->image_size = 0;
+	new->flags = 0;
+	new->source = NULL;
+	new->source_size = 0;
+	new->text = NULL;
+	new->index = NULL;
 
 	return new;
 }
@@ -80,12 +119,18 @@ cip_ini_sect *cip_ini_sect_new(cip_err_ctx *ctx, cip_ini_file *file,
 {
 	cip_ini_sect *new;
 
-	new = malloc(sizeof *new);
+	if (schema->flags & CIP_SECT_MULTIPLE)
+		new = cip_ini_sect_alloc(ctx, 0);
+	else
+		new = cip_ini_sect_alloc(ctx, schema->num_opts);
 	if (new == NULL)
-		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+		return NULL;
 
 	new->node.name = schema->node.name;
 	new->schema = schema;
+	new->line = 0;
+	new->hash = 0;
+	new->flags = 0;
 
 	if (schema->flags & CIP_SECT_MULTIPLE)
 		new->instances = NULL;
@@ -93,7 +138,7 @@ cip_ini_sect *cip_ini_sect_new(cip_err_ctx *ctx, cip_ini_file *file,
 		new->values = NULL;
 
 	if (cip_ini_sect_put(file, new) == -1) {
-		free(new);
+		cip_free(new);
 		cip_err(ctx, "Duplicate section [%s]", schema->node.name);
 		return NULL;
 	}
@@ -106,16 +151,19 @@ cip_ini_sect *cip_ini_inst_new(cip_err_ctx *ctx, cip_ini_sect *sect,
 {
 	cip_ini_sect *new;
 
-	new = malloc(sizeof *new);
+	new = cip_ini_sect_alloc(ctx, schema->num_opts);
 	if (new == NULL)
-		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+		return NULL;
 
 	new->node.name = id;
 	new->schema = schema;
 	new->values = NULL;
+	new->line = 0;
+	new->hash = 0;
+	new->flags = 0;
 
 	if (cip_ini_inst_put(sect, new) == -1) {
-		free(new);
+		cip_free(new);
 		return cip_err_ptr(ctx, "Duplicate section [%s:%s]",
 				   schema->node.name, id);
 	}
@@ -123,23 +171,32 @@ cip_ini_sect *cip_ini_inst_new(cip_err_ctx *ctx, cip_ini_sect *sect,
 	return new;
 }
 
-int cip_ini_value_new(cip_err_ctx *ctx, cip_ini_sect *sect,
-		      const cip_opt_schema *schema, const void *value)
+cip_ini_value *cip_ini_value_alloc(cip_err_ctx *ctx,
+				   const cip_opt_schema *schema)
 {
 	cip_ini_value *new;
 
-	new = malloc(sizeof *new + schema->type->size);
+	new = cip_malloc(sizeof *new + schema->type->size);
 	if (new == NULL)
-		return cip_err_int(ctx, "%s", strerror(ENOMEM));
+		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
 
 	new->node.name = schema->node.name;
 	new->schema = schema;
 	new->post_parse_done = 0;
-	memcpy(new->value, value, schema->type->size);
 
-	if (cip_ini_value_put(sect, new) == -1) {
+	return new;
+}
+
+int cip_ini_value_add(cip_err_ctx *ctx, cip_ini_sect *sect,
+		      cip_ini_value *value)
+{
+	const cip_opt_schema *schema;
+
+	schema = value->schema;
+
+	if (cip_ini_value_put(sect, value) == -1) {
 
-		free(new);
+		cip_free(value);
 		if (sect->schema->flags & CIP_SECT_MULTIPLE) {
 			cip_err(ctx, "Duplicate value [%s:%s]:%s",
 				sect->schema->node.name, sect->node.name,
@@ -153,9 +210,81 @@ int cip_ini_value_new(cip_err_ctx *ctx, cip_ini_sect *sect,
 		return -1;
 	}
 
+	sect->slots[schema->slot] = value;
 	return 0;
 }
 
+int cip_ini_value_new(cip_err_ctx *ctx, cip_ini_sect *sect,
+		      const cip_opt_schema *schema, const void *value)
+{
+	cip_ini_value *new;
+
+	new = cip_ini_value_alloc(ctx, schema);
+	if (new == NULL)
+		return -1;
+
+	memcpy(new->value, value, schema->type->size);
+
+	return cip_ini_value_add(ctx, sect, new);
+}
+
+/* Shares old's values (and ID); see cip_reparse_buffer() */
+
+static cip_ini_sect *cip_ini_borrow(cip_err_ctx *ctx, const cip_ini_sect *old)
+{
+	cip_ini_sect *new;
+
+	new = cip_ini_sect_alloc(ctx, old->num_slots);
+	if (new == NULL)
+		return NULL;
+
+	memcpy(new->slots, old->slots, old->num_slots * sizeof *old->slots);
+	new->node.name = old->node.name;
+	new->schema = old->schema;
+	new->values = old->values;
+	new->line = old->line;
+	new->hash = old->hash;
+	new->flags = CIP_INI_BORROWED;
+
+	return new;
+}
+
+cip_ini_sect *cip_ini_sect_borrow(cip_err_ctx *ctx, cip_ini_file *file,
+				  const cip_ini_sect *old)
+{
+	cip_ini_sect *new;
+
+	new = cip_ini_borrow(ctx, old);
+	if (new == NULL)
+		return NULL;
+
+	if (cip_ini_sect_put(file, new) == -1) {
+		cip_free(new);
+		return cip_err_ptr(ctx, "Duplicate section [%s]",
+				   old->node.name);
+	}
+
+	return new;
+}
+
+cip_ini_sect *cip_ini_inst_borrow(cip_err_ctx *ctx, cip_ini_sect *sect,
+				  const cip_ini_sect *old)
+{
+	cip_ini_sect *new;
+
+	new = cip_ini_borrow(ctx, old);
+	if (new == NULL)
+		return NULL;
+
+	if (cip_ini_inst_put(sect, new) == -1) {
+		cip_free(new);
+		return cip_err_ptr(ctx, "Duplicate section [%s:%s]",
+				   old->schema->node.name, old->node.name);
+	}
+
+	return new;
+}
+
 static void cip_ini_value_free(struct cip_avl_node *node)
 {
 	const void *default_value;
@@ -179,6 +308,9 @@ static void cip_ini_inst_free(struct cip_avl_node *node)
 	cip_ini_sect *inst;
 
 	inst = (cip_ini_sect *)node;
+	if (inst->flags & CIP_INI_BORROWED)
+		return;
+
 	free(inst->node.name);
 
 	if (inst->values != NULL) {
@@ -198,7 +330,7 @@ static void cip_ini_sect_free(struct cip_avl_node *node)
 		cip_avl_free((struct cip_avl_node *)sect->instances,
 			     cip_ini_inst_free);
 	}
-	else if (sect->values != NULL) {
+	else if (sect->values != NULL && !(sect->flags & CIP_INI_BORROWED)) {
 		cip_avl_free((struct cip_avl_node *)sect->values,
 			     cip_ini_value_free);
 	}
@@ -210,10 +342,194 @@ static void cip_ini_sect_free(struct cip_avl_node *node)
 
 void cip_ini_file_free(cip_ini_file *file)
 {
-	if (file->sections != NULL) {
+	/* Everything loaded from a cache lives in the image */
+	if (file->image != NULL) {
+		munmap(file->image, file->image_size);
+	}
+	else if (file->arena == NULL && file->sections != NULL) {
 		cip_avl_free((struct cip_avl_node *)file->sections,
 			     cip_ini_sect_free);
 	}
 
-	free(file);
+	if (file->source != NULL)
+		munmap(file->source, file->source_size);
+
+	if (file->text != NULL)
+		cip_arena_free(file->text);
+
+	free(file->index);
+
+	/* The file itself is in its arena */
+	if (file->arena != NULL)
+		cip_arena_free(file->arena);
+	else
+		free(file);
+}
+
+const cip_ini_value *cip_ini_value_get(const cip_ini_sect *sect,
+				      const char *name)
+{
+	return cip_ini_value_get_p(sect, name);
+}
+
+const cip_ini_value *cip_ini_value_get_by_handle(const cip_ini_sect *sect,
+						int handle)
+{
+	unsigned id, slot;
+
+	id = (unsigned)handle >> CIP_HANDLE_SLOT_BITS;
+	slot = (unsigned)handle & CIP_HANDLE_SLOT_MASK;
+
+	if (handle < 0 || id != sect->schema->id || slot >= sect->num_slots) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return sect->slots[slot];
+}
+
+const cip_ini_sect *cip_ini_inst_get(const cip_ini_sect *sect,
+				     const char *name)
+{
+	return cip_ini_inst_get_p(sect, name);
+}
+
+const cip_ini_sect *cip_ini_sect_get(const cip_ini_file *file,
+				     const char *name)
+{
+	return cip_ini_sect_get_p(file, name);
+}
+
+/*
+ * Binding values into caller structs
+ */
+
+struct cip_bind_ctx {
+	cip_err_ctx *err;
+	char *config;
+	char *structs;		/* next instance struct */
+	unsigned num_arrays;	/* instance arrays allocated so far */
+};
+
+static void cip_bind_values(char *base, const cip_ini_sect *sect)
+{
+	const cip_ini_value *value;
+	unsigned i;
+
+	for (i = 0; i < sect->num_slots; ++i) {
+
+		value = sect->slots[i];
+
+		if (value != NULL && (value->schema->flags & CIP_OPT_BIND)) {
+			memcpy(base + value->schema->offset, value->value,
+			       value->schema->type->size);
+		}
+	}
+}
+
+static int cip_bind_count_cb(struct cip_avl_node *node __attribute__((unused)),
+			     void *context)
+{
+	++*(unsigned *)context;
+	return 1;
+}
+
+static int cip_bind_inst_cb(struct cip_avl_node *node, void *context)
+{
+	struct cip_bind_ctx *ctx;
+	cip_ini_sect *inst;
+
+	ctx = context;
+	inst = (cip_ini_sect *)node;
+
+	*(const char **)ctx->structs = inst->node.name;
+	cip_bind_values(ctx->structs, inst);
+	ctx->structs += inst->schema->struct_size;
+
+	return 1;
+}
+
+static int cip_bind_sect_cb(struct cip_avl_node *node, void *context)
+{
+	const cip_sect_schema *schema;
+	struct cip_bind_ctx *ctx;
+	cip_inst_array *array;
+	cip_ini_sect *sect;
+	unsigned count;
+
+	ctx = context;
+	sect = (cip_ini_sect *)node;
+	schema = sect->schema;
+
+	if (schema->struct_size == 0)
+		return 1;
+
+	if (!(schema->flags & CIP_SECT_MULTIPLE)) {
+		cip_bind_values(ctx->config + schema->offset, sect);
+		return 1;
+	}
+
+	count = 0;
+	cip_avl_foreach((struct cip_avl_node *)sect->instances,
+			cip_bind_count_cb, &count);
+
+	ctx->structs = calloc(count, schema->struct_size);
+	if (ctx->structs == NULL) {
+		cip_err(ctx->err, "%s", strerror(ENOMEM));
+		return 0;
+	}
+
+	array = (cip_inst_array *)(ctx->config + schema->offset);
+	array->structs = ctx->structs;
+	array->count = count;
+	++ctx->num_arrays;
+
+	cip_avl_foreach((struct cip_avl_node *)sect->instances,
+			cip_bind_inst_cb, ctx);
+
+	return 1;
+}
+
+/* Frees the instance arrays allocated before a failure */
+static int cip_bind_undo_cb(struct cip_avl_node *node, void *context)
+{
+	const cip_sect_schema *schema;
+	struct cip_bind_ctx *ctx;
+	cip_inst_array *array;
+
+	ctx = context;
+	schema = ((cip_ini_sect *)node)->schema;
+
+	if (ctx->num_arrays == 0)
+		return 0;
+
+	if (schema->struct_size != 0 && (schema->flags & CIP_SECT_MULTIPLE)) {
+		array = (cip_inst_array *)(ctx->config + schema->offset);
+		free(array->structs);
+		array->structs = NULL;
+		array->count = 0;
+		--ctx->num_arrays;
+	}
+
+	return 1;
+}
+
+int cip_ini_file_bind(cip_err_ctx *ctx, const cip_ini_file *file,
+		      void *config)
+{
+	struct cip_bind_ctx bind;
+	struct cip_avl_node *tree;
+
+	bind.err = ctx;
+	bind.config = config;
+	bind.num_arrays = 0;
+
+	tree = (struct cip_avl_node *)file->sections;
+
+	if (!cip_avl_foreach(tree, cip_bind_sect_cb, &bind)) {
+		cip_avl_foreach(tree, cip_bind_undo_cb, &bind);
+		return -1;
+	}
+
+	return 0;
 }
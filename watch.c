@@ -0,0 +1,391 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+/*
+ * Watching for changes.  A file is watched through its directory, so that
+ * saves which replace it (by renaming a new file over it) are seen as well as
+ * writes to it.  Each change (re)starts a timer, and the file (or directory)
+ * is only reparsed once the timer runs out, so a burst of changes means one
+ * reload.  A background thread waits for inotify events and for an eventfd
+ * that tells it to stop.  If the directory itself goes away (or is renamed),
+ * its watch is gone too; the thread reloads (which reports the failure) and
+ * then tries to watch the path again every CIP_WATCH_RETRY_MS until it can.
+ */
+
+#define CIP_WATCH_MASK	(IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | \
+			 IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			 IN_DELETE_SELF | IN_MOVE_SELF)
+
+#define CIP_WATCH_RETRY_MS	1000
+
+struct cip_watcher {
+	char *path;
+	char *dir_name;		/* what inotify watches */
+	const char *base_name;	/* in dir_name; NULL if watching it */
+	char *suffix;
+	const cip_file_schema *schema;
+	int (*warning_fn)(const char *warn_msg);
+	void (*file_fn)(cip_ini_file *file, cip_err_ctx *err, void *data);
+	void (*dir_fn)(cip_parse_result *results, unsigned count,
+		       cip_err_ctx *err, void *data);
+	void *data;
+	unsigned delay_ms;
+	unsigned threads;
+	int inotify_fd;
+	int wd;			/* -1 while the directory is missing */
+	int stop_fd;
+	int stopped;		/* freed by reload_fn */
+	cip_err_ctx err;
+	pthread_t thread;
+};
+
+/* Does the event concern the file (or one of the directory's files)? */
+static int cip_watch_match(const struct cip_watcher *w,
+			   const struct inotify_event *event)
+{
+	size_t name_len, suffix_len;
+
+	/* The directory itself went away, or events were lost */
+	if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_Q_OVERFLOW))
+		return 1;
+
+	if (event->len == 0)
+		return 0;
+
+	if (w->base_name != NULL)
+		return strcmp(event->name, w->base_name) == 0;
+
+	/* Same rules as cip_parse_dir() */
+	if (event->name[0] == '.' || (event->mask & IN_ISDIR))
+		return 0;
+
+	if (w->suffix == NULL)
+		return 1;
+
+	name_len = strlen(event->name);
+	suffix_len = strlen(w->suffix);
+
+	return name_len > suffix_len &&
+		strcmp(event->name + name_len - suffix_len, w->suffix) == 0;
+}
+
+/* Forgets a watch that the kernel has dropped, or that has moved away */
+static void cip_watch_lost(struct cip_watcher *w,
+			   const struct inotify_event *event)
+{
+	if (event->wd != w->wd ||
+		!(event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))) {
+		return;
+	}
+
+	if (event->mask & IN_MOVE_SELF)
+		inotify_rm_watch(w->inotify_fd, w->wd);
+
+	w->wd = -1;
+}
+
+/* Reads all pending events; returns 1 if any of them matter */
+static int cip_watch_read(struct cip_watcher *w)
+{
+	const struct inotify_event *event;
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	int changed;
+	ssize_t len;
+	char *p;
+
+	changed = 0;
+
+	while ((len = read(w->inotify_fd, buf, sizeof buf)) > 0) {
+		for (p = buf; p < buf + len; p += sizeof *event + event->len) {
+			event = (const struct inotify_event *)p;
+			if (cip_watch_match(w, event))
+				changed = 1;
+			cip_watch_lost(w, event);
+		}
+	}
+
+	return changed;
+}
+
+static void cip_watch_reload(struct cip_watcher *w)
+{
+	cip_parse_result *results;
+	cip_ini_file *file;
+	unsigned count;
+
+	if (w->base_name != NULL) {
+		file = cip_parse_file(&w->err, w->path, w->schema,
+				      w->warning_fn);
+		w->file_fn(file, &w->err, w->data);
+	}
+	else {
+		count = 0;
+		results = cip_parse_dir(&w->err, w->path, w->suffix, &count,
+					w->schema, w->warning_fn, w->threads);
+		w->dir_fn(results, count, &w->err, w->data);
+	}
+}
+
+static int64_t cip_watch_now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Everything but the thread */
+static void cip_watch_release(struct cip_watcher *w)
+{
+	if (w->stop_fd != -1)
+		close(w->stop_fd);
+
+	if (w->inotify_fd != -1)
+		close(w->inotify_fd);
+
+	cip_err_ctx_fini(&w->err);
+	free(w->path);
+	free(w->dir_name);
+	free(w->suffix);
+	free(w);
+}
+
+static void *cip_watch_thread(void *arg)
+{
+	struct pollfd fds[2];
+	struct cip_watcher *w;
+	int64_t deadline, now;
+	int timeout;
+
+	w = arg;
+	deadline = -1;		/* nothing pending */
+
+	fds[0].fd = w->inotify_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = w->stop_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+
+		/* Back again; it may have changed while it was gone */
+		if (w->wd == -1) {
+			w->wd = inotify_add_watch(w->inotify_fd, w->dir_name,
+						  CIP_WATCH_MASK);
+			if (w->wd != -1)
+				deadline = cip_watch_now_ms() + w->delay_ms;
+		}
+
+		if (deadline == -1) {
+			timeout = -1;
+		}
+		else {
+			now = cip_watch_now_ms();
+			if (now >= deadline) {
+				deadline = -1;
+				cip_watch_reload(w);
+				if (w->stopped)
+					break;
+				continue;
+			}
+			timeout = deadline - now;
+		}
+
+		if (w->wd == -1 &&
+			(timeout == -1 || timeout > CIP_WATCH_RETRY_MS)) {
+			timeout = CIP_WATCH_RETRY_MS;
+		}
+
+		if (poll(fds, 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents != 0)
+			break;
+
+		if ((fds[0].revents & POLLIN) && cip_watch_read(w))
+			deadline = cip_watch_now_ms() + w->delay_ms;
+	}
+
+	/* Nobody will join this thread */
+	if (w->stopped) {
+		pthread_detach(pthread_self());
+		cip_watch_release(w);
+	}
+
+	return NULL;
+}
+
+/* Takes care of w, whether or not it succeeds */
+static cip_watcher *cip_watch_start(cip_err_ctx *ctx, struct cip_watcher *w)
+{
+	int ret;
+
+	w->inotify_fd = -1;
+	w->stop_fd = -1;
+	cip_err_ctx_init(&w->err);
+
+	w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->inotify_fd == -1) {
+		cip_err(ctx, "inotify_init1: %m");
+		goto error;
+	}
+
+	w->wd = inotify_add_watch(w->inotify_fd, w->dir_name, CIP_WATCH_MASK);
+	if (w->wd == -1) {
+		cip_err(ctx, "%s: %m", w->dir_name);
+		goto error;
+	}
+
+	w->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (w->stop_fd == -1) {
+		cip_err(ctx, "eventfd: %m");
+		goto error;
+	}
+
+	ret = pthread_create(&w->thread, NULL, cip_watch_thread, w);
+	if (ret != 0) {
+		cip_err(ctx, "%s", strerror(ret));
+		goto error;
+	}
+
+	return w;
+
+error:
+	cip_watch_release(w);
+	return NULL;
+}
+
+/*
+ * Public API
+ */
+
+cip_watcher *cip_watch_file(cip_err_ctx *ctx, const char *file_name,
+			    const cip_file_schema *schema,
+			    int (*warning_fn)(const char *warn_msg),
+			    void (*reload_fn)(cip_ini_file *file,
+					      cip_err_ctx *err, void *data),
+			    void *data, unsigned delay_ms)
+{
+	struct cip_watcher *w;
+	const char *slash;
+
+	w = calloc(1, sizeof *w);
+	if (w == NULL)
+		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+
+	w->path = strdup(file_name);
+	slash = strrchr(file_name, '/');
+
+	if (slash == NULL)
+		w->dir_name = strdup(".");
+	else if (slash == file_name)
+		w->dir_name = strdup("/");
+	else
+		w->dir_name = strndup(file_name, slash - file_name);
+
+	if (w->path == NULL || w->dir_name == NULL) {
+		free(w->path);
+		free(w->dir_name);
+		free(w);
+		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+	}
+
+	if (slash == NULL)
+		w->base_name = w->path;
+	else
+		w->base_name = w->path + (slash - file_name) + 1;
+
+	w->schema = schema;
+	w->warning_fn = warning_fn;
+	w->file_fn = reload_fn;
+	w->data = data;
+	w->delay_ms = delay_ms;
+
+	return cip_watch_start(ctx, w);
+}
+
+cip_watcher *cip_watch_dir(cip_err_ctx *ctx, const char *dir_name,
+			   const char *suffix, const cip_file_schema *schema,
+			   int (*warning_fn)(const char *warn_msg),
+			   unsigned threads,
+			   void (*reload_fn)(cip_parse_result *results,
+					     unsigned count, cip_err_ctx *err,
+					     void *data),
+			   void *data, unsigned delay_ms)
+{
+	struct cip_watcher *w;
+
+	w = calloc(1, sizeof *w);
+	if (w == NULL)
+		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+
+	w->path = strdup(dir_name);
+	w->dir_name = strdup(dir_name);
+	w->suffix = (suffix != NULL) ? strdup(suffix) : NULL;
+
+	if (w->path == NULL || w->dir_name == NULL ||
+			(suffix != NULL && w->suffix == NULL)) {
+		free(w->path);
+		free(w->dir_name);
+		free(w->suffix);
+		free(w);
+		return cip_err_ptr(ctx, "%s", strerror(ENOMEM));
+	}
+
+	w->schema = schema;
+	w->warning_fn = warning_fn;
+	w->threads = threads;
+	w->dir_fn = reload_fn;
+	w->data = data;
+	w->delay_ms = delay_ms;
+
+	return cip_watch_start(ctx, w);
+}
+
+void cip_watcher_free(cip_watcher *watcher)
+{
+	uint64_t one;
+
+	/* From reload_fn; the thread cleans up once it returns */
+	if (pthread_equal(pthread_self(), watcher->thread)) {
+		watcher->stopped = 1;
+		return;
+	}
+
+	one = 1;
+
+	/* Can't fail unless the counter overflows */
+	if (write(watcher->stop_fd, &one, sizeof one) == sizeof one)
+		pthread_join(watcher->thread, NULL);
+
+	cip_watch_release(watcher);
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright 2014 Ian Pilcher <arequipeno@gmail.com>
+ *
+ * This program is free software.  You can redistribute it or modify it under
+ * the terms of version 2 of the GNU General Public License (GPL), as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY -- without even the implied warranty of MERCHANTIBILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the text of the GPL for more details.
+ *
+ * Version 2 of the GNU General Public License is available at:
+ *
+ *   http://www.gnu.org/licenses/old-licenses/gpl-2.0.html
+ */
+
+#include "libcip.h"
+#include "libcip_p.h"
+
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+/*
+ * Writing files.  The whole file is formatted into one growing buffer (each
+ * value by its type's format_fn, straight into the buffer), which is then
+ * written with a single fwrite().
+ */
+
+struct cip_writer {
+	cip_err_ctx *err;
+	char *buf;
+	size_t len;
+	size_t size;
+	int first;		/* no section written yet */
+};
+
+/* Makes room for n more bytes (plus a NUL) */
+static int cip_writer_reserve(struct cip_writer *w, size_t n)
+{
+	size_t new_size;
+	char *new_buf;
+
+	if (n < w->size - w->len)
+		return 0;
+
+	if (n > SIZE_MAX / 2 - w->len)
+		return cip_err_int(w->err, "%s", strerror(ENOMEM));
+
+	new_size = (w->size != 0) ? w->size : 4096;
+	while (new_size <= w->len + n)
+		new_size *= 2;
+
+	new_buf = realloc(w->buf, new_size);
+	if (new_buf == NULL)
+		return cip_err_int(w->err, "%s", strerror(ENOMEM));
+
+	w->buf = new_buf;
+	w->size = new_size;
+	return 0;
+}
+
+static int cip_writer_put(struct cip_writer *w, const char *s, size_t len)
+{
+	if (cip_writer_reserve(w, len) == -1)
+		return -1;
+
+	memcpy(w->buf + w->len, s, len);
+	w->len += len;
+	return 0;
+}
+
+static int cip_writer_puts(struct cip_writer *w, const char *s)
+{
+	return cip_writer_put(w, s, strlen(s));
+}
+
+static int cip_write_value(struct cip_writer *w, const cip_ini_value *value)
+{
+	const cip_opt_type *type;
+	int ret;
+
+	type = value->schema->type;
+
+	if (cip_writer_puts(w, value->node.name) == -1 ||
+			cip_writer_put(w, " = ", 3) == -1) {
+		return -1;
+	}
+
+	/* Format straight into the buffer; try again if it didn't fit */
+	ret = type->format_fn(w->err, w->buf + w->len, w->size - w->len,
+			      value->value);
+	if (ret >= 0 && (size_t)ret >= w->size - w->len) {
+		if (cip_writer_reserve(w, ret) == -1)
+			return -1;
+		ret = type->format_fn(w->err, w->buf + w->len,
+				      w->size - w->len, value->value);
+	}
+
+	if (ret < 0)
+		return -1;
+
+	w->len += ret;
+
+	return cip_writer_put(w, "\n", 1);
+}
+
+static int cip_write_header(struct cip_writer *w, const char *title,
+			    const char *id)
+{
+	if (!w->first && cip_writer_put(w, "\n", 1) == -1)
+		return -1;
+
+	w->first = 0;
+
+	if (cip_writer_put(w, "[", 1) == -1 ||
+			cip_writer_puts(w, title) == -1) {
+		return -1;
+	}
+
+	if (id != NULL) {
+		if (cip_writer_put(w, ":", 1) == -1 ||
+				cip_writer_puts(w, id) == -1) {
+			return -1;
+		}
+	}
+
+	return cip_writer_put(w, "]\n", 2);
+}
+
+static int cip_write_values(struct cip_writer *w, const cip_ini_value *values)
+{
+	struct cip_avl_iter iter;
+	struct cip_avl_node *node;
+
+	cip_avl_iter_init(&iter, (struct cip_avl_node *)values);
+
+	while ((node = cip_avl_iter_next(&iter)) != NULL) {
+		if (cip_write_value(w, (cip_ini_value *)node) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int cip_write_inst(struct cip_avl_node *node, void *context)
+{
+	const cip_ini_sect *inst;
+	struct cip_writer *w;
+
+	inst = (cip_ini_sect *)node;
+	w = context;
+
+	if (cip_write_header(w, inst->schema->node.name, node->name) == -1)
+		return 0;
+
+	return cip_write_values(w, inst->values) == 0;
+}
+
+static int cip_write_sect(struct cip_avl_node *node, void *context)
+{
+	const cip_ini_sect *sect;
+	struct cip_writer *w;
+
+	sect = (cip_ini_sect *)node;
+	w = context;
+
+	if (sect->schema->flags & CIP_SECT_MULTIPLE) {
+		return cip_avl_foreach((struct cip_avl_node *)sect->instances,
+				       cip_write_inst, w);
+	}
+
+	if (cip_write_header(w, node->name, NULL) == -1)
+		return 0;
+
+	return cip_write_values(w, sect->values) == 0;
+}
+
+static int cip_write_file(struct cip_writer *w, cip_err_ctx *ctx,
+			  const cip_ini_file *file)
+{
+	w->err = ctx;
+	w->buf = NULL;
+	w->len = 0;
+	w->size = 0;
+	w->first = 1;
+
+	if (cip_writer_reserve(w, 0) == -1)
+		return -1;
+
+	if (file->sections != NULL &&
+			cip_avl_foreach((struct cip_avl_node *)file->sections,
+					cip_write_sect, w) == 0) {
+		free(w->buf);
+		return -1;
+	}
+
+	w->buf[w->len] = 0;
+	return 0;
+}
+
+/*
+ * Public API
+ */
+
+int cip_format_str(char *buf, size_t size, const char *s, size_t len)
+{
+	size_t n;
+
+	if (size != 0) {
+		n = (len < size) ? len : size - 1;
+		memcpy(buf, s, n);
+		buf[n] = 0;
+	}
+
+	return (len <= INT_MAX) ? (int)len : INT_MAX;
+}
+
+char *cip_ini_file_format(cip_err_ctx *ctx, const cip_ini_file *file,
+			  size_t *len)
+{
+	struct cip_writer w;
+
+	if (cip_write_file(&w, ctx, file) == -1)
+		return NULL;
+
+	*len = w.len;
+	return w.buf;
+}
+
+int cip_ini_file_write(cip_err_ctx *ctx, const cip_ini_file *file,
+		       FILE *out)
+{
+	struct cip_writer w;
+	size_t written;
+
+	if (cip_write_file(&w, ctx, file) == -1)
+		return -1;
+
+	written = fwrite(w.buf, 1, w.len, out);
+	free(w.buf);
+
+	if (written != w.len || ferror(out))
+		return cip_err_int(ctx, "Error writing INI file: %m");
+
+	return 0;
+}